@@ -37,8 +37,124 @@
 
 #include "GPIO.h"
 #include "sbpd.h"
+#include "alloc.h"
 
 #include <wiringPi.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+//
+//
+//  Edge interrupts
+//  Pins are exported and configured through sysfs directly instead of
+//  wiringPiISR(), which runs the "gpio" utility and starts a thread per pin.
+//  A single thread waits for edges on all pins.
+//
+//
+#define max_irqs (max_buttons + 2 * max_encoders)
+
+struct irq {
+    int pin;
+    void (*handler)(void);
+};
+
+static struct irq irqs[max_irqs];
+static struct pollfd irq_fds[max_irqs];
+static int numberofirqs = 0;
+static pthread_t irq_thread;
+static bool irq_thread_running = false;
+
+//
+//  Write a string to a sysfs file
+//
+static bool write_sysfs(const char * path, const char * value) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return false;
+    ssize_t size = write(fd, value, strlen(value));
+    close(fd);
+    return size == (ssize_t)strlen(value);
+}
+
+//
+//  Register an edge interrupt handler for a pin
+//  Parameters:
+//      pin: GPIO-Pin used in BCM numbering scheme
+//      edge: INT_EDGE_RISING, INT_EDGE_FALLING or INT_EDGE_BOTH
+//      handler: called on the interrupt thread
+//  Returns: success flag
+//
+static bool register_irq(int pin, int edge, void (*handler)(void)) {
+    if (numberofirqs == max_irqs) {
+        logerr("Maximum number of interrupts exceeded: %i", max_irqs);
+        return false;
+    }
+    char path[64];
+    char value[8];
+    snprintf(value, sizeof(value), "%d", pin);
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/edge", pin);
+    //
+    //  Export unless already exported
+    //
+    if (access(path, F_OK))
+        write_sysfs("/sys/class/gpio/export", value);
+    const char * edgeName = (edge == INT_EDGE_FALLING) ? "falling" :
+                            (edge == INT_EDGE_RISING) ? "rising" : "both";
+    if (!write_sysfs(path, edgeName)) {
+        logerr("Could not set edge for GPIO %d", pin);
+        return false;
+    }
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", pin);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        logerr("Could not open value for GPIO %d", pin);
+        return false;
+    }
+    char dummy[4];
+    if (read(fd, dummy, sizeof(dummy)) < 0)     // clear pending interrupt
+        logdebug("Initial read of GPIO %d failed", pin);
+    irqs[numberofirqs].pin = pin;
+    irqs[numberofirqs].handler = handler;
+    irq_fds[numberofirqs].fd = fd;
+    irq_fds[numberofirqs].events = POLLPRI | POLLERR;
+    numberofirqs++;
+    return true;
+}
+
+//
+//  Remove the last registered interrupt, when a control can't be set up
+//  Only before the interrupt thread is started
+//
+static void unregister_last_irq() {
+    numberofirqs--;
+    close(irq_fds[numberofirqs].fd);
+}
+
+//
+//  Interrupt thread
+//  Waits for edges on all registered pins and calls the handlers
+//
+static void * irq_loop(void * arg) {
+    char dummy[4];
+    alloc_scope(SBPD_alloc_gpio);
+    for (;;) {
+        if (poll(irq_fds, numberofirqs, -1) <= 0)
+            continue;
+        for (int cnt = 0; cnt < numberofirqs; cnt++) {
+            if (!(irq_fds[cnt].revents & (POLLPRI | POLLERR)))
+                continue;
+            lseek(irq_fds[cnt].fd, 0, SEEK_SET);
+            if (read(irq_fds[cnt].fd, dummy, sizeof(dummy)) < 0)
+                continue;
+            irqs[cnt].handler();
+        }
+    }
+    return NULL;
+}
 
 //
 //  Configured buttons
@@ -95,7 +211,7 @@ void updateButtons()
 //
 struct button *setupbutton(int pin, button_callback_t callback, int edge)
 {
-    if (numberofbuttons > max_buttons)
+    if (numberofbuttons >= max_buttons)
     {
         logerr("Maximum number of buttons exceded: %i", max_buttons);
         return NULL;
@@ -111,7 +227,11 @@ struct button *setupbutton(int pin, button_callback_t callback, int edge)
     
     pinMode(pin, INPUT);
     pullUpDnControl(pin, PUD_UP);
-    wiringPiISR(pin,edge, updateButtons);
+    newbutton->value = digitalRead(pin);    // buttons may be used as modifiers: need current state
+    if (!register_irq(pin, edge, updateButtons)) {
+        numberofbuttons--;
+        return NULL;
+    }
     
     return newbutton;
 }
@@ -183,7 +303,7 @@ struct encoder *setupencoder(int pin_a,
                              rotaryencoder_callback_t callback,
                              int edge)
 {
-    if (numberofencoders > max_encoders)
+    if (numberofencoders >= max_encoders)
     {
         logerr("Maximum number of encodered exceded: %i", max_encoders);
         return NULL;
@@ -203,8 +323,15 @@ struct encoder *setupencoder(int pin_a,
     pinMode(pin_b, INPUT);
     pullUpDnControl(pin_a, PUD_UP);
     pullUpDnControl(pin_b, PUD_UP);
-    wiringPiISR(pin_a,edge, updateEncoders);
-    wiringPiISR(pin_b,edge, updateEncoders);
+    if (!register_irq(pin_a, edge, updateEncoders)) {
+        numberofencoders--;
+        return NULL;
+    }
+    if (!register_irq(pin_b, edge, updateEncoders)) {
+        unregister_last_irq();          // pin_a
+        numberofencoders--;
+        return NULL;
+    }
     
     return newencoder;
 }
@@ -220,6 +347,24 @@ void init_GPIO() {
     wiringPiSetupGpio() ;
 }
 
+//
+//
+//  Start interrupt handling
+//  Call after all buttons and encoders are set up
+//
+//
+int start_GPIO_interrupts() {
+    if (irq_thread_running || !numberofirqs)
+        return 0;
+    if (pthread_create(&irq_thread, NULL, irq_loop, NULL)) {
+        logerr("Could not start GPIO interrupt thread");
+        return -1;
+    }
+    irq_thread_running = true;
+    loginfo("GPIO interrupts started for %d pins", numberofirqs);
+    return 0;
+}
+
 
 
 
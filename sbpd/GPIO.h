@@ -46,6 +46,16 @@
 //
 void init_GPIO();
 
+//
+//
+//  Start interrupt handling
+//  A single thread handles edges on all pins.
+//  Call after all buttons and encoders are set up
+//  Returns: 0 on success
+//
+//
+int start_GPIO_interrupts();
+
 //
 // Buttons and Rotary Encoders
 // Rotary Encoder taken from https://github.com/astine/rotaryencoder
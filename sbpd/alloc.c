@@ -0,0 +1,255 @@
+//
+//  alloc.c
+//  SqueezeButtonPi
+//
+//  Memory pools and allocation accounting
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "alloc.h"
+#include "sbpd.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+//
+//  Block header, keeps the payload aligned like malloc() does
+//  class is the size class or -1 for heap blocks, size the requested size
+//
+typedef union pool_header {
+    struct {
+        union pool_header * next;       // free list link
+        int class;
+        size_t size;
+    };
+    max_align_t align;
+} pool_header_t;
+
+static max_align_t arena[pool_arena_size / sizeof(max_align_t)];
+static size_t arenaUsed = 0;
+static pool_header_t * freeList[pool_classes];
+static unsigned long heapFallbacks = 0;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread sbpd_alloc_subsystem_t currentSubsystem = SBPD_alloc_other;
+static volatile bool steadyState = false;
+
+#ifdef SBPD_ALLOC_DEBUG
+//
+//  Debug build: count allocations per subsystem
+//  The heap functions are replaced and forward to glibc, so every heap
+//  allocation of the process is seen, including those of libraries.
+//
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t number, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void __libc_free(void * ptr);
+
+static const char * subsystemNames[SBPD_alloc_subsystems] = {
+    "other", "gpio", "input", "comm", "discovery", "events", "state"
+};
+
+static volatile unsigned long poolCount[SBPD_alloc_subsystems];
+static volatile unsigned long heapCount[SBPD_alloc_subsystems];
+
+//
+//  Count a heap allocation, assert there are none in steady state
+//  Must not log: logging may allocate
+//
+static void count_heap() {
+    __sync_fetch_and_add(&heapCount[currentSubsystem], 1);
+    if (steadyState) {
+        static const char message[] = "sbpd: heap allocation in steady state, subsystem ";
+        write(STDERR_FILENO, message, sizeof(message) - 1);
+        write(STDERR_FILENO, subsystemNames[currentSubsystem], strlen(subsystemNames[currentSubsystem]));
+        write(STDERR_FILENO, "\n", 1);
+        abort();
+    }
+}
+
+void * malloc(size_t size) {
+    count_heap();
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t number, size_t size) {
+    count_heap();
+    return __libc_calloc(number, size);
+}
+
+void * realloc(void * ptr, size_t size) {
+    count_heap();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void * ptr) {
+    __libc_free(ptr);
+}
+
+#define COUNT_POOL()    __sync_fetch_and_add(&poolCount[currentSubsystem], 1)
+#else
+#define COUNT_POOL()
+#endif
+
+//
+//  Size class for a request, -1 if too large for the pool
+//
+static int size_class(size_t size) {
+    int class = 0;
+    size_t blockSize = pool_min_block;
+    while (blockSize < size) {
+        if (++class == pool_classes)
+            return -1;
+        blockSize <<= 1;
+    }
+    return class;
+}
+
+void * pool_malloc(size_t size) {
+    COUNT_POOL();
+    int class = size_class(size);
+    pool_header_t * block = NULL;
+    if (class >= 0) {
+        pthread_mutex_lock(&poolLock);
+        block = freeList[class];
+        if (block)
+            freeList[class] = block->next;
+        else {
+            size_t blockSize = sizeof(pool_header_t) + ((size_t)pool_min_block << class);
+            if (arenaUsed + blockSize <= sizeof(arena)) {
+                block = (pool_header_t *)((char *)arena + arenaUsed);
+                arenaUsed += blockSize;
+            }
+        }
+        pthread_mutex_unlock(&poolLock);
+    }
+    //
+    //  Too large or pool exhausted: take it from the heap
+    //
+    if (!block) {
+        __sync_fetch_and_add(&heapFallbacks, 1);
+        block = malloc(sizeof(pool_header_t) + size);
+        if (!block)
+            return NULL;
+        class = -1;
+    }
+    block->class = class;
+    block->size = size;
+    return block + 1;
+}
+
+void pool_free(void * ptr) {
+    if (!ptr)
+        return;
+    pool_header_t * block = (pool_header_t *)ptr - 1;
+    if (block->class < 0) {
+        free(block);
+        return;
+    }
+    pthread_mutex_lock(&poolLock);
+    block->next = freeList[block->class];
+    freeList[block->class] = block;
+    pthread_mutex_unlock(&poolLock);
+}
+
+void * pool_calloc(size_t number, size_t size) {
+    if (size && number > SIZE_MAX / size)
+        return NULL;
+    void * ptr = pool_malloc(number * size);
+    if (ptr)
+        memset(ptr, 0, number * size);
+    return ptr;
+}
+
+void * pool_realloc(void * ptr, size_t size) {
+    if (!ptr)
+        return pool_malloc(size);
+    if (!size) {
+        pool_free(ptr);
+        return NULL;
+    }
+    //
+    //  Still fits into the block?
+    //
+    pool_header_t * block = (pool_header_t *)ptr - 1;
+    if (block->class >= 0 && size <= ((size_t)pool_min_block << block->class)) {
+        block->size = size;
+        return ptr;
+    }
+    void * newPtr = pool_malloc(size);
+    if (!newPtr)
+        return NULL;
+    //
+    //  Heap blocks are not only those too large for the pool, small ones
+    //  end up there when the arena is exhausted: copy what was requested
+    //
+    memcpy(newPtr, ptr, MIN(block->size, size));
+    pool_free(ptr);
+    return newPtr;
+}
+
+char * pool_strdup(const char * str) {
+    size_t length = strlen(str) + 1;
+    char * copy = pool_malloc(length);
+    if (copy)
+        memcpy(copy, str, length);
+    return copy;
+}
+
+sbpd_alloc_subsystem_t alloc_scope(sbpd_alloc_subsystem_t subsystem) {
+    sbpd_alloc_subsystem_t previous = currentSubsystem;
+    currentSubsystem = subsystem;
+    return previous;
+}
+
+void alloc_steady_state(bool steady) {
+    if (steadyState == steady)
+        return;
+    if (steady) {
+        alloc_report();
+#ifdef SBPD_ALLOC_DEBUG
+        loginfo("Steady state: heap allocations are fatal from now on");
+#endif
+    }
+    steadyState = steady;
+}
+
+void alloc_report() {
+    loginfo("Pool: %lu of %lu bytes used, %lu heap fallbacks",
+            (unsigned long)arenaUsed, (unsigned long)sizeof(arena), heapFallbacks);
+#ifdef SBPD_ALLOC_DEBUG
+    for (int cnt = 0; cnt < SBPD_alloc_subsystems; cnt++)
+        loginfo("Allocations %-10s pool: %lu heap: %lu",
+                subsystemNames[cnt], poolCount[cnt], heapCount[cnt]);
+#endif
+}
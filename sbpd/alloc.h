@@ -0,0 +1,95 @@
+//
+//  alloc.h
+//  SqueezeButtonPi
+//
+//  Memory pools and allocation accounting
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef alloc_h
+#define alloc_h
+
+#include "sbpd.h"
+
+//
+//  Subsystems for allocation accounting
+//  The subsystem is tracked per thread, see alloc_scope()
+//
+typedef enum {
+    SBPD_alloc_other = 0,
+    SBPD_alloc_gpio,
+    SBPD_alloc_input,
+    SBPD_alloc_comm,
+    SBPD_alloc_discovery,
+    SBPD_alloc_events,
+    SBPD_alloc_state,
+    SBPD_alloc_subsystems
+} sbpd_alloc_subsystem_t;
+
+//
+//  Pool sizes
+//  Blocks come in power of two size classes from pool_min_block up.
+//  All blocks are carved from one static arena and recycled through
+//  per class free lists, so after warm-up the pool doesn't touch the heap.
+//
+#define pool_arena_size (512 * 1024)
+#define pool_min_block  32
+#define pool_classes    12          // 32 bytes .. 64 kB, curl buffers are 16 kB + 1
+
+//
+//  Pool allocator, malloc() compatible
+//  Installed as the libcurl allocator with curl_global_init_mem().
+//  Requests larger than the largest class or beyond the arena fall back to the heap.
+//
+void * pool_malloc(size_t size);
+void * pool_calloc(size_t number, size_t size);
+void * pool_realloc(void * ptr, size_t size);
+char * pool_strdup(const char * str);
+void pool_free(void * ptr);
+
+//
+//  Set the subsystem for allocations of the calling thread
+//  Returns: the previous subsystem, to be restored by the caller
+//
+sbpd_alloc_subsystem_t alloc_scope(sbpd_alloc_subsystem_t subsystem);
+
+//
+//  Enter or leave steady state
+//  Steady state starts after startup and ends with shutdown.
+//  With SBPD_ALLOC_DEBUG defined heap allocations are counted per subsystem
+//  and any heap allocation in steady state aborts the daemon.
+//
+void alloc_steady_state(bool steady);
+
+//
+//  Log pool usage and, in debug builds, allocation counts per subsystem
+//
+void alloc_report();
+
+#endif /* alloc_h */
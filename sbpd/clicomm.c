@@ -0,0 +1,379 @@
+//
+//  clicomm.c
+//  SqueezeButtonPi
+//
+//  Command transport over the server's CLI port
+//  - One persistent connection, commands are pipelined
+//  - Replies are matched to commands in order
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "clicomm.h"
+#include "eventloop.h"
+#include "servercomm.h"
+#include "timing.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define CLI_RETRY           (10 * SCD_SECOND)   // reconnect interval
+#define max_cli_line        1024
+#define max_cli_output      2048
+#define max_cli_pending     (max_requests + 1)  // requests and the login reply
+
+static const char * playerMAC = NULL;
+static cli_result_t resultCallback = NULL;
+
+static struct {
+    int fd;                     // -1: not connected
+    bool connected;             // connect() completed
+    char host[16];
+    uint32_t port;
+    sbpd_time_t next_connect;
+    sbpd_time_t connect_deadline;
+    bool failed;                // last attempt failed, log quietly
+    //
+    //  Requests waiting for their reply, oldest first. -1: login
+    //
+    int pending[max_cli_pending];
+    int head;
+    int count;
+    size_t in_length;
+    char in[max_cli_line];
+    size_t out_length;
+    char out[max_cli_output];
+} cli = { .fd = -1 };
+
+static void cli_handler(int fd, short revents, void * context);
+
+void cli_encode(const char * text, char * out, size_t size) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t pos = 0;
+    for (; *text && (pos + 4 < size); text++) {
+        unsigned char c = *text;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || strchr("-_.~", c)) {
+            out[pos++] = c;
+        } else {
+            out[pos++] = '%';
+            out[pos++] = hex[c >> 4];
+            out[pos++] = hex[c & 0xf];
+        }
+    }
+    out[pos] = 0;
+}
+
+void cli_decode(char * text) {
+    char * out = text;
+    for (; *text; text++) {
+        if ((text[0] == '%') && text[1] && text[2]) {
+            char hex[3] = { text[1], text[2], 0 };
+            *out++ = (char)strtol(hex, NULL, 16);
+            text += 2;
+        } else
+            *out++ = *text;
+    }
+    *out = 0;
+}
+
+int cli_socket(const char * host, uint32_t port) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if (inet_pton(AF_INET, host, &address.sin_addr) != 1)
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) && (errno != EINPROGRESS)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//
+//  Convert a JSON command fragment to CLI arguments
+//
+int cli_arguments(const char * fragment, char * line, size_t size) {
+    int length = 0;
+    if (size)
+        line[0] = 0;
+    const char * pos = fragment + strspn(fragment, " ");
+    if (*pos++ != '[')
+        return -1;
+    for (;;) {
+        char value[160];
+        size_t count = 0;
+        pos += strspn(pos, " ");
+        if (*pos == '"') {
+            for (pos++; *pos && (*pos != '"'); pos++) {
+                if (count == sizeof(value) - 1)
+                    return -1;
+                if (*pos != '\\') {
+                    value[count++] = *pos;
+                    continue;
+                }
+                pos++;
+                if (!*pos || (*pos == 'u'))
+                    return -1;
+                value[count++] = (*pos == 'n') ? '\n' : (*pos == 't') ? '\t' : *pos;
+            }
+            if (*pos++ != '"')
+                return -1;
+        } else {
+            for (; *pos && !strchr(",] ", *pos); pos++) {
+                if (strchr("{}[\":", *pos) || (count == sizeof(value) - 1))
+                    return -1;
+                value[count++] = *pos;
+            }
+            if (!count)
+                return -1;
+        }
+        value[count] = 0;
+        char encoded[3 * sizeof(value)];
+        cli_encode(value, encoded, sizeof(encoded));
+        length += snprintf(line + length, (length < size) ? size - length : 0, " %s", encoded);
+        pos += strspn(pos, " ");
+        if (*pos == ']')
+            break;
+        if (*pos++ != ',')
+            return -1;
+    }
+    return (length < size) ? length : -1;
+}
+
+//
+//  Write as much output as the socket takes, wait for POLLOUT for the rest
+//
+static bool flush_output() {
+    if (cli.out_length) {
+        ssize_t written = write(cli.fd, cli.out, cli.out_length);
+        if ((written < 0) && (errno != EAGAIN))
+            return false;
+        if (written > 0) {
+            cli.out_length -= written;
+            memmove(cli.out, cli.out + written, cli.out_length);
+        }
+    }
+    watch_fd(cli.fd, (cli.out_length) ? POLLIN | POLLOUT : POLLIN, cli_handler, NULL);
+    return true;
+}
+
+static bool queue_line(const char * line, int length, int request) {
+    if ((cli.count == max_cli_pending) || (cli.out_length + length > sizeof(cli.out)))
+        return false;
+    memcpy(cli.out + cli.out_length, line, length);
+    cli.out_length += length;
+    cli.pending[(cli.head + cli.count++) % max_cli_pending] = request;
+    return true;
+}
+
+//
+//  A command line: the player, the prepared arguments and the line end
+//
+static bool queue_command(const char * player, const char * arguments, int length, int request) {
+    size_t id = strlen(player);
+    if ((cli.count == max_cli_pending) || (cli.out_length + id + length + 1 > sizeof(cli.out)))
+        return false;
+    memcpy(cli.out + cli.out_length, player, id);
+    memcpy(cli.out + cli.out_length + id, arguments, length);
+    cli.out_length += id + length;
+    cli.out[cli.out_length++] = '\n';
+    cli.pending[(cli.head + cli.count++) % max_cli_pending] = request;
+    return true;
+}
+
+static void cli_close() {
+    if (cli.fd >= 0) {
+        unwatch_fd(cli.fd);
+        close(cli.fd);
+    }
+    cli.fd = -1;
+    cli.connected = false;
+    cli.in_length = 0;
+    cli.out_length = 0;
+    cli.next_connect = clock_now() + CLI_RETRY;
+    //
+    //  Commands without reply failed
+    //
+    while (cli.count) {
+        int request = cli.pending[cli.head];
+        cli.head = (cli.head + 1) % max_cli_pending;
+        cli.count--;
+        if (request >= 0)
+            resultCallback(request, false);
+    }
+}
+
+//
+//  Every reply line completes the oldest command
+//
+static void parse_lines() {
+    char * start = cli.in;
+    char * end;
+    while ((end = memchr(start, '\n', cli.in + cli.in_length - start))) {
+        start = end + 1;
+        if (!cli.count)
+            continue;
+        int request = cli.pending[cli.head];
+        cli.head = (cli.head + 1) % max_cli_pending;
+        cli.count--;
+        if (request >= 0)
+            resultCallback(request, true);
+    }
+    cli.in_length -= start - cli.in;
+    memmove(cli.in, start, cli.in_length);
+    //
+    //  Overlong reply: skip to its end, the line still counts when it's complete
+    //
+    if (cli.in_length == sizeof(cli.in))
+        cli.in_length = 1;
+}
+
+static void cli_handler(int fd, short revents, void * context) {
+    if (!cli.connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error || (revents & (POLLERR | POLLHUP))) {
+            if (!cli.failed)
+                loginfo("No CLI connection to %s:%u, commands use HTTP", cli.host, cli.port);
+            cli.failed = true;
+            cli_close();
+            return;
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        cli.connected = true;
+        cli.failed = false;
+        loginfo("Commands use the CLI on %s:%u", cli.host, cli.port);
+        if (!flush_output())
+            cli_close();
+        return;
+    }
+    
+    if (revents & POLLOUT) {
+        if (!flush_output()) {
+            cli_close();
+            return;
+        }
+    }
+    if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+        return;
+    ssize_t received = read(fd, cli.in + cli.in_length, sizeof(cli.in) - cli.in_length);
+    if (received <= 0) {
+        if ((received < 0) && (errno == EAGAIN))
+            return;
+        loginfo("CLI connection to %s:%u closed", cli.host, cli.port);
+        cli_close();
+        return;
+    }
+    cli.in_length += received;
+    parse_lines();
+}
+
+//
+//  Connect, the login goes out as soon as the connection is up
+//
+static void cli_connect(struct sbpd_server * server) {
+    snprintf(cli.host, sizeof(cli.host), "%s", server->host);
+    cli.port = (server->cli_port) ? server->cli_port : SBPD_CLI_PORT;
+    cli.fd = cli_socket(cli.host, cli.port);
+    if (cli.fd < 0) {
+        cli.next_connect = clock_now() + CLI_RETRY;
+        return;
+    }
+    cli.connect_deadline = clock_now() + CLI_CONNECT_TIMEOUT;
+    if (server->user && server->password) {
+        char user[128], password[128], line[300];
+        cli_encode(server->user, user, sizeof(user));
+        cli_encode(server->password, password, sizeof(password));
+        int length = snprintf(line, sizeof(line), "login %s %s\n", user, password);
+        queue_line(line, length, -1);
+    }
+    watch_fd(cli.fd, POLLOUT, cli_handler, NULL);
+}
+
+void init_cli_comm(const char * mac, cli_result_t result) {
+    playerMAC = mac;
+    resultCallback = result;
+}
+
+void poll_cli_comm(struct sbpd_server * server) {
+    if (!playerMAC || !server->host)
+        return;
+    if ((cli.fd >= 0) &&
+        (strcmp(cli.host, server->host) ||
+         (cli.port != ((server->cli_port) ? server->cli_port : SBPD_CLI_PORT)))) {
+        cli_close();
+        cli.next_connect = 0;
+    }
+    if ((cli.fd >= 0) && !cli.connected && (clock_now() >= cli.connect_deadline)) {
+        if (!cli.failed)
+            loginfo("CLI connection to %s:%u timed out, commands use HTTP", cli.host, cli.port);
+        cli.failed = true;
+        cli_close();
+    }
+    if ((cli.fd < 0) && (clock_now() >= cli.next_connect))
+        cli_connect(server);
+}
+
+bool cli_ready() {
+    return cli.connected;
+}
+
+bool cli_command(int request, const char * player, const char * arguments, int length) {
+    if (!cli.connected || (length < 0) || !queue_command(player, arguments, length, request))
+        return false;
+    logdebug("CLI command %d: %s%.*s", request, player, length, arguments);
+    //
+    //  A write error closes the connection from the event loop,
+    //  the command fails through the callback then
+    //
+    flush_output();
+    return true;
+}
+
+void cli_abort() {
+    if (cli.fd < 0)
+        return;
+    logwarn("CLI connection to %s:%u stuck, dropped", cli.host, cli.port);
+    cli_close();
+}
+
+void shutdown_cli_comm() {
+    cli_close();
+}
@@ -0,0 +1,122 @@
+//
+//  clicomm.h
+//  SqueezeButtonPi
+//
+//  Command transport over the server's CLI port
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef clicomm_h
+#define clicomm_h
+
+#include "sbpd.h"
+#include "timing.h"
+
+//
+//  Default CLI port if discovery didn't report one
+//
+#define SBPD_CLI_PORT   9090
+
+//
+//  Result callback
+//  Called from the event loop for every command, in the order sent
+//  Parameters:
+//      request: the request handle passed to cli_command
+//      success: false if the connection was lost before the reply
+//
+typedef void (*cli_result_t)(int request, bool success);
+
+//
+//  Initialize the CLI transport
+//  Parameters:
+//      mac: the player MAC address
+//      result: gets the command results
+//
+void init_cli_comm(const char * mac, cli_result_t result);
+
+//
+//  Polling function: connect, reconnect and follow server changes
+//  Parameters:
+//      server: the server, uses host, cli_port and credentials
+//
+void poll_cli_comm(struct sbpd_server * server);
+
+//
+//  Is the CLI connection up?
+//
+bool cli_ready();
+
+//
+//  Send a command
+//  Commands are written back to back without waiting for replies,
+//  replies are matched in order.
+//  Parameters:
+//      request: request handle, passed to the result callback
+//      player: the player id, URL encoded
+//      arguments, length: the command arguments, see cli_arguments()
+//                         length -1: not a CLI command
+//  Returns: false if the command can't be sent over the CLI (not connected,
+//           queue full or not a CLI command), use HTTP then
+//
+bool cli_command(int request, const char * player, const char * arguments, int length);
+
+//
+//  Convert a JSON command fragment to CLI arguments
+//  Only flat arrays of strings and numbers, e.g. ["mixer","volume","+2"]
+//  becomes " mixer volume %2B2": URL encoded, each with a leading blank
+//  Returns: length, -1 if not convertible or too long
+//
+int cli_arguments(const char * fragment, char * arguments, size_t size);
+
+//
+//  Drop a stuck connection, pending commands fail. Reconnects later.
+//
+void cli_abort();
+
+//
+//  Close the connection, pending commands fail
+//
+void shutdown_cli_comm();
+
+//
+//  CLI helpers, shared with the player state cache
+//  cli_encode: URL encode a CLI argument
+//  cli_decode: URL decode a CLI argument in place
+//  cli_socket: start a non-blocking connect to host:port, returns the socket or -1
+//
+void cli_encode(const char * text, char * out, size_t size);
+void cli_decode(char * text);
+int cli_socket(const char * host, uint32_t port);
+
+//
+//  Connect timeout for CLI connections
+//
+#define CLI_CONNECT_TIMEOUT     (2 * SCD_SECOND)
+
+#endif /* clicomm_h */
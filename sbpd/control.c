@@ -39,10 +39,15 @@
 #include "sbpd.h"
 #include "control.h"
 #include "servercomm.h"
+#include "timing.h"
+#include "events.h"
+#include "dispatch.h"
+#include "players.h"
 #include <wiringPi.h>
 #include <string.h>
-#include <time.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/param.h>
 
 //
 //  Pre-allocate encoder and button objects on the stack so we don't have to
@@ -54,32 +59,114 @@ static int numberofbuttons = 0;
 static int numberofencoders = 0;
 
 //
-//  Command fragments
+//  Encoder command coalescing
+//  Deltas are capped: volume is 0..100, anything beyond is a glitch or a
+//  long spin while the server was slow. A request that never reports back
+//  (e.g. event queue overflow) is given up after the timeout.
 //
-//  Buttons
+#define max_encoder_delta       100
+#define ENCODER_PENDING_TIMEOUT (5 * SCD_SECOND)
+#define ENCODER_SUPERSEDE       (250 * SCD_MILLISECOND)
+
+//
+//  A press that could not be queued is tried again for this long
 //
-#define FRAGMENT_PAUSE          "[\"pause\"]"
-#define FRAGMENT_VOLUME_UP      "[\"button\",\"volume_up\"]"
-#define FRAGMENT_VOLUME_DOWN    "[\"button\",\"voldown\"]"
-#define FRAGMENT_PREV           "[\"button\",\"rew\"]"
-#define FRAGMENT_NEXT           "[\"button\",\"fwd\"]"
-#define FRAGMENT_POWER           "[\"button\",\"power\"]"
+#define BUTTON_RETRY_TIMEOUT    (5 * SCD_SECOND)
+static int command_subscriber = -1;
+
 //
-//  Encoder
+//  Player volume models for absolute encoders (VOLA), one per player
+//  Seeded by a volume query, then encoder movement is applied locally and
+//  only the resulting volume is sent. Reseeded after a server change or a
+//  failed command. Changes from elsewhere come in from the player state
+//  cache, which follows the default player only.
+//  A group target uses the model of its player, the volume is set on all members.
 //
-#define FRAGMENT_VOLUME         "[\"mixer\",\"volume\",\"%s%d\"]"
+static struct volume_model {
+    int level;                  // current volume, -1: unknown
+    int sent;                   // volume last sent to the server
+    sbpd_request_t query;       // volume query in flight, -1: none
+    long queried;               // query result, filled by the reply parser
+    struct sbpd_json_field field;
+} volumes[max_players];
+static struct sbpd_command volumeSetCommand;   // compiled FRAGMENT_VOLUME_SET
 
 //
-//  Button press callback
-//  Sets the flag for "button pressed"
+//  Run an action
+//  Single commands are sent directly, macro steps are pipelined
+//  Compiled actions only get the steps written in, others are rendered here
+//  Parameters:
+//      server: the server to send commands to
+//      target: the player or group
+//      action: the action
+//      steps: encoder steps for "%d" placeholders
+//  Returns: request handle of the (last) command, SBPD_request_busy if the
+//           queue was full, -1 if it can't be sent (e.g. doesn't render)
 //
-void button_press_cb(const struct button * button, int change) {
-    for (int cnt = 0; cnt < numberofbuttons; cnt++) {
-        if (button == button_ctrls[cnt].gpio_button) {
-            button_ctrls[cnt].waiting = true;
-            return;
+static sbpd_request_t run_action(struct sbpd_server * server, sbpd_target_t target,
+                                 const struct sbpd_action * action, int steps) {
+    const struct sbpd_command * commands = action_commands(action);
+    if (commands)
+        return send_compiled(server, target, commands, action->steps, action->depends, steps);
+    char fragments[max_steps][max_fragment];
+    char * list[max_steps];
+    for (int step = 0; step < action->steps; step++) {
+        if (render_action(action, step, steps, fragments[step], max_fragment) < 0)
+            return -1;
+        list[step] = fragments[step];
+    }
+    if (action->steps == 1)
+        return send_command(server, target, list[0]);
+    return send_commands(server, target, list, action->depends, action->steps);
+}
+
+//
+//  Where GPIO callbacks deliver input events
+//  Default: apply locally. With privilege separation: forward to the network process
+//
+static input_sink_t input_sink = control_input;
+
+void set_input_sink(input_sink_t sink) {
+    input_sink = (sink) ? sink : control_input;
+}
+
+//
+//  Apply an input event to the control state
+//  Buttons: set the flag for "button pressed", encoders: update value
+//
+void control_input(const struct sbpd_event * event) {
+    if (event->input.source == SBPD_input_button) {
+        for (int cnt = 0; cnt < numberofbuttons; cnt++) {
+            if (event->input.pin == button_ctrls[cnt].gpio_button->pin) {
+                button_ctrls[cnt].value = (bool)event->input.value;
+                button_ctrls[cnt].pressed = event->time;
+                button_ctrls[cnt].waiting = true;
+                break;
+            }
+        }
+    } else {
+        for (int cnt = 0; cnt < numberofencoders; cnt++) {
+            if (event->input.pin == encoder_ctrls[cnt].gpio_encoder->pin_a) {
+                encoder_ctrls[cnt].value = event->input.value;
+                break;
+            }
         }
     }
+    struct sbpd_event published = *event;
+    publish_event(&published);
+}
+
+//
+//  Button press callback
+//  Called on GPIO interrupt threads
+//
+void button_press_cb(const struct button * button, int change) {
+    struct sbpd_event event = {
+        .type = SBPD_evt_input,
+        .time = clock_now(),
+        .input = { SBPD_input_button, button->pin, button->value, change }
+    };
+    input_sink(&event);
 }
 
 //
@@ -91,48 +178,64 @@ void button_press_cb(const struct button * button, int change) {
 //                  VOL-    - decrement volume
 //                  PREV    - previous track
 //                  NEXT    - next track
+//                  POWR    - toggle power
+//                  -       - none, actions defined by rules only
 //      pin: the GPIO-Pin-Number
 //      edge: one of
 //                  1 - falling edge
 //                  2 - rising edge
 //                  0, 3 - both
+//      player: MAC or name of the player to control, "@" in front for its
+//              sync group. NULL for the default player
 //
-int setup_button_ctrl(char * cmd, int pin, int edge) {
-    char * fragment = NULL;
-    if (strlen(cmd) > 4)
+int setup_button_ctrl(char * cmd, int pin, int edge, const char * player) {
+    if (!cmd)
+        return -1;
+    if (numberofbuttons == max_buttons) {
+        logerr("Maximum number of buttons exceeded: %i", max_buttons);
         return -1;
-    
-    //
-    //  Select fragment for parameter
-    //  Would love to "switch" here but that's not portable...
-    //
-    uint32_t code = STRTOU32(cmd);
-    if (code == STRTOU32("PLAY")) {
-        fragment = FRAGMENT_PAUSE;
-    } else if (code == STRTOU32("VOL+")) {
-        fragment = FRAGMENT_VOLUME_UP;
-    } else if (code == STRTOU32("VOL-")) {
-        fragment = FRAGMENT_VOLUME_DOWN;
-    } else if (code == STRTOU32("PREV")) {
-        fragment = FRAGMENT_PREV;
-    } else if (code == STRTOU32("NEXT")) {
-        fragment = FRAGMENT_NEXT;
-    } else if (code == STRTOU32("POWR")) {
-        fragment = FRAGMENT_POWER;
     }
-    if (!fragment)
+    sbpd_target_t target = add_target(player);
+    if (target < 0)
+        return -1;
+#ifndef SBPD_STATIC_CONFIG
+    if (strcmp(cmd, "-") && add_rule(pin, SBPD_gesture_press, -1, cmd))
         return -1;
+#endif
     
     struct button * gpio_b = setupbutton(pin, button_press_cb, edge);
-    button_ctrls[numberofbuttons].fragment = fragment;
+    if (!gpio_b)
+        return -1;
     button_ctrls[numberofbuttons].waiting = false;
+    button_ctrls[numberofbuttons].pressed = 0;
+    button_ctrls[numberofbuttons].value = gpio_b->value;
     button_ctrls[numberofbuttons].gpio_button = gpio_b;
+    button_ctrls[numberofbuttons].target = target;
     numberofbuttons++;
-    loginfo("Button defined: Pin %d, Edge: %s, Fragment: \n%s",
+    loginfo("Button defined: Pin %d, Edge: %s, Command: %s%s%s",
             pin,
             ((edge != INT_EDGE_FALLING) && (edge != INT_EDGE_RISING)) ? "both" :
             (edge == INT_EDGE_FALLING) ? "falling" : "rising",
-            fragment);
+            cmd, (player && *player) ? ", Player: " : "", (player) ? player : "");
+    return 0;
+}
+
+//
+//  Currently active modifier slot
+//  The first modifier button held down (other than the triggering control)
+//  Buttons are pulled up, so "held" reads as low
+//
+static int active_modifier(int pin) {
+    for (int slot = 1; slot <= number_of_modifiers(); slot++) {
+        int mpin = modifier_pin(slot);
+        if (mpin == pin)
+            continue;
+        for (int cnt = 0; cnt < numberofbuttons; cnt++) {
+            if ((button_ctrls[cnt].gpio_button->pin == mpin) &&
+                !button_ctrls[cnt].value)
+                return slot;
+        }
+    }
     return 0;
 }
 
@@ -145,8 +248,20 @@ void handle_buttons(struct sbpd_server * server) {
     //logdebug("Polling buttons");
     for (int cnt = 0; cnt < numberofbuttons; cnt++) {
         if (button_ctrls[cnt].waiting) {
-            loginfo("Button pressed: Pin %d", button_ctrls[cnt].gpio_button->pin);
-            send_command(server, button_ctrls[cnt].fragment);
+            int pin = button_ctrls[cnt].gpio_button->pin;
+            const struct sbpd_action * action = dispatch(pin, SBPD_gesture_press,
+                                                         active_modifier(pin));
+            //
+            //  Not queued because the queue is full: try again for a while
+            //  Anything else won't get better, the press is dropped
+            //
+            sbpd_request_t request = (action) ? run_action(server, button_ctrls[cnt].target, action, 0) : 0;
+            if ((request == SBPD_request_busy) &&
+                (clock_now() - button_ctrls[cnt].pressed < BUTTON_RETRY_TIMEOUT))
+                continue;
+            if ((request < 0) && (request != SBPD_request_busy))
+                logwarn("Button on GPIO %d: command can't be sent, press dropped", pin);
+            loginfo("Button pressed: Pin %d", pin);
             button_ctrls[cnt].waiting = false;  // clear waiting
         }
     }
@@ -155,10 +270,15 @@ void handle_buttons(struct sbpd_server * server) {
 
 //
 //  Encoder interrupt callback
-//  Currently does nothing since we poll for volume changes
+//  Only passes on the value since we poll for volume changes
 //
 void encoder_rotate_cb(const struct encoder * encoder, long change) {
-    logdebug("Interrupt: encoder value: %d change: %d", encoder->value, change);
+    struct sbpd_event event = {
+        .type = SBPD_evt_input,
+        .time = clock_now(),
+        .input = { SBPD_input_encoder, encoder->pin_a, encoder->value, change }
+    };
+    input_sink(&event);
 }
 
 //
@@ -166,84 +286,250 @@ void encoder_rotate_cb(const struct encoder * encoder, long change) {
 //  Parameters:
 //      cmd: Command. Currently only
 //                  VOLU    - volume
-//          Can be NULL for volume
+//                  -       - none, actions defined by rules only
+//          Can be NULL for volume, anything else is also treated as volume
 //      pin1: the GPIO-Pin-Number for the first pin used
 //      pin2: the GPIO-Pin-Number for the second pin used
 //      edge: one of
 //                  1 - falling edge
 //                  2 - rising edge
 //                  0, 3 - both
+//      player: MAC or name of the player to control, "@" in front for its
+//              sync group. NULL for the default player
 //
 //
-int setup_encoder_ctrl(char * cmd, int pin1, int pin2, int edge) {
-    char * fragment = FRAGMENT_VOLUME;
-    /*if (strlen(cmd) > 4)
+int setup_encoder_ctrl(char * cmd, int pin1, int pin2, int edge, const char * player) {
+    if (numberofencoders == max_encoders) {
+        logerr("Maximum number of encoders exceeded: %i", max_encoders);
         return -1;
-    
-    //
-    //  Select fragment for parameter
-    //  Would love to "switch" here but that's not portable...
-    //
-    uint32_t code = STRTOU32(cmd);
-    if (code == STRTOU32("VOLU")) {
-        fragment = FRAGMENT_VOLUME;
-    }*/
+    }
+    sbpd_target_t target = add_target(player);
+    if (target < 0)
+        return -1;
+    bool absolute = cmd && !strcmp(cmd, "VOLA");
+#ifndef SBPD_STATIC_CONFIG
+    if (!absolute && (!cmd || strcmp(cmd, "-"))) {
+        if (add_rule(pin1, SBPD_gesture_cw, -1, "VOLU") ||
+            add_rule(pin1, SBPD_gesture_ccw, -1, "VOLU"))
+            return -1;
+    }
+#endif
     
     struct encoder * gpio_e = setupencoder(pin1, pin2, encoder_rotate_cb, edge);
-    encoder_ctrls[numberofencoders].fragment = fragment;
+    if (!gpio_e)
+        return -1;
     encoder_ctrls[numberofencoders].gpio_encoder = gpio_e;
+    encoder_ctrls[numberofencoders].target = target;
+    encoder_ctrls[numberofencoders].value = 0;
     encoder_ctrls[numberofencoders].last_value = 0;
+    encoder_ctrls[numberofencoders].pending = -1;
+    encoder_ctrls[numberofencoders].pending_change = 0;
+    encoder_ctrls[numberofencoders].absolute = absolute;
+    if (absolute)
+        compile_command(&volumeSetCommand, FRAGMENT_VOLUME_SET);
+    if (command_subscriber < 0) {
+        command_subscriber = subscribe_events(SBPD_evt_command | SBPD_evt_server | SBPD_evt_player);
+        for (int cnt = 0; cnt < max_players; cnt++)
+            volumes[cnt].level = volumes[cnt].sent = volumes[cnt].query = -1;
+    }
     numberofencoders++;
-    loginfo("Rotary encoder defined: Pin %d, %d, Edge: %s, Fragment: \n%s",
-            pin1, pin2,
+    loginfo("Rotary encoder defined: Pin %d, %d,%s Edge: %s%s%s",
+            pin1, pin2, (absolute) ? " absolute volume," : "",
             ((edge != INT_EDGE_FALLING) && (edge != INT_EDGE_RISING)) ? "both" :
             (edge == INT_EDGE_FALLING) ? "falling" : "rising",
-            fragment);
+            (player && *player) ? ", Player: " : "", (player) ? player : "");
     return 0;
 }
 
+//
+//  Command, server and player event handler
+//  Release encoders waiting for their request, update the volume model
+//
+static void encoder_command_event(const struct sbpd_event * event, void * context) {
+    if (event->type == SBPD_evt_server) {
+        for (int cnt = 0; cnt < max_players; cnt++)
+            volumes[cnt].level = -1;
+        return;
+    }
+    if (event->type == SBPD_evt_player) {
+        //
+        //  Pushed volume of the default player: take it unless a local change is on its way
+        //
+        if ((event->player.volume < 0) || (volumes[0].level != volumes[0].sent))
+            return;
+        for (int cnt = 0; cnt < numberofencoders; cnt++)
+            if (encoder_ctrls[cnt].absolute && (encoder_ctrls[cnt].pending >= 0) &&
+                !SBPD_target_player(encoder_ctrls[cnt].target))
+                return;
+        volumes[0].level = volumes[0].sent = event->player.volume;
+        return;
+    }
+    for (int cnt = 0; cnt < numberofencoders; cnt++) {
+        if (encoder_ctrls[cnt].pending != event->command.request)
+            continue;
+        encoder_ctrls[cnt].pending = -1;
+        if (event->command.code == SBPD_result_timeout)
+            logwarn("Encoder on GPIO %d: server didn't answer in time",
+                    encoder_ctrls[cnt].gpio_encoder->pin_a);
+        //
+        //  Cancelled: superseded or coalesced into a newer volume
+        //
+        if (encoder_ctrls[cnt].absolute && !event->command.success &&
+            (event->command.code != SBPD_result_cancelled))
+            volumes[SBPD_target_player(encoder_ctrls[cnt].target)].level = -1;
+    }
+}
+
+//
+//  Volume query reply: {..."result":{"_volume":"30"}}
+//  Negative values are a muted player
+//  Every player's model has its own result field, queries can overlap
+//
+static void volume_reply(sbpd_request_t request, bool success, void * context) {
+    int player = (int)(intptr_t)context;
+    volumes[player].query = -1;
+    if (!success || !volumes[player].field.found) {
+        logwarn("Could not read volume of player %s", player_id(player));
+        return;
+    }
+    volumes[player].level = (int)MIN(labs(volumes[player].queried), 100);
+    volumes[player].sent = volumes[player].level;
+    logdebug("Player %s volume: %d", player_id(player), volumes[player].level);
+}
+
+//
+//  Absolute encoder: apply movement to the volume model
+//  Returns: false if the volume is not known yet, movement stays pending
+//
+static bool apply_volume(struct sbpd_server * server, struct encoder_ctrl * ctrl) {
+    int player = SBPD_target_player(ctrl->target);
+    if (volumes[player].level < 0) {
+        if ((volumes[player].query < 0) && server->host && server->port) {
+            volumes[player].field = (struct sbpd_json_field) {
+                "_volume", SBPD_json_int, &volumes[player].queried, sizeof(volumes[player].queried)
+            };
+            volumes[player].query = send_query(server, player, FRAGMENT_VOLUME_QUERY,
+                                               &volumes[player].field, 1, volume_reply,
+                                               (void *)(intptr_t)player);
+        }
+        return false;
+    }
+    long value = ctrl->value;
+    long level = volumes[player].level + value - ctrl->last_value;
+    volumes[player].level = (int)MAX(MIN(level, 100), 0);
+    ctrl->last_value = value;
+    return true;
+}
+
 //
 //  Polling function: handle encoder commands
 //  Parameters:
 //      server: the server to send commands to
 //
 void handle_encoders(struct sbpd_server * server) {
-    //
-    //  chatter filter 200ms - disabled...
-    //  We poll every 100ms anyway plus wait for network action to complete
-    //
-    /*static unsigned long lasttimeVol = 0;
-    struct timespec thistime;
-     
-    clock_gettime(0, &thistime);
-    unsigned long time = thistime.tv_sec * 10 + thistime.tv_nsec / (1e8);
-    if (lasttimeVol - time < 2) {
-        return;
-    }*/
+    poll_events(command_subscriber, encoder_command_event, NULL);
+    sbpd_time_t now = clock_now();
     
     //logdebug("Polling encoders");
     for (int cnt = 0; cnt < numberofencoders; cnt++) {
+        struct encoder_ctrl * ctrl = encoder_ctrls + cnt;
+        int pin = ctrl->gpio_encoder->pin_a;
+        struct volume_model * volume = volumes + SBPD_target_player(ctrl->target);
+        int modifier = active_modifier(pin);
+        //
+        //  Absolute volume: movement is applied to the model right away,
+        //  clamped at the ends. A modifier switches to the rules.
+        //
+        bool absolute = ctrl->absolute && !modifier;
+        bool known = absolute && apply_volume(server, ctrl);
+        
+        //
+        //  An absolute volume is superseded by a newer one: if the server
+        //  is slow don't wait for the old one, the new one replaces it
+        //
+        if (known && (ctrl->pending >= 0) && (volume->level != volume->sent) &&
+            (now - ctrl->sent >= ENCODER_SUPERSEDE)) {
+            logdebug("Encoder on GPIO %d: volume %d superseded by %d",
+                     pin, volume->sent, volume->level);
+            cancel_command(ctrl->pending);
+            ctrl->pending = -1;
+        }
+        
+        //
+        //  Still in the offline queue: replace it by one request for all
+        //  movement so far instead of queueing more
         //
-        //  build volume delta
-        //  ignore if > 100: overflow
+        if ((ctrl->pending >= 0) && command_waiting(ctrl->pending)) {
+            if (absolute ? (known && (volume->level != volume->sent)) : (ctrl->value != ctrl->last_value)) {
+                logdebug("Encoder on GPIO %d: queued request %d replaced", pin, ctrl->pending);
+                cancel_command(ctrl->pending);
+                if (!absolute)
+                    ctrl->last_value -= ctrl->pending_change;
+                ctrl->pending = -1;
+            } else
+                continue;
+        }
+        
+        //
+        //  Latest wins: while a request is in flight movement accumulates
+        //
+        if (ctrl->pending >= 0) {
+            if (now - ctrl->sent < ENCODER_PENDING_TIMEOUT)
+                continue;
+            logwarn("Encoder on GPIO %d: no reply to request %d, giving up",
+                    ctrl->gpio_encoder->pin_a, ctrl->pending);
+            ctrl->pending = -1;
+        }
+        
+        //
+        //  Only the newest volume is sent, nothing if it didn't change
         //
-        int delta = (int)(encoder_ctrls[cnt].gpio_encoder->value - encoder_ctrls[cnt].last_value);
-        if (delta > 100)
-            delta = 0;  //
+        if (absolute) {
+            if (!known || (volume->level == volume->sent))
+                continue;
+            sbpd_request_t request = send_compiled(server, ctrl->target, &volumeSetCommand, 1, 0,
+                                                   volume->level);
+            if (request >= 0) {
+                volume->sent = volume->level;
+                ctrl->pending = request;
+                ctrl->sent = now;
+            }
+            continue;
+        }
+        
+        //
+        //  build volume delta, saturated in both directions
+        //  value is updated by the GPIO thread: read once
+        //
+        long value = ctrl->value;
+        long change = value - ctrl->last_value;
+        int delta = (int)MAX(MIN(change, max_encoder_delta), -max_encoder_delta);
         if (delta != 0) {
-            logdebug("Encoder on GPIO %d, %d value change: %d",
-                    encoder_ctrls[cnt].gpio_encoder->pin_a,
-                    encoder_ctrls[cnt].gpio_encoder->pin_b,
-                    delta);
-
-            char fragment[50];
-            char * prefix = (delta > 0) ? "+" : "-";
-            snprintf(fragment, sizeof(fragment),
-                     encoder_ctrls[cnt].fragment, prefix, abs(delta));
+            logdebug("Encoder on GPIO %d, %d value change: %ld, sending %d",
+                    ctrl->gpio_encoder->pin_a,
+                    ctrl->gpio_encoder->pin_b,
+                    change, delta);
+
+            sbpd_gesture_t gesture = (delta > 0) ? SBPD_gesture_cw : SBPD_gesture_ccw;
+            const struct sbpd_action * action = dispatch(pin, gesture, modifier);
+            if (!action) {
+                ctrl->last_value = value;
+                continue;
+            }
             
-            if (send_command(server, fragment)) {
-                encoder_ctrls[cnt].last_value = encoder_ctrls[cnt].gpio_encoder->value;
-                //lasttimeVol = time; // chatter filter
+            //
+            //  Not queued (too many requests): keep accumulating
+            //  Can't be sent at all: drop the movement instead of trying every poll
+            //
+            sbpd_request_t request = run_action(server, ctrl->target, action, abs(delta));
+            if (request >= 0) {
+                ctrl->last_value = value;
+                ctrl->pending = request;
+                ctrl->pending_change = change;
+                ctrl->sent = now;
+            } else if (request != SBPD_request_busy) {
+                logwarn("Encoder on GPIO %d: command can't be sent, movement dropped", pin);
+                ctrl->last_value = value;
             }
         }
     }
@@ -37,6 +37,8 @@
 
 #include "sbpd.h"
 #include "GPIO.h"
+#include "events.h"
+#include "servercomm.h"
 
 //
 //  Store command parameters for each button used
@@ -44,8 +46,10 @@
 struct button_ctrl
 {
     struct button * gpio_button;
+    sbpd_target_t target;       // player or group the commands go to
+    volatile bool value;        // last reported state
     volatile bool waiting;
-    char * fragment;
+    sbpd_time_t pressed;        // time of the press, retried until BUTTON_RETRY_TIMEOUT
 };
 
 //
@@ -57,13 +61,18 @@ struct button_ctrl
 //                  VOL-    - decrement volume
 //                  PREV    - previous track
 //                  NEXT    - next track
+//                  POWR    - toggle power
+//                  -       - none, actions defined by rules only
+//           Ignored with a static configuration, actions are defined by rules only
 //      pin: the GPIO-Pin-Number
 //      edge: one of
 //                  1 - falling edge
 //                  2 - rising edge
 //                  0, 3 - both
+//      player: MAC or name of the player to control, "@" in front for its
+//              sync group. NULL for the default player
 //
-int setup_button_ctrl(char * cmd, int pin, int edge);
+int setup_button_ctrl(char * cmd, int pin, int edge, const char * player);
 
 //
 //  Polling function: handle button commands
@@ -78,30 +87,64 @@ void handle_buttons(struct sbpd_server * server);
 struct encoder_ctrl
 {
     struct encoder * gpio_encoder;
-    volatile long last_value;
-    char * fragment;
+    sbpd_target_t target;       // player or group the commands go to
+    volatile long value;        // last reported value
+    volatile long last_value;   // value last sent to the server
+    sbpd_request_t pending;     // request in flight, -1: none
+    sbpd_time_t sent;           // time the pending request was sent
+    long pending_change;        // movement carried by the pending request
+    bool absolute;              // VOLA: set absolute volume from the volume model
 };
 //
 //  Setup encoder control
 //  Parameters:
 //      cmd: Command. Currently only
 //                  VOLU    - volume
-//          Can be NULL for volume or actually anything since it's ignored
+//                  VOLA    - absolute volume: sbpd keeps a model of the player volume
+//                            and sends the resulting volume instead of steps
+//                  -       - none, actions defined by rules only
+//          Can be NULL for volume, anything else is also treated as volume
+//          With a static configuration only VOLA is used, actions are defined by rules
 //      pin1: the GPIO-Pin-Number for the first pin used
 //      pin2: the GPIO-Pin-Number for the second pin used
 //      edge: one of
 //                  1 - falling edge
 //                  2 - rising edge
 //                  0, 3 - both
+//      player: MAC or name of the player to control, "@" in front for its
+//              sync group. NULL for the default player
 //
-int setup_encoder_ctrl(char * cmd, int pin1, int pin2, int edge);
+int setup_encoder_ctrl(char * cmd, int pin1, int pin2, int edge, const char * player);
 
 //
 //  Polling function: handle encoders
+//  One request per encoder is in flight, movement in the meantime is
+//  coalesced and sent as a single command when the request completed.
 //  Parameters:
 //      server: the server to send commands to
 //
 void handle_encoders(struct sbpd_server * server);
 
+//
+//  Input events
+//  GPIO callbacks create input events and pass them to the input sink.
+//  The default sink is control_input() which updates the control state.
+//
+typedef void (*input_sink_t)(const struct sbpd_event * event);
+
+//
+//  Apply an input event to the control state
+//  Parameters:
+//      event: input event
+//
+void control_input(const struct sbpd_event * event);
+
+//
+//  Redirect input events
+//  Used to forward input from the GPIO process to the network process
+//  Parameters:
+//      sink: the new sink, NULL for control_input
+//
+void set_input_sink(input_sink_t sink);
 
 #endif /* control_h */
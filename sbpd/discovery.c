@@ -38,11 +38,15 @@
 
 #include "discovery.h"
 #include "sbpd.h"
+#include "timing.h"
+#include "events.h"
+#include "netlink.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -58,6 +62,7 @@ void update_server(sbpd_config_parameters_t * discovered,
                    struct sbpd_server * server);
 void update_port();
 void _write_server_string(struct sbpd_server * server, in_addr_t s_addr);
+void _publish_server(in_addr_t s_addr, uint32_t port);
 bool get_serverIPv4(uint32_t *ip);
 void send_discovery(uint32_t address);
 uint32_t read_discovery(uint32_t address);
@@ -66,6 +71,7 @@ bool get_mac(uint8_t mac[]);
 
 
 #define IP_SEARCH_TIMEOUT 3 // every 3 s
+#define IP_SEARCH_STARTUP_TIMEOUT 500 // every 500 ms until a server was found
 
 //
 //  Polling function for server discovery
@@ -74,14 +80,27 @@ bool get_mac(uint8_t mac[]);
 //
 
 //
-// counter for search scheduling
+// deadline for search scheduling. 0: search on first poll
 //
-static uint32_t search_timer = 0;
+static sbpd_time_t next_search = 0;
+//
+//  Where player connections are read from
+//
+static const char * connectionSource = "/proc/net/tcp";
 //
 //  Helper variable; don't want to convert back and forth between string and net-addr
 //
 static in_addr_t foundAddr = 0;
 //
+//  Port known from cache, verify through discovery
+//
+static bool verifyPort = false;
+//
+//  Additional discovery results
+//
+static char discoveredUUID[64];
+static uint32_t discoveredCliPort = 0;
+//
 //  Parameters:
 //  config: defines which parameters are preconfigured and will not be discovered
 //  discovered: the discovered parameters
@@ -91,12 +110,16 @@ void poll_discovery(sbpd_config_parameters_t config,
                     sbpd_config_parameters_t *discovered,
                     struct sbpd_server * server) {
     //logdebug("Polling server discovery");
+    sbpd_config_parameters_t previous = *discovered;
     //
     // search for server
     //
     if (!(config & SBPD_cfg_host)) {
-        if (!search_timer--) {
-            search_timer = IP_SEARCH_TIMEOUT * SCD_SECOND / SCD_SLEEP_TIMEOUT;
+        sbpd_time_t now = clock_now();
+        if (now >= next_search) {
+            next_search = now + ((*discovered & SBPD_cfg_host) ?
+                                 IP_SEARCH_TIMEOUT * SCD_SECOND :
+                                 IP_SEARCH_STARTUP_TIMEOUT * SCD_MILLISECOND);
             in_addr_t addr = 0;
             if (server->host)
                 addr = inet_addr(server->host);
@@ -111,8 +134,10 @@ void poll_discovery(sbpd_config_parameters_t config,
                 foundAddr = addr;
                 
                 // we don't update server struct, yet, if we also look for the port.
-                if (config & SBPD_cfg_port)
+                if (config & SBPD_cfg_port) {
                     _write_server_string(server, addr);
+                    _publish_server(addr, server->port);
+                }
                 // otherwise: look for port
                 else
                     send_discovery(addr);
@@ -123,18 +148,74 @@ void poll_discovery(sbpd_config_parameters_t config,
     // only search if configured to do so and port is not yet found
     //
     if (!(config & SBPD_cfg_port) &&
-        !(*discovered & SBPD_cfg_port)) {
+        (!(*discovered & SBPD_cfg_port) || verifyPort)) {
         logdebug("Looking for port");
         uint32_t foundPort = read_discovery(foundAddr);
-        if (foundPort) {
+        if (foundPort && verifyPort && (foundPort == server->port)) {
+            loginfo("Cached server confirmed");
+            server->cli_port = discoveredCliPort;
+            server->uuid = discoveredUUID;
+        } else if (foundPort) {
             loginfo("Squeezebox control port found: %d", foundPort);
             if (!(config & SBPD_cfg_host))
                 _write_server_string(server, foundAddr);
             server->port = foundPort;
+            server->cli_port = discoveredCliPort;
+            server->uuid = discoveredUUID;
             *discovered |= SBPD_cfg_port;
+            _publish_server(inet_addr(server->host), foundPort);
         }
+        if (foundPort)
+            verifyPort = false;
+    }
+    if (*discovered != previous) {
+        struct sbpd_event event = {
+            .type = SBPD_evt_discovery,
+            .discovery = { *discovered }
+        };
+        publish_event(&event);
+    }
+}
+
+//
+//  Read player connections from another file
+//
+void set_discovery_source(const char * path) {
+    connectionSource = (path) ? path : "/proc/net/tcp";
+}
 
+//
+//  Seed discovery with a previously known server
+//
+void seed_discovery(sbpd_config_parameters_t config,
+                    sbpd_config_parameters_t *discovered,
+                    struct sbpd_server * server) {
+    in_addr_t addr = inet_addr(server->host);
+    if (!(config & SBPD_cfg_host)) {
+        foundAddr = addr;
+        _write_server_string(server, addr);
+        *discovered |= SBPD_cfg_host;
     }
+    if (!(config & SBPD_cfg_port)) {
+        *discovered |= SBPD_cfg_port;
+        //
+        //  Verify the port in the background
+        //
+        verifyPort = true;
+        send_discovery(addr);
+    }
+    _publish_server(addr, server->port);
+}
+
+//
+//  Helper function to announce a new server endpoint
+//
+void _publish_server(in_addr_t s_addr, uint32_t port) {
+    struct sbpd_event event = {
+        .type = SBPD_evt_server,
+        .server = { s_addr, port }
+    };
+    publish_event(&event);
 }
 
 //
@@ -169,6 +250,43 @@ enum {
     
     TCP_MAX_STATES  // Leave at the end!
 };
+//
+//  Line reader for /proc files with a fixed buffer
+//  stdio would allocate a FILE and its buffer on every scan
+//
+struct line_reader {
+    int fd;
+    size_t start;
+    size_t end;
+    char buffer[4096];
+};
+
+//
+//  Read the next line into line, truncated to size
+//  Returns false at end of file
+//
+static bool read_line(struct line_reader * reader, char * line, size_t size) {
+    size_t length = 0;
+    while (true) {
+        if (reader->start == reader->end) {
+            ssize_t count = read(reader->fd, reader->buffer, sizeof(reader->buffer));
+            if (count <= 0) {
+                line[length] = 0;
+                return length > 0;
+            }
+            reader->start = 0;
+            reader->end = count;
+        }
+        char c = reader->buffer[reader->start++];
+        if (length + 1 < size)
+            line[length++] = c;
+        if (c == '\n') {
+            line[length] = 0;
+            return true;
+        }
+    }
+}
+
 //
 //
 // Get server IP from /proc/net/tcp
@@ -178,16 +296,18 @@ enum {
 //
 bool get_serverIPv4(uint32_t *ip) {
     uint32_t foundIp;
-    FILE * procTcp = fopen("/proc/net/tcp", "r");
-    if (!procTcp)
+    static struct line_reader procTcp;
+    procTcp.fd = open(connectionSource, O_RDONLY);
+    procTcp.start = procTcp.end = 0;
+    if (procTcp.fd < 0)
         return false;
     char line[256];
-    if (!fgets(line, 255, procTcp)) {
-        fclose(procTcp);
+    if (!read_line(&procTcp, line, sizeof(line))) {
+        close(procTcp.fd);
         return false;
     }
     bool found = false;
-    while (fgets(line, 255, procTcp)) {
+    while (read_line(&procTcp, line, sizeof(line))) {
         logdebug("/proc/net/tcp line: %s", line);
         strtok(line, " "); // line number
         strtok(NULL, " "); // source address
@@ -196,7 +316,7 @@ bool get_serverIPv4(uint32_t *ip) {
         logdebug("target: %s\n", target);
         if (!target) {
             logwarn("no tcp target found");
-            fclose(procTcp);
+            close(procTcp.fd);
             return false;
         }
         char * ipString = strtok(target, ":");
@@ -208,7 +328,7 @@ bool get_serverIPv4(uint32_t *ip) {
                 logwarn("no portString found");
             if (!socketState)
                 logwarn("no socketState found");
-            fclose(procTcp);
+            close(procTcp.fd);
             return false;
         }
         char * portComp = "0D9B";
@@ -234,7 +354,7 @@ bool get_serverIPv4(uint32_t *ip) {
                 loginfo("Found server %s. A new address", ipString);
                 // no logging: we're done
                 if (loglevel() < LOG_NOTICE) {
-                    fclose(procTcp);
+                    close(procTcp.fd);
                     return true;
                 }
                 found = true;
@@ -242,18 +362,18 @@ bool get_serverIPv4(uint32_t *ip) {
             loginfo("Found server %s. Same as before");
             // no logging? we're done
             if (loglevel() < LOG_NOTICE) {
-                fclose(procTcp);
+                close(procTcp.fd);
                 return false;
             }
         }
     }
-    fclose(procTcp);
+    close(procTcp.fd);
     return found;
 }
 
 static int udpSocket = 0;
 static uint32_t udpAddress;
-# define SIZE_SERVER_DISCOVERY_LONG 23
+# define SIZE_SERVER_DISCOVERY_LONG 28
 # define SBS_UDP_PORT 3483
 
 //
@@ -281,7 +401,7 @@ void send_discovery(uint32_t address) {
     addr4.sin_port = htons(SBS_UDP_PORT);
     addr4.sin_addr.s_addr = address;
     
-    char * data = "eIPAD\0NAME\0JSON\0UUID\0\0\0";
+    char * data = "eIPAD\0NAME\0JSON\0UUID\0CLIP\0\0\0";
     
     ssize_t error;
     error = sendto(udpSocket, data, SIZE_SERVER_DISCOVERY_LONG, 0, (struct sockaddr*)&addr4, sizeof(addr4));
@@ -317,42 +437,32 @@ uint32_t read_discovery(uint32_t address) {
     
     logdebug("Server discovery: packet found");
     unsigned int pos = 1;
-    char code[5];
-    code[4] = 0;
-    // this is the whole packet interpretation for debug purposes
-    // not needed in final code
     char port[6];
     strncpy(port, "9000\0", 6);
-    if (loglevel() >= LOG_NOTICE) {
-        char name[256];
-        memset(name, 0, sizeof(name));
-        char UUID[256];
-        memset(UUID, 0, sizeof(UUID));
-        while (pos < (size - 5)) {
-            unsigned int fieldLen = buffer[pos + 4];
-            uint32_t * selector = (uint32_t *)(buffer + pos);
-            if (*selector == STRTOU32("NAME")) {
-                strncpy(name, buffer + pos + 5, MIN(fieldLen, sizeof(name)));
-            } else if (*selector == STRTOU32("JSON")) {
-                strncpy(port, buffer + pos + 5, MIN(fieldLen, sizeof(port)));
-            } else if (*selector == STRTOU32("UUID")) {
-                strncpy(UUID, buffer + pos + 5, MIN(fieldLen, sizeof(UUID)));
-            }
-            pos += fieldLen + 5;
-        }
-        loginfo("discovery packet: port: %s, name: %s, uuid: %s", port, name, UUID);
-    } else {
-        while (pos < (size - 5)) {
-            unsigned int fieldLen = buffer[pos + 4];
-            uint32_t * selector = (uint32_t *)(buffer + pos);
-            if (*selector == STRTOU32("JSON")) {
-                strncpy(port, buffer + pos + 5, MIN(fieldLen, sizeof(port)));
-            }
-            pos += fieldLen + 5;
+    char cliPort[6];
+    memset(cliPort, 0, sizeof(cliPort));
+    char name[256];
+    memset(name, 0, sizeof(name));
+    memset(discoveredUUID, 0, sizeof(discoveredUUID));
+    while (pos < (size - 5)) {
+        unsigned int fieldLen = (uint8_t)buffer[pos + 4];
+        uint32_t * selector = (uint32_t *)(buffer + pos);
+        if (*selector == STRTOU32("NAME")) {
+            strncpy(name, buffer + pos + 5, MIN(fieldLen, sizeof(name) - 1));
+        } else if (*selector == STRTOU32("JSON")) {
+            strncpy(port, buffer + pos + 5, MIN(fieldLen, sizeof(port) - 1));
+        } else if (*selector == STRTOU32("CLIP")) {
+            strncpy(cliPort, buffer + pos + 5, MIN(fieldLen, sizeof(cliPort) - 1));
+        } else if (*selector == STRTOU32("UUID")) {
+            strncpy(discoveredUUID, buffer + pos + 5, MIN(fieldLen, sizeof(discoveredUUID) - 1));
         }
-        loginfo("discovery packet: port: %s", port);
+        pos += fieldLen + 5;
     }
+    loginfo("discovery packet: port: %s, cli port: %s, name: %s, uuid: %s",
+            port, cliPort, name, discoveredUUID);
+    discoveredCliPort = (uint32_t)strtoul(cliPort, NULL, 10);
     close(udpSocket);
+    udpSocket = 0;
     
     return (uint32_t)strtoul(port, NULL, 10);
 }
@@ -362,10 +472,8 @@ uint32_t read_discovery(uint32_t address) {
 // MAC address search
 //
 // mac address. From SqueezeLite so should match that behaviour.
-// search first 4 interfaces returned by IFCONF
+// search interfaces in the order returned by IFCONF
 //
-//  Parameters:
-//  config: defines which parameters are preconfigured and will not be discovered
 //  returns: MAC string
 //
 char * find_mac() {
@@ -385,17 +493,14 @@ char * find_mac() {
 // Actualy MAC address search
 //
 // mac address. From SqueezeLite so should match that behaviour.
-// search first 4 interfaces returned by IFCONF
+// search interfaces in the order returned by IFCONF (IPv4 address order)
+// Unlike SqueezeLite all interfaces are searched, not only the first 4.
 //
 // Returns 6 bytes MAC.
 //
 bool get_mac(uint8_t mac[]) {
 #ifdef __unix__ // just to silence errors on Mac while developing
     char *utmac;
-    struct ifconf ifc;
-    struct ifreq *ifr, *ifend;
-    struct ifreq ifreq;
-    struct ifreq ifs[4];
     
     utmac = getenv("UTMAC");
     if (utmac)
@@ -413,30 +518,11 @@ bool get_mac(uint8_t mac[]) {
     
     mac[0] = mac[1] = mac[2] = mac[3] = mac[4] = mac[5] = 0;
     
-    int s = socket(AF_INET, SOCK_DGRAM, 0);
-    
-    ifc.ifc_len = sizeof(ifs);
-    ifc.ifc_req = ifs;
-    
-    if (ioctl(s, SIOCGIFCONF, &ifc) == 0) {
-        ifend = ifs + (ifc.ifc_len / sizeof(struct ifreq));
-        
-        for (ifr = ifc.ifc_req; ifr < ifend; ifr++) {
-            if (ifr->ifr_addr.sa_family == AF_INET) {
-                
-                strncpy(ifreq.ifr_name, ifr->ifr_name, sizeof(ifreq.ifr_name));
-                if (ioctl (s, SIOCGIFHWADDR, &ifreq) == 0) {
-                    memcpy(mac, ifreq.ifr_hwaddr.sa_data, 6);
-                    if (mac[0]+mac[1]+mac[2] != 0) {
-                        close(s);
-                        return true;
-                    }
-                }
-            }
-        }
-    }
-    
-    close(s);
+    //
+    //  Same priority as SIOCGIFCONF in SqueezeLite, but across all interfaces
+    //
+    if (netlink_get_mac(mac))
+        return true;
 #endif
     return false;
 }
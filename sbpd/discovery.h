@@ -51,17 +51,35 @@ void poll_discovery(sbpd_config_parameters_t config,
                     sbpd_config_parameters_t *discovered,
                     struct sbpd_server * server);
 
+//
+//  Seed discovery with a previously known server, e.g. from the state cache
+//  The server is used right away and verified by discovery in the background
+//
+//  Parameters:
+//  config: defines which parameters are preconfigured and will not be discovered
+//  discovered: the discovered parameters
+//  server: server configuration with host and port set
+//
+void seed_discovery(sbpd_config_parameters_t config,
+                    sbpd_config_parameters_t *discovered,
+                    struct sbpd_server * server);
+
+//
+//  Read player connections from another file than /proc/net/tcp
+//  Same format, used by tests and replays
+//
+//  Parameters:
+//  path: the file, NULL for /proc/net/tcp
+//
+void set_discovery_source(const char * path);
 
 //
 // MAC address search
 //
 // mac address. From SqueezeLite so should match that behaviour.
-// search first 4 interfaces returned by IFCONF
+// search interfaces in the order returned by IFCONF
 //
-//  Parameters:
-//  config: defines which parameters are preconfigured and will not be discovered
-//  discovered: the discovered parameters
-//  server: server configuration
+//  returns: MAC string
 //
 char * find_mac();
 
@@ -0,0 +1,448 @@
+//
+//  dispatch.c
+//  SqueezeButtonPi
+//
+//  Map control input to actions
+//  - Built-in commands and rule file parsing
+//  - Compile rules into a flat dispatch table: one lookup per input event
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "dispatch.h"
+#include "sbpd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#ifdef SBPD_STATIC_CONFIG
+#include "sbpd_config.h"
+#endif
+
+//
+//  The dispatch table
+//  Indexed by pin, gesture and modifier slot, contains action index + 1 (0: none)
+//  Unmodified rules are in slot 0 and apply to all modifier slots without a rule of their own
+//
+#define DISPATCH_INDEX(pin, gesture, modifier) \
+    (((pin) * SBPD_gestures + (gesture)) * (max_modifiers + 1) + (modifier))
+#define DISPATCH_TABLE_SIZE (max_pins * SBPD_gestures * (max_modifiers + 1))
+
+#ifdef SBPD_STATIC_CONFIG
+//
+//  Static configuration
+//  Actions, modifiers and the dispatch table are built by the compiler
+//  from the X-macro tables. Later rules for the same input win.
+//
+#define RULE_ENUM(name, pin, gesture, modifier, steps, depends, text) \
+    SBPD_rule_##name,
+#define RULE_ACTION(name, pin, gesture, modifier, steps, depends, text) \
+    { steps, depends, text },
+#define RULE_DISPATCH(name, pin, gesture, modifier, steps, depends, text) \
+    [DISPATCH_INDEX(pin, SBPD_gesture_##gesture, SBPD_modifier_##modifier)] = SBPD_rule_##name + 1,
+#define MODIFIER_ENUM(name, pin) SBPD_modifier_##name,
+#define MODIFIER_PIN(name, pin) pin,
+
+enum { SBPD_modifier_none = 0, SBPD_MODIFIERS(MODIFIER_ENUM) SBPD_modifier_end };
+enum { SBPD_RULES(RULE_ENUM) SBPD_rule_end };
+_Static_assert(SBPD_modifier_end - 1 <= max_modifiers, "Too many modifiers");
+_Static_assert(SBPD_rule_end <= max_actions, "Too many rules");
+
+static const struct sbpd_action actions[] = { SBPD_RULES(RULE_ACTION) };
+static const int modifiers[max_modifiers + 1] = { -1, SBPD_MODIFIERS(MODIFIER_PIN) };
+static const int numberofmodifiers = SBPD_modifier_end - 1;
+static const uint8_t dispatch_table[DISPATCH_TABLE_SIZE] = { SBPD_RULES(RULE_DISPATCH) };
+static const int numberofactions = SBPD_rule_end;
+
+#else
+
+//
+//  Built-in commands
+//  Encoders use the "ccw" fragment for counter clockwise turns
+//
+static const struct {
+    char code[5];
+    const char * fragment;
+    const char * fragment_ccw;
+} builtins[] = {
+    { "PLAY", FRAGMENT_PAUSE, NULL },
+    { "VOL+", FRAGMENT_VOLUME_UP, NULL },
+    { "VOL-", FRAGMENT_VOLUME_DOWN, NULL },
+    { "PREV", FRAGMENT_PREV, NULL },
+    { "NEXT", FRAGMENT_NEXT, NULL },
+    { "POWR", FRAGMENT_POWER, NULL },
+    { "VOLU", FRAGMENT_VOLUME_PLUS, FRAGMENT_VOLUME_MINUS },
+};
+
+//
+//  Rules as added, compiled into the dispatch table later
+//
+struct rule {
+    int pin;
+    sbpd_gesture_t gesture;
+    int modifier;           // modifier pin or -1
+    int action;             // index into actions
+};
+
+static struct rule rules[max_rules];
+static int numberofrules = 0;
+static struct sbpd_action actions[max_actions];
+static char action_texts[max_actions][max_action_text];
+static int numberofactions = 0;
+static int modifiers[max_modifiers + 1];   // slot 0 unused: "no modifier"
+static int numberofmodifiers = 0;
+static uint8_t dispatch_table[DISPATCH_TABLE_SIZE];
+
+//
+//  Get the fragment for a command
+//  Returns NULL for unknown commands
+//
+static const char * command_fragment(const char * command, sbpd_gesture_t gesture) {
+    if (command[0] == '[')
+        return command;
+    if (strlen(command) != 4)
+        return NULL;
+    for (int cnt = 0; cnt < sizeof(builtins) / sizeof(builtins[0]); cnt++) {
+        if (STRTOU32(builtins[cnt].code) == STRTOU32(command))
+            return ((gesture == SBPD_gesture_ccw) && builtins[cnt].fragment_ccw) ?
+                builtins[cnt].fragment_ccw : builtins[cnt].fragment;
+    }
+    return NULL;
+}
+
+//
+//  Length of the text of an action, including all NULs
+//
+static size_t action_length(const struct sbpd_action * action) {
+    const char * end = action->text;
+    for (int step = 0; step < action->steps; step++)
+        end += strlen(end) + 1;
+    return end - action->text;
+}
+
+//
+//  Parse a command or macro into an action
+//  Commands are separated by ";" outside of JSON strings
+//  The command templates are written to text (max_action_text bytes)
+//  Returns false on error
+//
+static bool parse_action(const char * command, sbpd_gesture_t gesture,
+                         struct sbpd_action * action, char * text) {
+    char copy[max_action_text];
+    if (strlen(command) >= sizeof(copy))
+        return false;
+    strcpy(copy, command);
+    memset(action, 0, sizeof(*action));
+    action->text = text;
+    size_t used = 0;
+    char * step = copy;
+    bool quoted = false;
+    for (char * pos = copy; ; pos++) {
+        if (*pos == '"' && (pos == copy || pos[-1] != '\\'))
+            quoted = !quoted;
+        if ((*pos && *pos != ';') || (*pos == ';' && quoted))
+            continue;
+        bool last = !*pos;
+        *pos = 0;
+        //
+        //  Trim and check for dependency flag
+        //
+        while (isspace((unsigned char)*step))
+            step++;
+        char * end = step + strlen(step);
+        while ((end > step) && isspace((unsigned char)end[-1]))
+            *--end = 0;
+        bool depends = (*step == '&');
+        if (depends)
+            step++;
+        while (isspace((unsigned char)*step))
+            step++;
+        if (*step) {
+            const char * fragment = command_fragment(step, gesture);
+            if (!fragment || (action->steps == max_steps))
+                return false;
+            size_t len = strlen(fragment);
+            if ((len >= max_fragment) || (used + len + 1 > max_action_text))
+                return false;
+            if (depends)
+                action->depends |= 1 << action->steps;
+            action->steps++;
+            strcpy(text + used, fragment);
+            used += len + 1;
+        }
+        if (last)
+            break;
+        step = pos + 1;
+    }
+    return action->steps > 0;
+}
+
+//
+//  Find or create an action
+//  Returns the action index or -1
+//
+static int get_action(const struct sbpd_action * action) {
+    size_t length = action_length(action);
+    for (int cnt = 0; cnt < numberofactions; cnt++) {
+        if ((actions[cnt].steps == action->steps) &&
+            (actions[cnt].depends == action->depends) &&
+            (action_length(actions + cnt) == length) &&
+            !memcmp(actions[cnt].text, action->text, length))
+            return cnt;
+    }
+    if (numberofactions == max_actions) {
+        logerr("Maximum number of actions exceeded: %i", max_actions);
+        return -1;
+    }
+    memcpy(action_texts[numberofactions], action->text, length);
+    actions[numberofactions] = *action;
+    actions[numberofactions].text = action_texts[numberofactions];
+    return numberofactions++;
+}
+
+//
+//  Add a rule
+//
+int add_rule(int pin, sbpd_gesture_t gesture, int modifier, const char * command) {
+    if ((pin < 0) || (pin >= max_pins) || (modifier >= max_pins) ||
+        (gesture < 0) || (gesture >= SBPD_gestures)) {
+        logerr("Invalid rule for pin %d: %s", pin, command);
+        return -1;
+    }
+    if (numberofrules == max_rules) {
+        logerr("Maximum number of rules exceeded: %i", max_rules);
+        return -1;
+    }
+    struct sbpd_action parsed;
+    char text[max_action_text];
+    if (!parse_action(command, gesture, &parsed, text)) {
+        logerr("Invalid command for pin %d: %s", pin, command);
+        return -1;
+    }
+    int action = get_action(&parsed);
+    if (action < 0)
+        return -1;
+    struct rule * rule = rules + numberofrules++;
+    rule->pin = pin;
+    rule->gesture = gesture;
+    rule->modifier = (modifier < 0) ? -1 : modifier;
+    rule->action = action;
+    loginfo("Rule defined: Pin %d, Gesture: %d, Modifier: %d, Commands: %d, Fragment: %s",
+            pin, gesture, rule->modifier, parsed.steps, parsed.text);
+    return 0;
+}
+
+//
+//  Parse a BCM GPIO number from the rule file
+//  Returns -1 if it isn't a complete number in 0..max_pins-1
+//
+static int parse_pin(const char * text) {
+    char * end = NULL;
+    errno = 0;
+    long pin = strtol(text, &end, 10);
+    if ((end == text) || *end || errno || (pin < 0) || (pin >= max_pins))
+        return -1;
+    return (int)pin;
+}
+
+//
+//  Read rules from a file
+//
+int load_rules(const char * path) {
+    FILE * file = fopen(path, "r");
+    if (!file) {
+        logerr("Could not open rule file %s", path);
+        return -1;
+    }
+    char line[256];
+    int count = 0;
+    int lineno = 0;
+    while (fgets(line, sizeof(line), file)) {
+        lineno++;
+        char * end = line + strlen(line);
+        while ((end > line) && isspace((unsigned char)end[-1]))
+            *--end = 0;
+        char * save = NULL;
+        char * pin = strtok_r(line, " \t", &save);
+        if (!pin || (pin[0] == '#'))
+            continue;
+        char * gesture = strtok_r(NULL, " \t", &save);
+        char * modifier = strtok_r(NULL, " \t", &save);
+        char * command = strtok_r(NULL, "", &save);
+        while (command && isspace((unsigned char)*command))
+            command++;
+        if (!gesture || !modifier || !command || !*command) {
+            logwarn("Rule file %s, line %d: incomplete rule", path, lineno);
+            continue;
+        }
+        sbpd_gesture_t g;
+        if (!strcmp(gesture, "press"))
+            g = SBPD_gesture_press;
+        else if (!strcmp(gesture, "cw"))
+            g = SBPD_gesture_cw;
+        else if (!strcmp(gesture, "ccw"))
+            g = SBPD_gesture_ccw;
+        else {
+            logwarn("Rule file %s, line %d: unknown gesture %s", path, lineno, gesture);
+            continue;
+        }
+        int p = parse_pin(pin);
+        if (p < 0) {
+            logwarn("Rule file %s, line %d: invalid pin %s", path, lineno, pin);
+            continue;
+        }
+        int m = -1;
+        if (strcmp(modifier, "-") && ((m = parse_pin(modifier)) < 0)) {
+            logwarn("Rule file %s, line %d: invalid modifier %s", path, lineno, modifier);
+            continue;
+        }
+        if (!add_rule(p, g, m, command))
+            count++;
+    }
+    fclose(file);
+    loginfo("%d rules read from %s", count, path);
+    return count;
+}
+
+//
+//  Get the slot for a modifier pin, allocate if needed
+//  Returns 0 if there are no more slots
+//
+static int modifier_slot(int pin) {
+    for (int slot = 1; slot <= numberofmodifiers; slot++)
+        if (modifiers[slot] == pin)
+            return slot;
+    if (numberofmodifiers == max_modifiers) {
+        logerr("Maximum number of modifiers exceeded: %i", max_modifiers);
+        return 0;
+    }
+    modifiers[++numberofmodifiers] = pin;
+    return numberofmodifiers;
+}
+
+//
+//  Compile all rules into the dispatch table
+//  Unmodified rules go to slot 0. Later rules win.
+//
+void compile_dispatch() {
+    memset(dispatch_table, 0, sizeof(dispatch_table));
+    for (struct rule * rule = rules; rule < rules + numberofrules; rule++) {
+        int slot = (rule->modifier < 0) ? 0 : modifier_slot(rule->modifier);
+        if ((rule->modifier < 0) || slot)
+            dispatch_table[DISPATCH_INDEX(rule->pin, rule->gesture, slot)] = rule->action + 1;
+    }
+    loginfo("Dispatch table compiled: %d rules, %d actions, %d modifiers",
+            numberofrules, numberofactions, numberofmodifiers);
+}
+#endif
+
+//
+//  Compiled commands
+//  Actions refer to their first command + 1, the steps follow. 0: not compiled
+//
+static struct sbpd_command commands[max_commands];
+static int firstCommand[max_actions];
+
+void compile_actions() {
+    int used = 0;
+    for (int action = 0; action < numberofactions; action++) {
+        firstCommand[action] = 0;
+        if (used + actions[action].steps > max_commands) {
+            logwarn("Maximum number of compiled commands exceeded: %i", max_commands);
+            continue;
+        }
+        const char * text = actions[action].text;
+        int step = 0;
+        for (; step < actions[action].steps; step++, text += strlen(text) + 1)
+            if (!compile_command(commands + used + step, text))
+                break;
+        if (step < actions[action].steps) {
+            logwarn("Could not compile command: %s", text);
+            continue;
+        }
+        firstCommand[action] = used + 1;
+        used += step;
+    }
+    loginfo("%d commands compiled", used);
+}
+
+const struct sbpd_command * action_commands(const struct sbpd_action * action) {
+    int first = firstCommand[action - actions];
+    return (first) ? commands + first - 1 : NULL;
+}
+
+//
+//  Look up the action for an input
+//
+const struct sbpd_action * dispatch(int pin, sbpd_gesture_t gesture, int modifier) {
+    if ((unsigned)pin >= max_pins || (unsigned)gesture >= SBPD_gestures ||
+        (unsigned)modifier > max_modifiers)
+        return NULL;
+    uint8_t action = dispatch_table[DISPATCH_INDEX(pin, gesture, modifier)];
+    if (!action && modifier)
+        action = dispatch_table[DISPATCH_INDEX(pin, gesture, 0)];
+    return (action) ? actions + action - 1 : NULL;
+}
+
+int number_of_modifiers() {
+    return numberofmodifiers;
+}
+
+int modifier_pin(int slot) {
+    return ((slot > 0) && (slot <= numberofmodifiers)) ? modifiers[slot] : -1;
+}
+
+//
+//  Render a command fragment of an action
+//  "%d" is replaced by steps, everything else is copied verbatim
+//
+int render_action(const struct sbpd_action * action, int step, int steps,
+                  char * buffer, size_t size) {
+    if ((step < 0) || (step >= action->steps))
+        return -1;
+    const char * src = action->text;
+    while (step--)
+        src += strlen(src) + 1;
+    size_t len = 0;
+    while (*src) {
+        if ((src[0] == '%') && (src[1] == 'd')) {
+            int written = snprintf(buffer + len, size - len, "%d", steps);
+            if ((written < 0) || (written >= size - len))
+                return -1;
+            len += written;
+            src += 2;
+            continue;
+        }
+        if (len + 1 >= size)
+            return -1;
+        buffer[len++] = *src++;
+    }
+    buffer[len] = 0;
+    return (int)len;
+}
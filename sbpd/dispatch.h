@@ -0,0 +1,194 @@
+//
+//  dispatch.h
+//  SqueezeButtonPi
+//
+//  Map control input to actions
+//  Rules are compiled into a flat dispatch table at startup
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef dispatch_h
+#define dispatch_h
+
+#include "sbpd.h"
+#include "servercomm.h"
+
+//
+//  Gestures
+//  Buttons are "pressed", encoders turn in one of two directions
+//
+typedef enum {
+    SBPD_gesture_press = 0,     // button triggered
+    SBPD_gesture_cw,            // encoder value increasing
+    SBPD_gesture_ccw,           // encoder value decreasing
+
+    SBPD_gestures               // number of gestures. Leave at the end!
+} sbpd_gesture_t;
+
+//
+//  Command fragments of the built-in commands
+//
+//  Buttons
+//
+#define FRAGMENT_PAUSE          "[\"pause\"]"
+#define FRAGMENT_VOLUME_UP      "[\"button\",\"volume_up\"]"
+#define FRAGMENT_VOLUME_DOWN    "[\"button\",\"voldown\"]"
+#define FRAGMENT_PREV           "[\"button\",\"rew\"]"
+#define FRAGMENT_NEXT           "[\"button\",\"fwd\"]"
+#define FRAGMENT_POWER          "[\"button\",\"power\"]"
+//
+//  Encoder
+//
+#define FRAGMENT_VOLUME_PLUS    "[\"mixer\",\"volume\",\"+%d\"]"
+#define FRAGMENT_VOLUME_MINUS   "[\"mixer\",\"volume\",\"-%d\"]"
+#define FRAGMENT_VOLUME_SET     "[\"mixer\",\"volume\",\"%d\"]"
+#define FRAGMENT_VOLUME_QUERY   "[\"mixer\",\"volume\",\"?\"]"
+
+//
+//  Limits
+//
+#define max_pins        64      // BCM GPIO numbers 0..63
+#define max_modifiers   3       // buttons usable as modifiers
+#define max_rules       64
+#define max_actions     64
+#define max_fragment    160     // JSON command template length
+#define max_steps       8       // commands per macro action
+#define max_action_text 512     // all commands of an action
+#define max_commands    64      // compiled commands of all actions
+
+//
+//  An action
+//  A single command or a macro: an ordered list of commands.
+//  Each command is a JSON array command template,
+//  "%d" is replaced by the number of encoder steps
+//      steps: number of commands
+//      depends: bit n set: command n needs the reply to command n - 1
+//      text: the command templates, each NUL terminated
+//
+struct sbpd_action {
+    int steps;
+    uint8_t depends;
+    const char * text;
+};
+
+//
+//  Rules
+//  Built with SBPD_STATIC_CONFIG the rules come from the X-macro tables in
+//  sbpd_config.h instead and the dispatch table is constant data.
+//  See sbpd_config.example.h
+//
+#ifndef SBPD_STATIC_CONFIG
+//
+//  Add a rule
+//  Parameters:
+//      pin: the GPIO pin of the control (first pin for encoders)
+//      gesture: the gesture triggering the action
+//      modifier: GPIO pin of a button that needs to be held, -1 for none
+//      command: the command. Either a built-in name:
+//                  PLAY    - play/pause
+//                  VOL+    - increment volume
+//                  VOL-    - decrement volume
+//                  PREV    - previous track
+//                  NEXT    - next track
+//                  POWR    - toggle power state
+//                  VOLU    - volume up/down by encoder steps (encoders only)
+//               or a JSON command array like ["favorites","playlist","play","item_id:3"]
+//               or a macro: a list of the above separated by ";"
+//               Commands in a macro are sent in order, back to back.
+//               Prefix a command with "&" to hold it until the previous one replied
+//               and only send it if that succeeded:
+//                  POWR; ["mixer","volume","30"]; &["favorites","playlist","play","item_id:3"]
+//  Returns: 0 on success, -1 on error
+//
+int add_rule(int pin, sbpd_gesture_t gesture, int modifier, const char * command);
+
+//
+//  Read rules from a file
+//  One rule per line:
+//      pin gesture modifier command
+//          pin: GPIO pin in BCM notation (first pin for encoders)
+//          gesture: "press" for buttons, "cw" or "ccw" for encoders
+//          modifier: GPIO pin of a button that needs to be held or "-"
+//          command: see add_rule(), the rest of the line
+//  Empty lines and lines starting with "#" are ignored.
+//  Rules read later override earlier rules for the same input
+//  Returns: number of rules read or -1 if the file could not be read
+//
+int load_rules(const char * path);
+
+//
+//  Compile all rules into the dispatch table
+//  Call once after all rules were added
+//
+void compile_dispatch();
+#endif
+
+//
+//  Look up the action for an input
+//  Parameters:
+//      pin: the GPIO pin of the control
+//      gesture: the gesture
+//      modifier: modifier slot: 0 for none, 1...number_of_modifiers()
+//  Returns: the action or NULL if there is none
+//
+const struct sbpd_action * dispatch(int pin, sbpd_gesture_t gesture, int modifier);
+
+//
+//  Modifiers
+//  number_of_modifiers: number of modifier slots in use
+//  modifier_pin: the GPIO pin for a modifier slot 1...number_of_modifiers()
+//
+int number_of_modifiers();
+int modifier_pin(int slot);
+
+//
+//  Compile the commands of all actions, see compile_command()
+//  Call once the rules are complete
+//
+void compile_actions();
+
+//
+//  The compiled commands of an action, one per step
+//  Returns: NULL if the action could not be compiled, use render_action() then
+//
+const struct sbpd_command * action_commands(const struct sbpd_action * action);
+
+//
+//  Render a command fragment of an action
+//  Parameters:
+//      action: the action
+//      step: the command of the action, 0...action->steps - 1
+//      steps: value for a "%d" placeholder
+//      buffer, size: target buffer
+//  Returns: length of the fragment or -1 if it didn't fit
+//
+int render_action(const struct sbpd_action * action, int step, int steps,
+                  char * buffer, size_t size);
+
+#endif /* dispatch_h */
@@ -0,0 +1,177 @@
+//
+//  eventloop.c
+//  SqueezeButtonPi
+//
+//  Event loop: file descriptor watches and timers
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "eventloop.h"
+#include "sbpd.h"
+
+#include <poll.h>
+#include <errno.h>
+
+struct watch {
+    fd_handler_t handler;
+    void * context;
+};
+
+struct timer {
+    timer_handler_t handler;
+    void * context;
+    sbpd_time_t deadline;   // 0: disarmed
+};
+
+//
+//  Watches are kept as a pollfd array ready for poll()
+//
+static struct pollfd pollfds[max_watches];
+static struct watch watches[max_watches];
+static int numberofwatches = 0;
+static struct timer timers[max_timers];
+static int numberoftimers = 0;
+
+int watch_fd(int fd, short events, fd_handler_t handler, void * context) {
+    int cnt = 0;
+    for (; cnt < numberofwatches; cnt++)
+        if (pollfds[cnt].fd == fd)
+            break;
+    if (cnt == numberofwatches) {
+        if (numberofwatches == max_watches) {
+            logerr("Maximum number of file descriptor watches exceeded: %i", max_watches);
+            return -1;
+        }
+        numberofwatches++;
+    }
+    pollfds[cnt].fd = fd;
+    pollfds[cnt].events = events;
+    pollfds[cnt].revents = 0;
+    watches[cnt].handler = handler;
+    watches[cnt].context = context;
+    return 0;
+}
+
+void unwatch_fd(int fd) {
+    for (int cnt = 0; cnt < numberofwatches; cnt++) {
+        if (pollfds[cnt].fd != fd)
+            continue;
+        //
+        //  Move the last watch into the gap
+        //
+        numberofwatches--;
+        pollfds[cnt] = pollfds[numberofwatches];
+        watches[cnt] = watches[numberofwatches];
+        return;
+    }
+}
+
+int create_timer(timer_handler_t handler, void * context) {
+    if (numberoftimers == max_timers) {
+        logerr("Maximum number of timers exceeded: %i", max_timers);
+        return -1;
+    }
+    timers[numberoftimers].handler = handler;
+    timers[numberoftimers].context = context;
+    timers[numberoftimers].deadline = 0;
+    return numberoftimers++;
+}
+
+void set_timer(int timer, sbpd_time_t deadline) {
+    if ((timer >= 0) && (timer < numberoftimers))
+        timers[timer].deadline = deadline;
+}
+
+//
+//  Call the handlers of all expired timers
+//  A handler may re-arm its own or other timers
+//
+static void run_timers() {
+    sbpd_time_t now = clock_now();
+    for (int cnt = 0; cnt < numberoftimers; cnt++) {
+        if (!timers[cnt].deadline || (timers[cnt].deadline > now))
+            continue;
+        timers[cnt].deadline = 0;
+        timers[cnt].handler(timers[cnt].context);
+    }
+}
+
+void run_loop(sbpd_time_t timeout) {
+    //
+    //  Wait until the next timer at the latest
+    //
+    sbpd_time_t now = clock_now();
+    for (int cnt = 0; cnt < numberoftimers; cnt++) {
+        if (!timers[cnt].deadline)
+            continue;
+        sbpd_time_t remaining = (timers[cnt].deadline > now) ? timers[cnt].deadline - now : 0;
+        if (remaining < timeout)
+            timeout = remaining;
+    }
+    
+    //
+    //  A virtual clock only checks the descriptors: poll() would wait in
+    //  real time. If nothing is ready time passes on the clock instead,
+    //  the same as with nothing to watch.
+    //
+    bool virtualClock = clock_is_virtual();
+    int ready = 0;
+    if (numberofwatches) {
+        ready = poll(pollfds, numberofwatches,
+                     (virtualClock) ? 0 : (int)((timeout + SCD_MILLISECOND - 1) / SCD_MILLISECOND));
+        if ((ready < 0) && (errno != EINTR))
+            logerr("poll failed: %d", errno);
+    }
+    if ((!numberofwatches || virtualClock) && !ready && timeout)
+        clock_sleep(timeout);
+    
+    //
+    //  Handlers may add or remove watches: collect first, then dispatch
+    //
+    if (ready > 0) {
+        int fds[max_watches];
+        short revents[max_watches];
+        int count = 0;
+        for (int cnt = 0; cnt < numberofwatches; cnt++) {
+            if (!pollfds[cnt].revents)
+                continue;
+            fds[count] = pollfds[cnt].fd;
+            revents[count++] = pollfds[cnt].revents;
+        }
+        for (int cnt = 0; cnt < count; cnt++) {
+            for (int watch = 0; watch < numberofwatches; watch++) {
+                if (pollfds[watch].fd != fds[cnt])
+                    continue;
+                watches[watch].handler(fds[cnt], revents[cnt], watches[watch].context);
+                break;
+            }
+        }
+    }
+    run_timers();
+}
@@ -0,0 +1,101 @@
+//
+//  eventloop.h
+//  SqueezeButtonPi
+//
+//  Event loop: file descriptor watches and timers
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef eventloop_h
+#define eventloop_h
+
+#include "sbpd.h"
+#include "timing.h"
+
+//
+//  Limits
+//
+#define max_watches     16
+#define max_timers      8
+
+//
+//  Handlers
+//  fd_handler_t: called with the poll() revents of a watched file descriptor
+//  timer_handler_t: called once when a timer expires
+//
+typedef void (*fd_handler_t)(int fd, short revents, void * context);
+typedef void (*timer_handler_t)(void * context);
+
+//
+//  Watch a file descriptor
+//  Watching an already watched descriptor updates events, handler and context
+//  Parameters:
+//      fd: the file descriptor
+//      events: poll() events (POLLIN, POLLOUT)
+//      handler: called when the descriptor is ready
+//      context: passed to the handler
+//  Returns: 0 on success, -1 if there are too many watches
+//
+int watch_fd(int fd, short events, fd_handler_t handler, void * context);
+
+//
+//  Stop watching a file descriptor
+//
+void unwatch_fd(int fd);
+
+//
+//  Create a timer
+//  Timers are created disarmed, use set_timer()
+//  Parameters:
+//      handler: called when the timer expires
+//      context: passed to the handler
+//  Returns: timer id or -1 if there are too many timers
+//
+int create_timer(timer_handler_t handler, void * context);
+
+//
+//  Arm or disarm a timer
+//  Parameters:
+//      timer: the timer id
+//      deadline: expiry time (clock_now() base), 0 disarms the timer
+//
+void set_timer(int timer, sbpd_time_t deadline);
+
+//
+//  Run the loop once
+//  Waits for watched file descriptors or the next timer, at most timeout µs,
+//  then calls the handlers of everything that is ready.
+//  Never blocks on anything but the wait itself.
+//  With a virtual clock the wait advances the clock, it never blocks.
+//  Parameters:
+//      timeout: maximum wait in µs
+//
+void run_loop(sbpd_time_t timeout);
+
+#endif /* eventloop_h */
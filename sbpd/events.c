@@ -0,0 +1,154 @@
+//
+//  events.c
+//  SqueezeButtonPi
+//
+//  Internal publish/subscribe event bus
+//  Bounded lock-free queues (one per subscriber), multiple publishers
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "events.h"
+#include "sbpd.h"
+
+#include <string.h>
+
+//
+//  Queue slot
+//  The sequence number tells producers and the consumer whether the slot
+//  is free or filled for a given position (D. Vyukov's bounded queue)
+//
+struct event_slot {
+    volatile unsigned long sequence;
+    struct sbpd_event event;
+};
+
+struct subscriber {
+    sbpd_event_type_t mask;
+    volatile unsigned long head;    // consumer position
+    volatile unsigned long tail;    // producer position
+    volatile unsigned long dropped;
+    struct event_slot slots[event_queue_size];
+};
+
+//
+//  Pre-allocate subscribers statically, the bus never allocates
+//
+static struct subscriber subscribers[max_subscribers];
+static volatile int numberofsubscribers = 0;
+
+//
+//  Subscribe to events
+//  Call during setup, before events are published
+//
+int subscribe_events(sbpd_event_type_t mask) {
+    if (numberofsubscribers == max_subscribers) {
+        logerr("Maximum number of event subscribers exceeded: %i", max_subscribers);
+        return -1;
+    }
+    struct subscriber * sub = subscribers + numberofsubscribers;
+    for (unsigned long pos = 0; pos < event_queue_size; pos++)
+        sub->slots[pos].sequence = pos;
+    sub->head = 0;
+    sub->tail = 0;
+    sub->dropped = 0;
+    sub->mask = mask;
+    __atomic_store_n(&numberofsubscribers, numberofsubscribers + 1, __ATOMIC_RELEASE);
+    return numberofsubscribers - 1;
+}
+
+//
+//  Add an event to a subscriber queue
+//  Returns false if the queue is full
+//
+static bool enqueue(struct subscriber * sub, const struct sbpd_event * event) {
+    unsigned long pos = __atomic_load_n(&sub->tail, __ATOMIC_RELAXED);
+    struct event_slot * slot;
+    for (;;) {
+        slot = sub->slots + (pos & (event_queue_size - 1));
+        unsigned long seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            // slot free: claim it
+            if (__atomic_compare_exchange_n(&sub->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false;   // full
+        } else {
+            pos = __atomic_load_n(&sub->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->event = *event;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+//
+//  Publish an event to all matching subscribers
+//
+void publish_event(struct sbpd_event * event) {
+    if (!event->time)
+        event->time = clock_now();
+    int count = __atomic_load_n(&numberofsubscribers, __ATOMIC_ACQUIRE);
+    for (struct subscriber * sub = subscribers; sub < subscribers + count; sub++) {
+        if (!(sub->mask & event->type))
+            continue;
+        if (!enqueue(sub, event))
+            __atomic_add_fetch(&sub->dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+//
+//  Dispatch queued events of a subscriber
+//
+int poll_events(int subscriber, event_handler_t handler, void * context) {
+    if (subscriber < 0 || subscriber >= numberofsubscribers)
+        return 0;
+    struct subscriber * sub = subscribers + subscriber;
+    int count = 0;
+    for (;;) {
+        unsigned long pos = sub->head;
+        struct event_slot * slot = sub->slots + (pos & (event_queue_size - 1));
+        unsigned long seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (seq != pos + 1)
+            break;  // empty
+        struct sbpd_event event = slot->event;
+        sub->head = pos + 1;
+        __atomic_store_n(&slot->sequence, pos + event_queue_size, __ATOMIC_RELEASE);
+        handler(&event, context);
+        count++;
+    }
+    return count;
+}
+
+unsigned long dropped_events(int subscriber) {
+    if (subscriber < 0 || subscriber >= numberofsubscribers)
+        return 0;
+    return __atomic_load_n(&subscribers[subscriber].dropped, __ATOMIC_RELAXED);
+}
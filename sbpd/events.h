@@ -0,0 +1,151 @@
+//
+//  events.h
+//  SqueezeButtonPi
+//
+//  Internal publish/subscribe event bus
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef events_h
+#define events_h
+
+#include "sbpd.h"
+#include "timing.h"
+
+//
+//  Event types
+//  Used as bit mask for subscriptions
+//
+typedef enum {
+    SBPD_evt_input = 0x1,       // button or encoder activity
+    SBPD_evt_command = 0x2,     // result of a command sent to the server
+    SBPD_evt_discovery = 0x4,   // discovered parameters changed
+    SBPD_evt_server = 0x8,      // server endpoint (address/port) changed
+    SBPD_evt_player = 0x10,     // player state changed, see playerstate.h
+    SBPD_evt_health = 0x20,     // server degraded or recovered, see servercomm.h
+
+    SBPD_evt_all = 0xffff,
+} sbpd_event_type_t;
+
+//
+//  Input sources
+//
+typedef enum {
+    SBPD_input_button = 1,
+    SBPD_input_encoder,
+} sbpd_input_t;
+
+//
+//  Event data
+//  Events are copied into the subscriber queues so keep this small
+//
+struct sbpd_event {
+    sbpd_event_type_t type;
+    sbpd_time_t time;           // monotonic time the event was published
+    union {
+        struct {
+            sbpd_input_t source;
+            int pin;            // button pin or first encoder pin
+            long value;         // button state or encoder value
+            long change;        // button change or encoder increment
+        } input;
+        struct {
+            int request;        // request handle returned by send_command()
+            bool success;
+            int code;           // HTTP status (200 for CLI), negative curl result code, 0: not sent
+        } command;
+        struct {
+            sbpd_config_parameters_t discovered;
+        } discovery;
+        struct {
+            uint32_t address;   // IPv4, network byte order
+            uint32_t port;
+        } server;
+        struct {
+            bool known;
+            bool power;
+            bool muted;
+            int8_t volume;      // -1: unknown
+            uint8_t mode;       // sbpd_mode_t
+        } player;
+        struct {
+            bool degraded;
+            uint32_t rtt;       // smoothed round trip in µs, 0: unknown
+        } health;
+    };
+};
+
+//
+//  Limits
+//  Queue size needs to be a power of two
+//
+#define max_subscribers     8
+#define event_queue_size    64
+
+//
+//  Subscribe to events
+//  Every subscriber gets its own lock-free queue so a slow subscriber
+//  never delays a publisher or any other subscriber.
+//  Parameters:
+//      mask: the event types to be received
+//  Returns: subscriber id or -1 if there are too many subscribers
+//
+int subscribe_events(sbpd_event_type_t mask);
+
+//
+//  Publish an event
+//  Lock-free and non-blocking, safe to call from GPIO interrupt threads.
+//  If a subscriber queue is full the event is dropped for that subscriber.
+//  Parameters:
+//      event: the event. Time will be set if 0
+//
+void publish_event(struct sbpd_event * event);
+
+//
+//  Event handler callback for poll_events
+//
+typedef void (*event_handler_t)(const struct sbpd_event * event, void * context);
+
+//
+//  Dispatch queued events of a subscriber
+//  Each subscriber needs to poll from a single thread
+//  Parameters:
+//      subscriber: the subscriber id
+//      handler: called for every event
+//      context: passed to the handler
+//  Returns: number of events dispatched
+//
+int poll_events(int subscriber, event_handler_t handler, void * context);
+
+//
+//  Number of events dropped for a subscriber because its queue was full
+//
+unsigned long dropped_events(int subscriber);
+
+#endif /* events_h */
@@ -0,0 +1,559 @@
+//
+//  httpclient.c
+//  SqueezeButtonPi
+//
+//  Built-in HTTP/1.1 client for JSON-RPC requests
+//  - one persistent connection with TCP_NODELAY, requests are pipelined
+//  - each request goes out with one writev() of the prebuilt head and the body
+//  - replies are parsed from a fixed buffer, bodies are passed on as they arrive
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#define _GNU_SOURCE     // strcasestr
+#include "httpclient.h"
+#include "servercomm.h"
+#include "eventloop.h"
+#include "timing.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define HTTP_PATH           "/jsonrpc.js"
+#define KEEPALIVE_IDLE      20      // s idle before the first probe
+#define KEEPALIVE_INTERVAL  5       // s between probes
+#define KEEPALIVE_COUNT     3       // failed probes until the connection is dead
+#define max_http_head       512     // request head up to "Content-Length: "
+#define max_http_input      4096    // status and header lines must fit
+#define max_http_output     8192
+#define max_http_pending    (2 * max_requests)  // in flight, including cancelled
+
+//
+//  Reply parser states
+//
+typedef enum {
+    HTTP_status = 0,
+    HTTP_header,
+    HTTP_body,
+    HTTP_chunk_size,
+    HTTP_chunk_data,
+    HTTP_chunk_end,
+    HTTP_trailer
+} http_state_t;
+
+static http_data_t dataCallback = NULL;
+static http_done_t doneCallback = NULL;
+static int httpTimer = -1;
+static unsigned long generation = 0;   // counts closed connections
+
+static struct {
+    int fd;                     // -1: not connected
+    bool connected;             // connect() completed
+    bool resolved;              // address is valid
+    struct sockaddr_in address;
+    char host[64];
+    uint32_t port;
+    char secret[255];           // user:password the head was built for
+    sbpd_time_t connect_deadline;
+    unsigned long served;       // replies on this connection
+    //
+    //  Prebuilt request head, only the length and the body are added per request
+    //
+    size_t head_length;
+    char head[max_http_head];
+    //
+    //  Requests waiting for their reply, oldest first
+    //
+    struct {
+        int slot;               // -1: cancelled, the reply is skipped
+        uint64_t start;         // output position of the request
+        sbpd_time_t deadline;
+    } pending[max_http_pending];
+    int first;
+    int count;
+    uint64_t queued;            // output bytes queued in total
+    uint64_t written;           // output bytes written in total
+    size_t out_length;
+    char out[max_http_output];
+    //
+    //  Reply parser
+    //
+    http_state_t state;
+    int status;
+    long remaining;             // body or chunk bytes, -1: no Content-Length
+    bool chunked;
+    bool close;                 // the server closes after this reply
+    size_t in_length;
+    char in[max_http_input];
+    //
+    //  Statistics
+    //
+    unsigned long reused;
+    unsigned long connects;
+    unsigned long lost;
+} http = { .fd = -1 };
+
+static void http_handler(int fd, short revents, void * context);
+
+//
+//  Base64 for basic authentication
+//
+static void base64(const char * in, char * out, size_t size) {
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t len = strlen(in);
+    size_t pos = 0;
+    for (size_t i = 0; (i < len) && (pos + 5 < size); i += 3) {
+        uint32_t v = (uint8_t)in[i] << 16;
+        if (i + 1 < len) v |= (uint8_t)in[i + 1] << 8;
+        if (i + 2 < len) v |= (uint8_t)in[i + 2];
+        out[pos++] = table[(v >> 18) & 0x3f];
+        out[pos++] = table[(v >> 12) & 0x3f];
+        out[pos++] = (i + 1 < len) ? table[(v >> 6) & 0x3f] : '=';
+        out[pos++] = (i + 2 < len) ? table[v & 0x3f] : '=';
+    }
+    out[pos] = 0;
+}
+
+//
+//  Build the request head for the current endpoint and credentials
+//
+static void build_head() {
+    char auth[400] = "";
+    if (http.secret[0]) {
+        char encoded[350];
+        base64(http.secret, encoded, sizeof(encoded));
+        snprintf(auth, sizeof(auth), "Authorization: Basic %s\r\n", encoded);
+    }
+    int length = snprintf(http.head, sizeof(http.head),
+                          "POST " HTTP_PATH " HTTP/1.1\r\n"
+                          "Host: %s:%u\r\n"
+                          "User-Agent: %s/%s\r\n"
+                          "Content-Type: application/json\r\n"
+                          "%s"
+                          "Content-Length: ",
+                          http.host, http.port, USER_AGENT, VERSION, auth);
+    http.head_length = MIN(length, sizeof(http.head) - 1);
+}
+
+//
+//  Arm the timer for the next deadline: connect or the oldest reply
+//
+static void update_timer() {
+    sbpd_time_t deadline = 0;
+    if ((http.fd >= 0) && !http.connected)
+        deadline = http.connect_deadline;
+    if (http.count && (!deadline || (http.pending[http.first].deadline < deadline)))
+        deadline = http.pending[http.first].deadline;
+    set_timer(httpTimer, deadline);
+}
+
+//
+//  Close the connection, requests without reply fail
+//  Requests not written at all were not sent and may be retried.
+//  The callbacks may send new requests: the state is reset first.
+//
+static void http_close(int code) {
+    if (http.fd >= 0) {
+        unwatch_fd(http.fd);
+        close(http.fd);
+    }
+    generation++;
+    http.fd = -1;
+    http.connected = false;
+    http.in_length = 0;
+    http.out_length = 0;
+    http.state = HTTP_status;
+    int failed[max_http_pending];
+    bool sent[max_http_pending];
+    int count = http.count;
+    for (int cnt = 0; cnt < count; cnt++) {
+        int index = (http.first + cnt) % max_http_pending;
+        failed[cnt] = http.pending[index].slot;
+        sent[cnt] = http.written > http.pending[index].start;
+    }
+    http.count = 0;
+    http.written = http.queued = 0;
+    update_timer();
+    for (int cnt = 0; cnt < count; cnt++)
+        if (failed[cnt] >= 0)
+            doneCallback(failed[cnt], 0, code, sent[cnt]);
+}
+
+//
+//  Start connecting, requests are queued until the connection is up
+//
+static bool http_connect() {
+    if (!http.resolved)
+        return false;
+    http.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (http.fd < 0)
+        return false;
+    if (connect(http.fd, (struct sockaddr *)&http.address, sizeof(http.address)) &&
+        (errno != EINPROGRESS)) {
+        close(http.fd);
+        http.fd = -1;
+        return false;
+    }
+    http.served = 0;
+    http.connect_deadline = clock_now() + SBPD_CONNECT_TIMEOUT * SCD_MILLISECOND;
+    watch_fd(http.fd, POLLOUT, http_handler, NULL);
+    return true;
+}
+
+//
+//  Write as much output as the socket takes, wait for POLLOUT for the rest
+//
+static bool flush_output() {
+    if (http.out_length) {
+        ssize_t written = write(http.fd, http.out, http.out_length);
+        if ((written < 0) && (errno != EAGAIN))
+            return false;
+        if (written > 0) {
+            http.out_length -= written;
+            http.written += written;
+            memmove(http.out, http.out + written, http.out_length);
+        }
+    }
+    watch_fd(http.fd, (http.out_length) ? POLLIN | POLLOUT : POLLIN, http_handler, NULL);
+    return true;
+}
+
+//
+//  The oldest request has its complete reply
+//
+static void complete_reply() {
+    int slot = http.pending[http.first].slot;
+    int status = http.status;
+    http.first = (http.first + 1) % max_http_pending;
+    http.count--;
+    if (http.served++)
+        http.reused++;
+    http.state = HTTP_status;
+    if (http.close)
+        http_close(SBPD_result_recv);
+    else
+        update_timer();
+    if (slot >= 0)
+        doneCallback(slot, status, 0, true);
+}
+
+//
+//  Body data: straight from the input buffer to the reply callback
+//  Returns: bytes used
+//
+static size_t body_data(const char * data, size_t length) {
+    size_t used = MIN(length, (size_t)http.remaining);
+    int slot = http.pending[http.first].slot;
+    if (used && (slot >= 0))
+        dataCallback(slot, data, used);
+    http.remaining -= used;
+    return used;
+}
+
+//
+//  Status and header lines
+//  Returns: false on a protocol error
+//
+static bool parse_line(char * line) {
+    switch (http.state) {
+        case HTTP_status:
+            if (strncmp(line, "HTTP/1.", 7) || (strlen(line) < 12))
+                return false;
+            http.status = (int)strtol(line + 9, NULL, 10);
+            http.close = (line[7] == '0');
+            http.chunked = false;
+            http.remaining = -1;
+            http.state = HTTP_header;
+            return true;
+        case HTTP_header:
+            if (*line) {
+                if (!strncasecmp(line, "Content-Length:", 15))
+                    http.remaining = strtol(line + 15, NULL, 10);
+                else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+                    http.chunked = strcasestr(line, "chunked") != NULL;
+                else if (!strncasecmp(line, "Connection:", 11))
+                    http.close = strcasestr(line, "close") != NULL;
+                return true;
+            }
+            if (http.status / 100 == 1) {
+                http.state = HTTP_status;   // interim reply
+                return true;
+            }
+            if (http.chunked) {
+                http.state = HTTP_chunk_size;
+                return true;
+            }
+            if (http.remaining < 0)
+                return false;   // replies must be delimited to pipeline
+            http.state = HTTP_body;
+            if (!http.remaining)
+                complete_reply();
+            return true;
+        case HTTP_chunk_size:
+            http.remaining = strtol(line, NULL, 16);
+            http.state = (http.remaining > 0) ? HTTP_chunk_data : HTTP_trailer;
+            return http.remaining >= 0;
+        case HTTP_chunk_end:
+            http.state = HTTP_chunk_size;
+            return !*line;
+        case HTTP_trailer:
+            if (!*line)
+                complete_reply();
+            return true;
+        default:
+            return false;
+    }
+}
+
+//
+//  Parse the input buffer
+//  Returns: false on a protocol error
+//
+static bool parse_input() {
+    unsigned long connection = generation;
+    size_t pos = 0;
+    while ((pos < http.in_length) && (generation == connection)) {
+        if (!http.count)
+            return false;   // nothing asked for
+        if ((http.state == HTTP_body) || (http.state == HTTP_chunk_data)) {
+            pos += body_data(http.in + pos, http.in_length - pos);
+            if (http.remaining)
+                continue;
+            if (http.state == HTTP_body)
+                complete_reply();
+            else
+                http.state = HTTP_chunk_end;
+            continue;
+        }
+        char * end = memchr(http.in + pos, '\n', http.in_length - pos);
+        if (!end)
+            break;
+        char * line = http.in + pos;
+        pos = end + 1 - http.in;
+        if ((end > line) && (end[-1] == '\r'))
+            end--;
+        *end = 0;
+        if (!parse_line(line))
+            return false;
+    }
+    if (generation != connection)
+        return true;    // closed after the last reply
+    http.in_length -= pos;
+    memmove(http.in, http.in + pos, http.in_length);
+    return http.in_length < sizeof(http.in);
+}
+
+static void http_handler(int fd, short revents, void * context) {
+    if (!http.connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error || (revents & (POLLERR | POLLHUP))) {
+            logdebug("Could not connect to server %s:%u: %s", http.host, http.port, strerror(error));
+            http_close(SBPD_result_connect);
+            return;
+        }
+        int on = 1;
+        int idle = KEEPALIVE_IDLE;
+        int interval = KEEPALIVE_INTERVAL;
+        int count = KEEPALIVE_COUNT;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+        http.connected = true;
+        http.connects++;
+        logdebug("Connected to server %s:%u", http.host, http.port);
+        if (!flush_output())
+            http_close(SBPD_result_send);
+        else
+            update_timer();
+        return;
+    }
+    
+    if ((revents & POLLOUT) && !flush_output()) {
+        http_close(SBPD_result_send);
+        return;
+    }
+    if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+        return;
+    ssize_t received = read(fd, http.in + http.in_length, sizeof(http.in) - http.in_length);
+    if (received <= 0) {
+        if ((received < 0) && (errno == EAGAIN))
+            return;
+        loginfo("Connection to server %s:%u lost", http.host, http.port);
+        http.lost++;
+        http_close(SBPD_result_recv);
+        return;
+    }
+    http.in_length += received;
+    if (!parse_input()) {
+        logwarn("Invalid reply from server %s:%u", http.host, http.port);
+        http_close(SBPD_result_recv);
+    }
+}
+
+//
+//  Deadline: connect or reply
+//
+static void http_timer_handler(void * context) {
+    logdebug("Server %s:%u: no %s in time", http.host, http.port, (http.connected) ? "reply" : "connection");
+    http_close(SBPD_result_timeout);
+}
+
+void http_endpoint(const char * host, uint32_t port, const char * user, const char * password) {
+    char secret[sizeof(http.secret)] = "";
+    if (user && password)
+        snprintf(secret, sizeof(secret), "%s:%s", user, password);
+    bool moved = (http.port != port) || strcmp(http.host, host);
+    if (!moved && !strcmp(secret, http.secret))
+        return;
+    strcpy(http.secret, secret);
+    if (moved) {
+        http_close(SBPD_result_recv);
+        snprintf(http.host, sizeof(http.host), "%s", host);
+        http.port = port;
+        memset(&http.address, 0, sizeof(http.address));
+        http.address.sin_family = AF_INET;
+        http.address.sin_port = htons(port);
+        http.resolved = inet_pton(AF_INET, host, &http.address.sin_addr) == 1;
+        //
+        //  Discovery yields IPv4 addresses. Only resolve names, getaddrinfo() allocates.
+        //
+        if (!http.resolved) {
+            struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+            struct addrinfo * result = NULL;
+            if (!getaddrinfo(host, NULL, &hints, &result) && result) {
+                http.address.sin_addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+                http.resolved = true;
+            } else
+                logwarn("Could not resolve server %s", host);
+            if (result)
+                freeaddrinfo(result);
+        }
+    }
+    build_head();
+}
+
+bool http_post(int slot, const char * body, size_t length) {
+    char contentLength[32];
+    int size = snprintf(contentLength, sizeof(contentLength), "%zu\r\n\r\n", length);
+    struct iovec iov[3] = {
+        { http.head, http.head_length },
+        { contentLength, size },
+        { (void *)body, length }
+    };
+    size_t total = http.head_length + size + length;
+    if ((http.count == max_http_pending) || (http.out_length + total > sizeof(http.out)))
+        return false;
+    if ((http.fd < 0) && !http_connect())
+        return false;
+    int index = (http.first + http.count++) % max_http_pending;
+    http.pending[index].slot = slot;
+    http.pending[index].start = http.queued;
+    http.pending[index].deadline = clock_now() + SBPD_COMMAND_TIMEOUT * SCD_MILLISECOND;
+    http.queued += total;
+    
+    //
+    //  One writev() if the connection is up and nothing is waiting to go out,
+    //  whatever the socket doesn't take is buffered.
+    //  A write error closes the connection from the event loop.
+    //
+    size_t written = 0;
+    if (http.connected && !http.out_length) {
+        ssize_t result = writev(http.fd, iov, 3);
+        if (result > 0)
+            written = result;
+        http.written += written;
+    }
+    for (int cnt = 0; cnt < 3; cnt++) {
+        size_t skip = MIN(written, iov[cnt].iov_len);
+        written -= skip;
+        memcpy(http.out + http.out_length, (char *)iov[cnt].iov_base + skip, iov[cnt].iov_len - skip);
+        http.out_length += iov[cnt].iov_len - skip;
+    }
+    if (http.connected)
+        watch_fd(http.fd, (http.out_length) ? POLLIN | POLLOUT : POLLIN, http_handler, NULL);
+    update_timer();
+    return true;
+}
+
+void http_cancel(int slot) {
+    for (int cnt = 0; cnt < http.count; cnt++) {
+        int index = (http.first + cnt) % max_http_pending;
+        if (http.pending[index].slot == slot)
+            http.pending[index].slot = -1;
+    }
+}
+
+bool http_ready() {
+    return http.fd >= 0;
+}
+
+const char * http_error(int code) {
+    switch (code) {
+        case SBPD_result_connect:
+            return "Could not connect to server";
+        case SBPD_result_timeout:
+            return "Timeout";
+        case SBPD_result_send:
+            return "Failed sending data to the server";
+        case SBPD_result_recv:
+            return "Connection closed before the reply";
+        default:
+            return "Transport error";
+    }
+}
+
+int init_http(http_data_t data, http_done_t done) {
+    loginfo("Initializing HTTP client");
+    dataCallback = data;
+    doneCallback = done;
+    httpTimer = create_timer(http_timer_handler, NULL);
+    return (httpTimer < 0) ? -1 : 0;
+}
+
+void shutdown_http() {
+    lognotice("Server connections: %lu commands on a kept connection, %lu connects, %lu lost",
+              http.reused, http.connects, http.lost);
+    http.count = 0;
+    http_close(SBPD_result_cancelled);
+}
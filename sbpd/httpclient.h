@@ -0,0 +1,104 @@
+//
+//  httpclient.h
+//  SqueezeButtonPi
+//
+//  HTTP transport for JSON-RPC requests
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef httpclient_h
+#define httpclient_h
+
+#include "sbpd.h"
+
+//
+//  Two implementations of this interface, chosen at build time:
+//      httpclient.c: built-in HTTP/1.1 client, one persistent pipelined connection
+//      httpcurl.c:   libcurl multi interface (make sbpd-curl)
+//  Both run from the event loop. Requests are identified by the caller's
+//  request slot, 0..max_requests-1, and take the body as it is.
+//
+
+//
+//  Reply callback
+//  The reply body, in chunks as they arrive. Not NUL terminated.
+//
+typedef void (*http_data_t)(int slot, const char * data, size_t length);
+
+//
+//  Completion callback
+//  Parameters:
+//      slot: the request slot
+//      status: HTTP status, 0 if there was no complete reply
+//      code: 0 or a negative SBPD_result_xxx transport error
+//      sent: the request went out, at least partially: it may have reached the server
+//
+typedef void (*http_done_t)(int slot, int status, int code, bool sent);
+
+//
+//  Initialize the transport
+//  Returns: 0 or -1 on error
+//
+int init_http(http_data_t data, http_done_t done);
+
+//
+//  Set the endpoint and credentials, connections to an old endpoint are dropped
+//  Cheap if nothing changed, call it before every request
+//
+void http_endpoint(const char * host, uint32_t port, const char * user, const char * password);
+
+//
+//  Send a POST request to /jsonrpc.js
+//  The body must stay valid until the request is done
+//  Returns: false if the request could not be queued, no callback then
+//
+bool http_post(int slot, const char * body, size_t length);
+
+//
+//  Cancel a request, there is no callback for it
+//
+void http_cancel(int slot);
+
+//
+//  Is there a usable connection to the server?
+//  Idle connections are checked, lost ones are dropped.
+//
+bool http_ready();
+
+//
+//  Log text for a transport error code
+//
+const char * http_error(int code);
+
+//
+//  Close all connections, pending requests are dropped without callback
+//
+void shutdown_http();
+
+#endif /* httpclient_h */
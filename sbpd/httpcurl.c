@@ -0,0 +1,361 @@
+//
+//  httpcurl.c
+//  SqueezeButtonPi
+//
+//  HTTP transport through the libcurl multi interface
+//  - persistent, monitored connections to the server endpoint
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "httpclient.h"
+#include "servercomm.h"
+#include "eventloop.h"
+#include "alloc.h"
+#include "timing.h"
+#include <curl/curl.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/param.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static CURLM *multi = NULL;
+static int curlTimer = -1;
+static CURL * handles[max_requests];
+static http_data_t dataCallback = NULL;
+static http_done_t doneCallback = NULL;
+
+//
+//  curl lists are built from static nodes, curl only reads them.
+//  Together with the pool allocator for curl this keeps the command path off the heap.
+//
+static char target[100];
+static struct curl_slist targetList = { target, NULL };
+static char userAgent[50];
+static struct curl_slist headerList[2] = {
+    { "Content-Type: application/json", headerList + 1 },
+    { userAgent, NULL }
+};
+static char secret[255];
+
+#define SERVER_ADDRESS_TEMPLATE "http://localhost/jsonrpc.js"
+
+//
+//  Connection manager
+//  Persistent connections to the current server endpoint.
+//  The endpoint is configured when it changes, connections are kept alive
+//  with TCP keepalive and idle connections are checked between commands.
+//
+#define KEEPALIVE_IDLE      20      // s idle before the first probe
+#define KEEPALIVE_INTERVAL  5       // s between probes
+#define KEEPALIVE_COUNT     3       // failed probes until the connection is dead
+
+static struct {
+    char host[16];
+    uint32_t port;
+    unsigned long reused;
+    unsigned long connects;
+    unsigned long lost;
+} connection;
+
+//
+//  Connection sockets
+//  busy: curl watches the socket for a transfer. Idle sockets are checked by us
+//  dead: closed by the server or for an old endpoint, curl will drop it
+//
+static struct {
+    curl_socket_t fd;           // CURL_SOCKET_BAD: unused
+    bool busy;
+    bool dead;
+} sockets[max_requests];
+
+static int socket_index(curl_socket_t fd) {
+    for (int cnt = 0; cnt < max_requests; cnt++)
+        if (sockets[cnt].fd == fd)
+            return cnt;
+    return -1;
+}
+
+//
+//  curl socket callbacks: configure keepalive and track connection sockets
+//
+static int sockopt_cb(void * clientp, curl_socket_t fd, curlsocktype purpose) {
+    int on = 1;
+    int idle = KEEPALIVE_IDLE;
+    int interval = KEEPALIVE_INTERVAL;
+    int count = KEEPALIVE_COUNT;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    int index = socket_index(CURL_SOCKET_BAD);
+    if (index >= 0) {
+        sockets[index].fd = fd;
+        sockets[index].busy = false;
+        sockets[index].dead = false;
+    }
+    return CURL_SOCKOPT_OK;
+}
+
+static int closesocket_cb(void * clientp, curl_socket_t fd) {
+    int index = socket_index(fd);
+    if (index >= 0)
+        sockets[index].fd = CURL_SOCKET_BAD;
+    return close(fd);
+}
+
+//
+//  Is an idle connection still alive?
+//  An idle HTTP connection has nothing to read: readable means closed by the
+//  server, an error means reset or keepalive timeout (half-open)
+//
+static bool connection_alive(curl_socket_t fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) == 0;
+}
+
+//
+//  A transfer is done
+//
+static void complete_transfer(CURL * curl, CURLcode result) {
+    intptr_t slot = 0;
+    long status = 0;
+    long connects = 0;
+    long sent = 0;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&slot);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &sent);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_multi_remove_handle(multi, curl);
+    if (connects)
+        connection.connects++;
+    else if (result == CURLE_OK)
+        connection.reused++;
+    logdebug("Request slot %d done: curl result %d, HTTP status %ld, %s connection",
+             (int)slot, result, status, (connects) ? "new" : "reused");
+    doneCallback((int)slot, (result == CURLE_OK) ? (int)status : 0, -(int)result, sent != 0);
+}
+
+//
+//  Collect finished transfers
+//
+static void check_completions() {
+    CURLMsg * message;
+    int pending;
+    while ((message = curl_multi_info_read(multi, &pending))) {
+        if (message->msg == CURLMSG_DONE)
+            complete_transfer(message->easy_handle, message->data.result);
+    }
+}
+
+//
+//  curl multi callbacks, called from the event loop
+//
+static void curl_fd_handler(int fd, short revents, void * context) {
+    int flags = 0;
+    if (revents & POLLIN)
+        flags |= CURL_CSELECT_IN;
+    if (revents & POLLOUT)
+        flags |= CURL_CSELECT_OUT;
+    if (revents & (POLLERR | POLLHUP))
+        flags |= CURL_CSELECT_ERR;
+    int running;
+    curl_multi_socket_action(multi, fd, flags, &running);
+    check_completions();
+}
+
+static void curl_timer_handler(void * context) {
+    int running;
+    curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    check_completions();
+}
+
+static int socket_cb(CURL * easy, curl_socket_t fd, int what, void * userp, void * socketp) {
+    int index = socket_index(fd);
+    if (what == CURL_POLL_REMOVE) {
+        unwatch_fd(fd);
+        if (index >= 0)
+            sockets[index].busy = false;
+        return 0;
+    }
+    short events = 0;
+    if ((what == CURL_POLL_IN) || (what == CURL_POLL_INOUT))
+        events |= POLLIN;
+    if ((what == CURL_POLL_OUT) || (what == CURL_POLL_INOUT))
+        events |= POLLOUT;
+    watch_fd(fd, events, curl_fd_handler, NULL);
+    if (index >= 0)
+        sockets[index].busy = true;
+    return 0;
+}
+
+static int timer_cb(CURLM * multi, long timeout_ms, void * userp) {
+    sbpd_time_t deadline = 0;
+    if (timeout_ms >= 0)
+        deadline = MAX(clock_now() + timeout_ms * SCD_MILLISECOND, 1);
+    set_timer(curlTimer, deadline);
+    return 0;
+}
+
+//
+//  Curl reply callback
+//  Replies from the server go here, in chunks as they arrive.
+//  The buffer is not NUL terminated.
+//
+static size_t write_data(char *buffer, size_t size, size_t nmemb, void *userp) {
+    size_t length = size * nmemb;
+    dataCallback((int)(intptr_t)userp, buffer, length);
+    return length;
+}
+
+//
+//  Configure the endpoint if the server changed
+//  The target only changes here, curl doesn't reuse connections to another target
+//
+void http_endpoint(const char * host, uint32_t port, const char * user, const char * password) {
+    if ((connection.port != port) || strcmp(connection.host, host)) {
+        snprintf(connection.host, sizeof(connection.host), "%s", host);
+        connection.port = port;
+        snprintf(target, sizeof(target), "::%s:%u", host, port);
+        for (int cnt = 0; cnt < max_requests; cnt++)
+            sockets[cnt].dead = true;
+    }
+    
+    //
+    //  username/password?
+    //  curl copies the credentials, so only set them when they change
+    //
+    if (!user || !password)
+        return;
+    char newSecret[sizeof(secret)];
+    snprintf(newSecret, sizeof(newSecret), "%s:%s", user, password);
+    if (!strcmp(newSecret, secret))
+        return;
+    strcpy(secret, newSecret);
+    for (int cnt = 0; cnt < max_requests; cnt++)
+        curl_easy_setopt(handles[cnt], CURLOPT_USERPWD, secret);
+}
+
+bool http_post(int slot, const char * body, size_t length) {
+    curl_easy_setopt(handles[slot], CURLOPT_POSTFIELDSIZE, (long)length);
+    curl_easy_setopt(handles[slot], CURLOPT_POSTFIELDS, body);
+    return curl_multi_add_handle(multi, handles[slot]) == CURLM_OK;
+}
+
+void http_cancel(int slot) {
+    curl_multi_remove_handle(multi, handles[slot]);
+}
+
+bool http_ready() {
+    bool usable = false;
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        if ((sockets[cnt].fd == CURL_SOCKET_BAD) || sockets[cnt].dead)
+            continue;
+        if (!sockets[cnt].busy && !connection_alive(sockets[cnt].fd)) {
+            loginfo("Connection to server %s:%u lost", connection.host, connection.port);
+            connection.lost++;
+            sockets[cnt].dead = true;
+            continue;
+        }
+        usable = true;
+    }
+    return usable;
+}
+
+const char * http_error(int code) {
+    return curl_easy_strerror(-code);
+}
+
+int init_http(http_data_t data, http_done_t done) {
+    loginfo("Initializing CURL");
+    dataCallback = data;
+    doneCallback = done;
+    
+    //
+    //  Initialize curl comm
+    //  All curl memory comes from the pools
+    //
+    curl_global_init_mem(CURL_GLOBAL_ALL, pool_malloc, pool_free, pool_realloc, pool_strdup, pool_calloc);
+    multi = curl_multi_init();
+    curlTimer = create_timer(curl_timer_handler, NULL);
+    if (!multi || (curlTimer < 0)) {
+        curl_global_cleanup();
+        return -1;
+    }
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+    snprintf(userAgent, sizeof(userAgent), "User-Agent: %s/%s)", USER_AGENT, VERSION);
+    //
+    //  Add session-ID? Only needed for MySB which is not supported
+    //
+    //  (would be a third node in headerList: "x-sdi-squeezenetwork-session: ...")
+    
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        sockets[cnt].fd = CURL_SOCKET_BAD;
+        CURL * curl = curl_easy_init();
+        if (!curl)
+            return -1;
+        handles[cnt] = curl;
+        //
+        //  Set verbose mode for communication debugging
+        //
+        if (loglevel() == LOG_DEBUG)
+            curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)(intptr_t)cnt);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)(intptr_t)cnt);
+        curl_easy_setopt(curl, CURLOPT_URL, SERVER_ADDRESS_TEMPLATE);
+        curl_easy_setopt(curl, CURLOPT_CONNECT_TO, &targetList);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)SBPD_CONNECT_TIMEOUT);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)SBPD_COMMAND_TIMEOUT);
+        curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_cb);
+        curl_easy_setopt(curl, CURLOPT_CLOSESOCKETFUNCTION, closesocket_cb);
+    }
+    return 0;
+}
+
+void shutdown_http() {
+    if (!multi)
+        return;
+    lognotice("Server connections: %lu commands on a kept connection, %lu connects, %lu lost",
+              connection.reused, connection.connects, connection.lost);
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        if (!handles[cnt])
+            continue;
+        curl_multi_remove_handle(multi, handles[cnt]);
+        curl_easy_cleanup(handles[cnt]);
+        handles[cnt] = NULL;
+    }
+    curl_multi_cleanup(multi);
+    multi = NULL;
+    curl_global_cleanup();
+}
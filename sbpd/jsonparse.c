@@ -0,0 +1,308 @@
+//
+//  jsonparse.c
+//  SqueezeButtonPi
+//
+//  Incremental JSON-RPC reply parser
+//  - Consumes reply chunks as they arrive, at any boundary
+//  - Extracts requested fields of the "result" object, no allocations
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "jsonparse.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/param.h>
+
+//
+//  Parser states
+//
+enum {
+    JSON_value = 0,             // expecting a value
+    JSON_key,                   // expecting a key or the end of an object
+    JSON_colon,                 // expecting ':' after a key
+    JSON_next,                  // expecting ',' or the end of a container
+    JSON_string,                // inside a key or string value
+    JSON_literal,               // inside a number, true, false or null
+    JSON_done,                  // top-level value complete
+};
+
+void json_begin(struct sbpd_json_parser * parser, struct sbpd_json_field * fields, int count) {
+    memset(parser, 0, sizeof(*parser));
+    parser->fields = fields;
+    parser->count = count;
+    parser->field = -1;
+    for (int cnt = 0; cnt < count; cnt++)
+        fields[cnt].found = false;
+}
+
+//
+//  Append a character of the current key or captured value
+//
+static void append(struct sbpd_json_parser * parser, char c) {
+    if (parser->is_key) {
+        if (parser->key_length < sizeof(parser->key) - 1)
+            parser->key[parser->key_length++] = c;
+        else
+            parser->key[0] = 0;     // too long, can't match
+    } else if (parser->capture && (parser->value_length < sizeof(parser->value) - 1))
+        parser->value[parser->value_length++] = c;
+}
+
+//
+//  A key is complete: decide what its value means
+//
+static void key_done(struct sbpd_json_parser * parser) {
+    parser->key[parser->key_length] = 0;
+    parser->field = -1;
+    if (parser->depth == 1) {
+        strcpy(parser->parent, parser->key);
+        if (!strcmp(parser->key, "result"))
+            parser->result = true;
+        else if (!strcmp(parser->key, "error"))
+            parser->error_key = true;
+    } else if ((parser->depth == 2) && parser->in_result) {
+        for (int cnt = 0; cnt < parser->count; cnt++) {
+            if (!strcmp(parser->fields[cnt].key, parser->key)) {
+                parser->field = cnt;
+                break;
+            }
+        }
+    }
+}
+
+//
+//  A scalar value is complete: store it if it's a requested field
+//
+static void value_done(struct sbpd_json_parser * parser) {
+    if (parser->field >= 0) {
+        struct sbpd_json_field * field = parser->fields + parser->field;
+        parser->value[parser->value_length] = 0;
+        switch (field->type) {
+            case SBPD_json_int:
+                *(long *)field->value = strtol(parser->value, NULL, 10);
+                break;
+            case SBPD_json_bool:
+                *(bool *)field->value = !strcmp(parser->value, "1") || !strcmp(parser->value, "true");
+                break;
+            case SBPD_json_string:
+                if (field->size) {
+                    size_t length = MIN(parser->value_length, field->size - 1);
+                    memcpy(field->value, parser->value, length);
+                    ((char *)field->value)[length] = 0;
+                }
+                break;
+        }
+        field->found = true;
+    }
+    parser->field = -1;
+    parser->capture = false;
+    parser->state = (parser->depth) ? JSON_next : JSON_done;
+}
+
+static bool open_container(struct sbpd_json_parser * parser, char c) {
+    if (parser->depth == max_json_depth)
+        return false;
+    if ((parser->depth == 1) && (c == '{') && !strcmp(parser->parent, "result"))
+        parser->in_result = true;
+    parser->stack[parser->depth++] = c;
+    parser->field = -1;
+    parser->state = (c == '{') ? JSON_key : JSON_value;
+    return true;
+}
+
+static bool close_container(struct sbpd_json_parser * parser, char c) {
+    if (!parser->depth || (parser->stack[parser->depth - 1] != ((c == '}') ? '{' : '[')))
+        return false;
+    parser->depth--;
+    if (parser->depth == 1)
+        parser->in_result = false;
+    parser->state = (parser->depth) ? JSON_next : JSON_done;
+    return true;
+}
+
+static bool is_space(char c) {
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+//
+//  Start a scalar value
+//
+static void begin_value(struct sbpd_json_parser * parser, uint8_t state) {
+    parser->state = state;
+    parser->is_key = false;
+    parser->capture = parser->field >= 0;
+    parser->value_length = 0;
+}
+
+static bool parse_char(struct sbpd_json_parser * parser, char c) {
+    switch (parser->state) {
+        case JSON_value:
+            if (is_space(c))
+                return true;
+            //
+            //  "error": null is no error, only null starts with 'n'
+            //
+            if (parser->error_key) {
+                parser->error_key = false;
+                if (c != 'n')
+                    parser->error = true;
+            }
+            if ((c == '{') || (c == '['))
+                return open_container(parser, c);
+            if (c == ']')       // empty array
+                return close_container(parser, c);
+            if (c == '"') {
+                begin_value(parser, JSON_string);
+                return true;
+            }
+            if (strchr("-0123456789tfn", c)) {
+                begin_value(parser, JSON_literal);
+                append(parser, c);
+                return true;
+            }
+            return false;
+        
+        case JSON_key:
+            if (is_space(c))
+                return true;
+            if (c == '}')
+                return close_container(parser, c);
+            if (c != '"')
+                return false;
+            parser->state = JSON_string;
+            parser->is_key = true;
+            parser->key_length = 0;
+            return true;
+        
+        case JSON_colon:
+            if (is_space(c))
+                return true;
+            if (c != ':')
+                return false;
+            key_done(parser);
+            parser->state = JSON_value;
+            return true;
+        
+        case JSON_next:
+            if (is_space(c))
+                return true;
+            if (c == ',') {
+                parser->state = (parser->stack[parser->depth - 1] == '{') ? JSON_key : JSON_value;
+                return true;
+            }
+            if ((c == '}') || (c == ']'))
+                return close_container(parser, c);
+            return false;
+        
+        case JSON_string:
+            if (parser->unicode) {
+                char hex[2] = { c, 0 };
+                if (!strchr("0123456789abcdefABCDEF", c))
+                    return false;
+                parser->codepoint = (parser->codepoint << 4) | (unsigned int)strtoul(hex, NULL, 16);
+                if (!--parser->unicode)
+                    append(parser, (parser->codepoint < 0x80) ? (char)parser->codepoint : '?');
+                return true;
+            }
+            if (parser->escape) {
+                parser->escape = false;
+                switch (c) {
+                    case 'u':
+                        parser->unicode = 4;
+                        parser->codepoint = 0;
+                        return true;
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'r': c = '\r'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                }
+                append(parser, c);
+                return true;
+            }
+            if (c == '\\') {
+                parser->escape = true;
+                return true;
+            }
+            if (c == '"') {
+                if (parser->is_key) {
+                    parser->is_key = false;
+                    parser->state = JSON_colon;
+                } else
+                    value_done(parser);
+                return true;
+            }
+            append(parser, c);
+            return true;
+        
+        case JSON_literal:
+            if (is_space(c) || (c == ',') || (c == '}') || (c == ']')) {
+                value_done(parser);
+                return parse_char(parser, c);
+            }
+            append(parser, c);
+            return true;
+        
+        case JSON_done:
+            return is_space(c);
+    }
+    return false;
+}
+
+bool json_feed(struct sbpd_json_parser * parser, const char * data, size_t length) {
+    if (parser->invalid)
+        return false;
+    for (size_t pos = 0; pos < length; pos++) {
+        //
+        //  Fast path: skip strings nobody asked for
+        //
+        if ((parser->state == JSON_string) && !parser->capture && !parser->is_key &&
+            !parser->escape && !parser->unicode) {
+            while ((pos < length) && (data[pos] != '"') && (data[pos] != '\\'))
+                pos++;
+            if (pos == length)
+                break;
+        }
+        if (!parse_char(parser, data[pos])) {
+            parser->invalid = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool json_end(struct sbpd_json_parser * parser) {
+    //
+    //  A top-level number has no terminator
+    //
+    if ((parser->state == JSON_literal) && !parser->depth)
+        value_done(parser);
+    return !parser->invalid && (parser->state == JSON_done) && !parser->error;
+}
@@ -0,0 +1,127 @@
+//
+//  jsonparse.h
+//  SqueezeButtonPi
+//
+//  Incremental JSON-RPC reply parser
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef jsonparse_h
+#define jsonparse_h
+
+#include "sbpd.h"
+
+//
+//  Limits
+//  Keys and values longer than this are truncated (keys won't match)
+//
+#define max_json_depth  32
+#define max_json_key    32
+#define max_json_value  128     // a sync group: up to 7 MACs
+
+//
+//  Field types
+//      int: number or numeric string, e.g. "_volume":"30" -> 30
+//      bool: 1, "1" or true
+//      string: copied into the caller's buffer, NUL terminated
+//
+typedef enum {
+    SBPD_json_int = 1,
+    SBPD_json_bool,
+    SBPD_json_string,
+} sbpd_json_type_t;
+
+//
+//  A field to extract from the "result" object of a reply
+//  e.g. { "_volume", SBPD_json_int, &volume, sizeof(volume) }
+//
+struct sbpd_json_field {
+    const char * key;
+    sbpd_json_type_t type;
+    void * value;               // long *, bool * or char buffer
+    size_t size;                // buffer size for strings
+    bool found;
+};
+
+//
+//  Parser state
+//  Fixed size, keeps everything needed to continue at any byte of a reply
+//
+struct sbpd_json_parser {
+    struct sbpd_json_field * fields;
+    int count;
+    uint8_t state;
+    uint8_t stack[max_json_depth];  // open containers: '{' or '['
+    int depth;
+    bool escape;
+    int unicode;                // hex digits of a \u escape still to come
+    unsigned int codepoint;
+    bool capture;               // current key or value is of interest
+    bool is_key;
+    bool in_result;             // inside the top-level "result" object
+    bool error;                 // top-level "error" member, not null
+    bool error_key;             // "error" read, its value is next
+    bool result;                // top-level "result" member
+    bool invalid;               // syntax error
+    int field;                  // field for the current value, -1: none
+    size_t key_length;
+    char key[max_json_key];
+    char parent[max_json_key];  // top-level key of the current value
+    size_t value_length;
+    char value[max_json_value];
+};
+
+//
+//  Start parsing a reply
+//  Parameters:
+//      parser: the parser state
+//      fields: fields to extract, found flags are cleared. Can be NULL
+//      count: number of fields
+//
+void json_begin(struct sbpd_json_parser * parser, struct sbpd_json_field * fields, int count);
+
+//
+//  Parse the next chunk of a reply
+//  Chunks can end anywhere, nothing is copied but extracted fields.
+//  Parameters:
+//      parser: the parser state
+//      data: the chunk, not NUL terminated
+//      length: chunk length
+//  Returns: false on a syntax error, the rest of the reply is ignored then
+//
+bool json_feed(struct sbpd_json_parser * parser, const char * data, size_t length);
+
+//
+//  Finish parsing
+//  Returns: true if the reply was complete, valid JSON without an "error" member
+//           other than "error": null
+//
+bool json_end(struct sbpd_json_parser * parser);
+
+#endif /* jsonparse_h */
@@ -0,0 +1,286 @@
+//
+//  netlink.c
+//  SqueezeButtonPi
+//
+//  Network interface state through rtnetlink
+//  - Event driven wait for network readiness at startup
+//  - Hardware address lookup via RTM_GETLINK
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "netlink.h"
+#include "sbpd.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_arp.h>
+
+//
+//  Interface table, filled from link and address messages
+//
+#define max_interfaces  32
+#define max_addresses   8       // IPv4 addresses tracked per interface
+
+struct interface {
+    int index;
+    unsigned int flags;
+    bool ipv4;              // has an IPv4 address
+    int addresses;          // IPv4 addresses known, see handle_address()
+    uint32_t address[max_addresses];
+    int order;              // order of first IPv4 address, 0: none yet
+    bool has_mac;
+    uint8_t mac[6];
+};
+
+static struct interface interfaces[max_interfaces];
+static int numberofinterfaces = 0;
+static int address_order = 0;
+
+#define NL_BUFFER_SIZE  8192
+
+//
+//  Get table entry for an interface index
+//  Returns NULL if the table is full
+//
+static struct interface * get_interface(int index) {
+    for (int cnt = 0; cnt < numberofinterfaces; cnt++)
+        if (interfaces[cnt].index == index)
+            return interfaces + cnt;
+    if (numberofinterfaces == max_interfaces)
+        return NULL;
+    struct interface * interface = interfaces + numberofinterfaces++;
+    memset(interface, 0, sizeof(*interface));
+    interface->index = index;
+    return interface;
+}
+
+//
+//  Usable interface available?
+//
+static bool network_ready() {
+    for (int cnt = 0; cnt < numberofinterfaces; cnt++) {
+        unsigned int flags = interfaces[cnt].flags;
+        if ((flags & IFF_UP) && (flags & IFF_RUNNING) && !(flags & IFF_LOOPBACK) &&
+            interfaces[cnt].ipv4)
+            return true;
+    }
+    return false;
+}
+
+//
+//  Handle link messages
+//
+static void handle_link(struct nlmsghdr * msg) {
+    struct ifinfomsg * info = NLMSG_DATA(msg);
+    struct interface * interface = get_interface(info->ifi_index);
+    if (!interface)
+        return;
+    if (msg->nlmsg_type == RTM_DELLINK) {
+        interface->flags = 0;
+        interface->ipv4 = false;
+        interface->addresses = 0;
+        return;
+    }
+    interface->flags = info->ifi_flags;
+    int length = IFLA_PAYLOAD(msg);
+    for (struct rtattr * attr = IFLA_RTA(info); RTA_OK(attr, length); attr = RTA_NEXT(attr, length)) {
+        if ((attr->rta_type == IFLA_ADDRESS) && (RTA_PAYLOAD(attr) == 6)) {
+            memcpy(interface->mac, RTA_DATA(attr), 6);
+            interface->has_mac = true;
+        }
+    }
+}
+
+//
+//  Handle IPv4 address messages
+//  Addresses are kept per interface: the kernel repeats RTM_NEWADDR for
+//  known addresses and an interface may have several, it only loses IPv4
+//  with its last one. Beyond max_addresses only the first ones are tracked.
+//
+static void handle_address(struct nlmsghdr * msg) {
+    struct ifaddrmsg * info = NLMSG_DATA(msg);
+    if (info->ifa_family != AF_INET)
+        return;
+    struct interface * interface = get_interface(info->ifa_index);
+    if (!interface)
+        return;
+    uint32_t address = 0;
+    int length = IFA_PAYLOAD(msg);
+    for (struct rtattr * attr = IFA_RTA(info); RTA_OK(attr, length); attr = RTA_NEXT(attr, length)) {
+        if (((attr->rta_type == IFA_LOCAL) || ((attr->rta_type == IFA_ADDRESS) && !address)) &&
+            (RTA_PAYLOAD(attr) == sizeof(address)))
+            memcpy(&address, RTA_DATA(attr), sizeof(address));
+    }
+    int slot = 0;
+    while ((slot < interface->addresses) && (interface->address[slot] != address))
+        slot++;
+    if (msg->nlmsg_type == RTM_NEWADDR) {
+        if ((slot == interface->addresses) && (slot < max_addresses))
+            interface->address[interface->addresses++] = address;
+    } else if (slot < interface->addresses)
+        interface->address[slot] = interface->address[--interface->addresses];
+    interface->ipv4 = (interface->addresses > 0);
+    if (interface->ipv4 && !interface->order)
+        interface->order = ++address_order;
+}
+
+//
+//  Read and handle messages
+//  Returns: 1 if a dump is complete, 0 if more data is expected, -1 on error
+//
+static int read_messages(int fd) {
+    static char buffer[NL_BUFFER_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+    if (size < 0)
+        return (errno == ENOBUFS) ? 0 : -1;   // overrun: state gets corrected by later events
+    int done = 0;
+    for (struct nlmsghdr * msg = (struct nlmsghdr *)buffer;
+         NLMSG_OK(msg, size);
+         msg = NLMSG_NEXT(msg, size)) {
+        switch (msg->nlmsg_type) {
+            case NLMSG_DONE:
+                done = 1;
+                break;
+            case NLMSG_ERROR:
+                return -1;
+            case RTM_NEWLINK:
+            case RTM_DELLINK:
+                handle_link(msg);
+                break;
+            case RTM_NEWADDR:
+            case RTM_DELADDR:
+                handle_address(msg);
+                break;
+            default:
+                break;
+        }
+    }
+    return done;
+}
+
+//
+//  Request a dump and read it
+//
+static bool dump(int fd, int type) {
+    struct {
+        struct nlmsghdr header;
+        struct rtgenmsg gen;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+    request.header.nlmsg_type = type;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = type;
+    request.gen.rtgen_family = AF_UNSPEC;
+    if (send(fd, &request, request.header.nlmsg_len, 0) < 0)
+        return false;
+    int result;
+    while (!(result = read_messages(fd)))
+        ;
+    return result > 0;
+}
+
+//
+//  Open a route socket and read the current interface state
+//  Parameters:
+//      groups: multicast groups to subscribe to, 0 for none
+//  Returns: socket or -1
+//
+static int open_netlink(uint32_t groups) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        logerr("Could not open netlink socket");
+        return -1;
+    }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+    //
+    //  Subscribe before dumping so we don't miss changes in between
+    //
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        !dump(fd, RTM_GETLINK) ||
+        !dump(fd, RTM_GETADDR)) {
+        logerr("Could not read interfaces from netlink");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//
+//  Wait until a usable network interface is available
+//
+bool wait_for_network() {
+    int fd = open_netlink(RTMGRP_LINK | RTMGRP_IPV4_IFADDR);
+    if (fd < 0)
+        return false;
+    if (!network_ready())
+        lognotice("Waiting for network");
+    while (!network_ready()) {
+        if (read_messages(fd) < 0) {
+            if (errno != EINTR)
+                logerr("Netlink read failed");
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+//
+//  Get the player MAC address
+//
+bool netlink_get_mac(uint8_t mac[]) {
+    int fd = open_netlink(0);
+    if (fd < 0)
+        return false;
+    close(fd);
+    struct interface * found = NULL;
+    for (struct interface * interface = interfaces;
+         interface < interfaces + numberofinterfaces;
+         interface++) {
+        if (!interface->ipv4 || !interface->has_mac ||
+            (interface->mac[0] + interface->mac[1] + interface->mac[2] == 0))
+            continue;
+        if (!found || (interface->order < found->order))
+            found = interface;
+    }
+    if (!found)
+        return false;
+    memcpy(mac, found->mac, 6);
+    return true;
+}
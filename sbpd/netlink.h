@@ -0,0 +1,62 @@
+//
+//  netlink.h
+//  SqueezeButtonPi
+//
+//  Network interface state through rtnetlink
+//  - Wait for a usable network interface without polling
+//  - Find hardware addresses of all interfaces
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef netlink_h
+#define netlink_h
+
+#include "sbpd.h"
+
+//
+//  Wait until a usable network interface is available
+//  Usable: up and running, not loopback, with an IPv4 address.
+//  Blocks on rtnetlink link and address events, returns immediately if an
+//  interface is already usable.
+//  Returns: true when the network is ready, false on error or if interrupted by a signal
+//
+bool wait_for_network();
+
+//
+//  Get the player MAC address
+//  Same choice as SqueezeLite: the first interface with an IPv4 address
+//  (in kernel order) having a hardware address with a non-zero OUI.
+//  All interfaces are checked, not just the first few.
+//  Parameters:
+//      mac: receives 6 bytes MAC
+//  Returns: true if a MAC was found
+//
+bool netlink_get_mac(uint8_t mac[]);
+
+#endif /* netlink_h */
@@ -0,0 +1,179 @@
+//
+//  players.c
+//  SqueezeButtonPi
+//
+//  Player targets
+//  - Keep the players commands can be sent to
+//  - Follow the sync groups of group targets
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "players.h"
+#include "servercomm.h"
+#include "clicomm.h"
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+//
+//  Players
+//  Player 0 is the default player. Members of sync groups are added as
+//  players of their own, by the MAC the server reports.
+//
+static struct {
+    char id[max_player_id];
+    char cli_id[3 * max_player_id];
+    bool group;                 // a group target: follow its sync group
+    int members[max_players];   // the other players in its sync group
+    int count;
+    sbpd_request_t query;       // sync group query in flight, -1: none
+    sbpd_time_t refresh;        // time of the next query
+    char sync[max_json_value];  // query reply: "-" or comma separated MACs
+    struct sbpd_json_field field;
+} players[max_players];
+static int numberofplayers = 1;
+
+static struct {
+    char host[16];
+    uint32_t port;
+} groupServer;
+
+static void set_player(int player, const char * id) {
+    snprintf(players[player].id, sizeof(players[player].id), "%s", id);
+    cli_encode(players[player].id, players[player].cli_id, sizeof(players[player].cli_id));
+    players[player].query = -1;
+}
+
+//
+//  Find a player, add it if it's new
+//  Returns: the player or -1 if there are too many
+//
+static int get_player(const char * id) {
+    for (int cnt = 0; cnt < numberofplayers; cnt++)
+        if (!strcasecmp(players[cnt].id, id))
+            return cnt;
+    if (numberofplayers == max_players)
+        return -1;
+    set_player(numberofplayers, id);
+    return numberofplayers++;
+}
+
+void init_players(const char * mac) {
+    set_player(0, (mac) ? mac : "");
+}
+
+sbpd_target_t add_target(const char * spec) {
+    if (!spec)
+        return SBPD_target_default;
+    bool group = (spec[0] == '@');
+    if (group)
+        spec++;
+    int player = (*spec) ? get_player(spec) : 0;
+    if (player < 0) {
+        logerr("Maximum number of players exceeded: %i", max_players);
+        return -1;
+    }
+    if (group)
+        players[player].group = true;
+    return player | ((group) ? SBPD_target_group : 0);
+}
+
+const char * player_id(int player) {
+    return players[player].id;
+}
+
+const char * player_cli_id(int player) {
+    return players[player].cli_id;
+}
+
+int target_players(sbpd_target_t target, int out[max_players]) {
+    int player = SBPD_target_player(target);
+    out[0] = player;
+    if (!(target & SBPD_target_group))
+        return 1;
+    memcpy(out + 1, players[player].members, players[player].count * sizeof(int));
+    return players[player].count + 1;
+}
+
+//
+//  Sync group query reply: {..."result":{"_sync":"00:04:20:aa:bb:cc,00:04:20:dd:ee:ff"}}
+//
+static void sync_reply(sbpd_request_t request, bool success, void * context) {
+    int player = (int)(intptr_t)context;
+    players[player].query = -1;
+    if (!success || !players[player].field.found) {
+        logwarn("Could not read the sync group of player %s", players[player].id);
+        return;
+    }
+    int members[max_players];
+    int count = 0;
+    char * save = NULL;
+    for (char * id = strtok_r(players[player].sync, ",", &save); id; id = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(id, "-"))
+            continue;
+        int member = get_player(id);
+        if (member < 0) {
+            logwarn("Maximum number of players exceeded, sync group of %s incomplete", players[player].id);
+            break;
+        }
+        if ((member != player) && (count < max_players - 1))
+            members[count++] = member;
+    }
+    if ((count == players[player].count) &&
+        !memcmp(members, players[player].members, count * sizeof(int)))
+        return;
+    memcpy(players[player].members, members, count * sizeof(int));
+    players[player].count = count;
+    loginfo("Sync group of player %s: %d players", players[player].id, count + 1);
+}
+
+void poll_players(struct sbpd_server * server) {
+    if (!server->host || !server->port)
+        return;
+    //
+    //  Groups are per server, query again after a change
+    //
+    bool changed = (groupServer.port != server->port) || strcmp(groupServer.host, server->host);
+    if (changed) {
+        snprintf(groupServer.host, sizeof(groupServer.host), "%s", server->host);
+        groupServer.port = server->port;
+    }
+    sbpd_time_t now = clock_now();
+    for (int cnt = 0; cnt < numberofplayers; cnt++) {
+        if (!players[cnt].group || (players[cnt].query >= 0) ||
+            (!changed && (now < players[cnt].refresh)))
+            continue;
+        players[cnt].refresh = now + SBPD_GROUP_REFRESH;
+        players[cnt].field = (struct sbpd_json_field){
+            "_sync", SBPD_json_string, players[cnt].sync, sizeof(players[cnt].sync), false
+        };
+        players[cnt].query = send_query(server, cnt, "[\"sync\",\"?\"]", &players[cnt].field, 1,
+                                        sync_reply, (void *)(intptr_t)cnt);
+    }
+}
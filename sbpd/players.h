@@ -0,0 +1,99 @@
+//
+//  players.h
+//  SqueezeButtonPi
+//
+//  Player targets
+//  - Commands go to the default player, another player or a sync group
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef players_h
+#define players_h
+
+#include "sbpd.h"
+#include "timing.h"
+
+//
+//  Targets
+//  Control elements send to the default player (-M or autodetected)
+//  unless they name another one, by MAC or by name: the server resolves
+//  both. "@player" is the player and all players synced with it, the
+//  group is queried from the server and followed.
+//
+#define max_players         8       // targets and the members of their groups
+#define max_player_id       64
+#define SBPD_GROUP_REFRESH  (30 * SCD_SECOND)
+
+typedef int sbpd_target_t;
+
+#define SBPD_target_default     0           // player 0
+#define SBPD_target_group       0x100       // flag: with the player's sync group
+#define SBPD_target_player(t)   ((t) & 0xff)
+
+//
+//  Set the default player
+//  Parameters:
+//      mac: the player MAC address
+//
+void init_players(const char * mac);
+
+//
+//  Add a target
+//  The same player is only added once
+//  Parameters:
+//      spec: MAC or name, "@" in front for its sync group. NULL or "" for the default player
+//  Returns: the target or -1 if there are too many players
+//
+sbpd_target_t add_target(const char * spec);
+
+//
+//  Player ids
+//  player_id: MAC or name as configured, for JSON-RPC
+//  player_cli_id: the same, URL encoded for the CLI
+//
+const char * player_id(int player);
+const char * player_cli_id(int player);
+
+//
+//  The players of a target
+//  Parameters:
+//      target: the target
+//      players: receives the player numbers, the target's player first
+//  Returns: number of players, at least 1
+//
+int target_players(sbpd_target_t target, int players[max_players]);
+
+//
+//  Polling function: query and refresh the sync groups of group targets
+//  Parameters:
+//      server: the server
+//
+void poll_players(struct sbpd_server * server);
+
+#endif /* players_h */
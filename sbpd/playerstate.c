@@ -0,0 +1,354 @@
+//
+//  playerstate.c
+//  SqueezeButtonPi
+//
+//  Player state cache
+//  - Subscribe to player notifications on the server's CLI port
+//  - Keep power, mode, volume and muting up to date from server pushes
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "playerstate.h"
+#include "eventloop.h"
+#include "events.h"
+#include "clicomm.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/param.h>
+
+#define CLI_RETRY           (10 * SCD_SECOND)   // reconnect interval
+#define CLI_SUBSCRIPTION    "subscribe mixer,power,pause,play,stop,mode,client\n"
+#define max_cli_line        1024
+#define max_cli_tokens      8
+
+static const char * playerMAC = NULL;
+static char encodedMAC[64];
+static struct sbpd_player_state state = { false, false, false, -1, SBPD_mode_unknown, 0 };
+static int volumeQueries = 0;   // replies to "mixer volume ?" still to come
+
+//
+//  CLI connection
+//
+static struct {
+    int fd;                     // -1: not connected
+    bool connected;             // connect() completed
+    char host[16];
+    uint32_t port;
+    sbpd_time_t next_connect;
+    sbpd_time_t connect_deadline;
+    bool failed;                // last attempt failed, log quietly
+    size_t length;
+    char buffer[max_cli_line];
+} cli = { .fd = -1 };
+
+static void cli_handler(int fd, short revents, void * context);
+
+//
+//  Publish the state after a change
+//
+static void publish_state() {
+    state.updated = clock_now();
+    struct sbpd_event event = {
+        .type = SBPD_evt_player,
+        .player = {
+            .known = state.known,
+            .power = state.power,
+            .muted = state.muted,
+            .volume = (int8_t)state.volume,
+            .mode = state.mode
+        }
+    };
+    publish_event(&event);
+}
+
+//
+//  Send a command line
+//  Lines are short, the socket buffer takes them whole or the connection is broken
+//
+static bool cli_send(const char * line) {
+    size_t length = strlen(line);
+    return write(cli.fd, line, length) == (ssize_t)length;
+}
+
+//
+//  Query a player value, e.g. "power"
+//  The reply comes in like a notification with the value instead of "?"
+//
+static bool query(const char * what) {
+    char line[96];
+    snprintf(line, sizeof(line), "%s %s ?\n", encodedMAC, what);
+    if (!strcmp(what, "mixer volume"))
+        volumeQueries++;
+    return cli_send(line);
+}
+
+//
+//  Query the full player state
+//
+static bool query_state() {
+    return query("power") && query("mode") && query("mixer volume") && query("mixer muting");
+}
+
+static void cli_close() {
+    if (cli.fd >= 0) {
+        unwatch_fd(cli.fd);
+        close(cli.fd);
+    }
+    cli.fd = -1;
+    cli.connected = false;
+    cli.length = 0;
+    volumeQueries = 0;
+    cli.next_connect = clock_now() + CLI_RETRY;
+    if (state.known) {
+        state.known = false;
+        publish_state();
+    }
+}
+
+//
+//  Connected: log in if needed, subscribe and query the current state
+//
+static bool cli_start(struct sbpd_server * server) {
+    if (server->user && server->password) {
+        char user[128], password[128], line[300];
+        cli_encode(server->user, user, sizeof(user));
+        cli_encode(server->password, password, sizeof(password));
+        snprintf(line, sizeof(line), "login %s %s\n", user, password);
+        if (!cli_send(line))
+            return false;
+    }
+    return cli_send(CLI_SUBSCRIPTION) && query_state();
+}
+
+//
+//  Start a non-blocking connect to the CLI port
+//
+static void cli_connect(struct sbpd_server * server) {
+    snprintf(cli.host, sizeof(cli.host), "%s", server->host);
+    cli.port = (server->cli_port) ? server->cli_port : SBPD_CLI_PORT;
+    cli.fd = cli_socket(cli.host, cli.port);
+    if (cli.fd < 0) {
+        cli.next_connect = clock_now() + CLI_RETRY;
+        return;
+    }
+    cli.connect_deadline = clock_now() + CLI_CONNECT_TIMEOUT;
+    watch_fd(cli.fd, POLLOUT, cli_handler, server);
+}
+
+//
+//  Apply a notification or query reply
+//  tokens[0] is the player, the rest the command
+//
+static void handle_line(char * tokens[], int count) {
+    if ((count < 2) || strcasecmp(tokens[0], playerMAC))
+        return;
+    const char * command = tokens[1];
+    const char * argument = (count > 2) ? tokens[2] : NULL;
+    bool changed = false;
+    
+    if (!strcmp(command, "mixer") && argument) {
+        const char * value = (count > 3) ? tokens[3] : NULL;
+        if (!strcmp(argument, "volume")) {
+            //
+            //  Notifications carry the command as sent: ask for the result of
+            //  relative changes. Query replies are negative for a muted player.
+            //
+            bool reply = volumeQueries > 0;
+            if (reply)
+                volumeQueries--;
+            if (!value || (!reply && ((*value == '+') || (*value == '-')))) {
+                query("mixer volume");
+                return;
+            }
+            int volume = (int)strtol(value, NULL, 10);
+            if (reply)
+                state.muted = volume < 0;
+            state.volume = MIN(abs(volume), 100);
+            changed = true;
+        } else if (!strcmp(argument, "muting")) {
+            if (value && (*value != '?')) {
+                state.muted = (*value == '1');
+                changed = true;
+            } else {
+                query("mixer muting");
+                return;
+            }
+        }
+    } else if (!strcmp(command, "power")) {
+        if (argument && (*argument != '?')) {
+            state.power = (*argument == '1');
+            changed = true;
+        } else {
+            query("power");
+            return;
+        }
+    } else if (!strcmp(command, "play")) {
+        state.mode = SBPD_mode_play;
+        changed = true;
+    } else if (!strcmp(command, "stop")) {
+        state.mode = SBPD_mode_stop;
+        changed = true;
+    } else if (!strcmp(command, "pause") || !strcmp(command, "mode")) {
+        if (argument && !strcmp(command, "mode") && (*argument != '?')) {
+            state.mode = (!strcmp(argument, "play")) ? SBPD_mode_play :
+                         (!strcmp(argument, "pause")) ? SBPD_mode_pause : SBPD_mode_stop;
+            changed = true;
+        } else if (argument && !strcmp(command, "pause") && (*argument == '0' || *argument == '1')) {
+            state.mode = (*argument == '1') ? SBPD_mode_pause : SBPD_mode_play;
+            changed = true;
+        } else {
+            //
+            //  Pause toggle: the result isn't in the notification
+            //
+            query("mode");
+            return;
+        }
+    } else if (!strcmp(command, "client") && argument) {
+        if (!strcmp(argument, "new") || !strcmp(argument, "reconnect")) {
+            query_state();
+            return;
+        }
+        state.power = false;
+        state.mode = SBPD_mode_stop;
+        changed = true;
+    }
+    
+    if (changed) {
+        state.known = true;
+        publish_state();
+    }
+}
+
+//
+//  Split the received data into lines, lines into URL decoded tokens
+//
+static void parse_lines() {
+    char * start = cli.buffer;
+    char * end;
+    while ((end = memchr(start, '\n', cli.buffer + cli.length - start))) {
+        *end = 0;
+        char * tokens[max_cli_tokens];
+        int count = 0;
+        char * save;
+        for (char * token = strtok_r(start, " \r", &save);
+             token && (count < max_cli_tokens);
+             token = strtok_r(NULL, " \r", &save)) {
+            cli_decode(token);
+            tokens[count++] = token;
+        }
+        handle_line(tokens, count);
+        start = end + 1;
+    }
+    cli.length -= start - cli.buffer;
+    memmove(cli.buffer, start, cli.length);
+    //
+    //  Overlong line (e.g. a status reply we didn't ask for): drop it
+    //
+    if (cli.length == sizeof(cli.buffer))
+        cli.length = 0;
+}
+
+//
+//  Event loop handler for the CLI connection
+//
+static void cli_handler(int fd, short revents, void * context) {
+    if (!cli.connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error || (revents & (POLLERR | POLLHUP))) {
+            if (!cli.failed)
+                loginfo("No CLI connection to %s:%u, player state unknown", cli.host, cli.port);
+            cli.failed = true;
+            cli_close();
+            return;
+        }
+        cli.connected = true;
+        if (!cli_start(context)) {
+            cli_close();
+            return;
+        }
+        cli.failed = false;
+        loginfo("Subscribed to player state on %s:%u", cli.host, cli.port);
+        watch_fd(fd, POLLIN, cli_handler, context);
+        return;
+    }
+    
+    ssize_t received = read(fd, cli.buffer + cli.length, sizeof(cli.buffer) - cli.length);
+    if (received <= 0) {
+        if ((received < 0) && (errno == EAGAIN))
+            return;
+        loginfo("CLI connection to %s:%u closed", cli.host, cli.port);
+        cli_close();
+        return;
+    }
+    cli.length += received;
+    parse_lines();
+}
+
+void init_player_state(const char * mac) {
+    playerMAC = mac;
+    cli_encode(mac, encodedMAC, sizeof(encodedMAC));
+}
+
+void poll_player_state(struct sbpd_server * server) {
+    if (!playerMAC)
+        return;
+    //
+    //  Follow server changes
+    //
+    if ((cli.fd >= 0) && server->host &&
+        (strcmp(cli.host, server->host) ||
+         (cli.port != ((server->cli_port) ? server->cli_port : SBPD_CLI_PORT)))) {
+        cli_close();
+        cli.next_connect = 0;
+    }
+    if ((cli.fd >= 0) && !cli.connected && (clock_now() >= cli.connect_deadline)) {
+        if (!cli.failed)
+            loginfo("CLI connection to %s:%u timed out, player state unknown", cli.host, cli.port);
+        cli.failed = true;
+        cli_close();
+    }
+    if ((cli.fd < 0) && server->host && (clock_now() >= cli.next_connect))
+        cli_connect(server);
+}
+
+const struct sbpd_player_state * player_state() {
+    return &state;
+}
+
+void shutdown_player_state() {
+    cli_close();
+}
@@ -0,0 +1,93 @@
+//
+//  playerstate.h
+//  SqueezeButtonPi
+//
+//  Player state cache
+//  Kept up to date by a subscription on the server's CLI port
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef playerstate_h
+#define playerstate_h
+
+#include "sbpd.h"
+#include "timing.h"
+
+//
+//  Player modes
+//
+typedef enum {
+    SBPD_mode_unknown = 0,
+    SBPD_mode_stop,
+    SBPD_mode_play,
+    SBPD_mode_pause,
+} sbpd_mode_t;
+
+//
+//  Player state
+//  Only valid if "known" is set. Volume is -1 until reported.
+//
+struct sbpd_player_state {
+    bool known;                 // connected and subscribed, player state queried
+    bool power;
+    bool muted;
+    int volume;                 // 0..100, -1: unknown
+    sbpd_mode_t mode;
+    sbpd_time_t updated;        // time of the last change
+};
+
+//
+//  Initialize the player state cache
+//  The cache follows the default player only, see players.h
+//  Parameters:
+//      mac: the player MAC address
+//
+void init_player_state(const char * mac);
+
+//
+//  Polling function: connect, reconnect and follow server changes
+//  Server pushes are read from the event loop, changes are published
+//  as SBPD_evt_player.
+//  Parameters:
+//      server: the server, uses host and cli_port
+//
+void poll_player_state(struct sbpd_server * server);
+
+//
+//  Current player state
+//  Local state, no server round trip
+//
+const struct sbpd_player_state * player_state();
+
+//
+//  Close the subscription
+//
+void shutdown_player_state();
+
+#endif /* playerstate_h */
@@ -0,0 +1,263 @@
+//
+//  privsep.c
+//  SqueezeButtonPi
+//
+//  Privilege separation
+//  - Shared memory SPSC ring for input events, eventfd for wake-ups
+//  - Privileged GPIO process, unprivileged network process
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "privsep.h"
+#include "sbpd.h"
+#include "timing.h"
+#include "eventloop.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <grp.h>
+#include <pwd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+
+//
+//  The ring
+//  Lives in shared memory, set up before forking.
+//  Single producer (GPIO process, serialized by a spin lock since every
+//  interrupt runs on its own thread), single consumer (network process).
+//
+struct input_ring {
+    volatile unsigned long tail;        // written by producer
+    volatile int lock;                  // producer lock
+    char pad1[64];
+    volatile unsigned long head;        // written by consumer
+    volatile int sleeping;              // consumer waits for eventfd
+    char pad2[64];
+    struct sbpd_event events[input_ring_size];
+    //
+    //  Statistics, GPIO process
+    //
+    volatile unsigned long dropped;
+};
+
+static struct input_ring * ring = NULL;
+static int wakeup_fd = -1;
+static pid_t network_pid = 0;
+static void wakeup_handler(int fd, short revents, void * context);
+
+//
+//  Latency statistics, network process
+//
+static unsigned long latency_count = 0;
+static sbpd_time_t latency_sum = 0;
+static sbpd_time_t latency_max = 0;
+
+//
+//  Drop root privileges
+//
+static bool drop_privileges(const char * user) {
+    struct passwd * pw = getpwnam(user);
+    if (!pw) {
+        logerr("Unknown user %s", user);
+        return false;
+    }
+    if (setgroups(0, NULL) || setgid(pw->pw_gid) || setuid(pw->pw_uid)) {
+        logerr("Could not drop privileges to user %s", user);
+        return false;
+    }
+    if (!setuid(0)) {
+        logerr("Privileges could not be dropped");
+        return false;
+    }
+    loginfo("Network process running as user %s", user);
+    return true;
+}
+
+//
+//  Set up the ring, before any input can be forwarded
+//
+int init_privsep() {
+    ring = mmap(NULL, sizeof(struct input_ring), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        logerr("Could not map input ring");
+        return -1;
+    }
+    memset(ring, 0, sizeof(*ring));
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        logerr("Could not create eventfd");
+        munmap(ring, sizeof(*ring));
+        ring = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+//
+//  Split into GPIO and network process
+//  Input forwarded before is in the ring already
+//
+sbpd_process_t start_privsep(const char * user) {
+    if (!ring)
+        return SBPD_proc_error;
+    network_pid = fork();
+    if (network_pid == -1) {
+        logerr("Could not fork network process");
+        return SBPD_proc_error;
+    }
+    if (network_pid) {
+        loginfo("Network process started: pid %d", network_pid);
+        return SBPD_proc_gpio;
+    }
+    
+    //
+    //  Network process
+    //  Terminate with the GPIO process
+    //
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (user && !drop_privileges(user))
+        _exit(-1);
+    set_input_sink(NULL);
+    watch_fd(wakeup_fd, POLLIN, wakeup_handler, NULL);
+    return SBPD_proc_network;
+}
+
+//
+//  GPIO process: forward an input event
+//
+void privsep_forward(const struct sbpd_event * event) {
+    while (__atomic_test_and_set(&ring->lock, __ATOMIC_ACQUIRE))
+        ;
+    unsigned long tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == input_ring_size) {
+        ring->dropped++;
+        __atomic_clear(&ring->lock, __ATOMIC_RELEASE);
+        return;
+    }
+    ring->events[tail & (input_ring_size - 1)] = *event;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_clear(&ring->lock, __ATOMIC_RELEASE);
+    
+    //
+    //  Only wake up the consumer if it sleeps: saves a syscall per event
+    //
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(wakeup_fd, &one, sizeof(one)) < 0)
+            logdebug("eventfd write failed");
+    }
+}
+
+//
+//  Network process: eventfd is readable, just clear it.
+//  The events are taken from the ring by privsep_poll()
+//
+static void wakeup_handler(int fd, short revents, void * context) {
+    uint64_t count;
+    if ((read(fd, &count, sizeof(count)) < 0) && (errno != EAGAIN))
+        logwarn("eventfd read failed: %d", errno);
+}
+
+static bool ring_empty() {
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head;
+}
+
+//
+//  Network process: about to wait in the event loop
+//  From here on the GPIO process signals new events through the eventfd
+//
+bool privsep_prepare() {
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return !ring_empty();
+}
+
+//
+//  Network process: apply queued input events
+//
+int privsep_poll(input_sink_t sink) {
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+    int count = 0;
+    unsigned long head = ring->head;
+    while (head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        struct sbpd_event event = ring->events[head & (input_ring_size - 1)];
+        __atomic_store_n(&ring->head, ++head, __ATOMIC_RELEASE);
+        //
+        //  Transfer latency: both processes use the same monotonic clock
+        //
+        sbpd_time_t latency = clock_now() - event.time;
+        latency_sum += latency;
+        latency_count++;
+        if (latency > latency_max)
+            latency_max = latency;
+        logdebug("Input event from GPIO process, latency %llu µs",
+                 (unsigned long long)latency);
+        sink(&event);
+        count++;
+    }
+    return count;
+}
+
+//
+//  Log ring statistics
+//
+static void log_statistics() {
+    if (latency_count)
+        lognotice("Input ring: %lu events, latency avg %llu µs, max %llu µs, %lu dropped",
+                  latency_count,
+                  (unsigned long long)(latency_sum / latency_count),
+                  (unsigned long long)latency_max,
+                  ring->dropped);
+}
+
+//
+//  GPIO process: stop network process and clean up
+//  Network process: log statistics
+//
+void stop_privsep() {
+    if (!ring)
+        return;
+    if (!network_pid) {
+        log_statistics();
+        return;
+    }
+    kill(network_pid, SIGTERM);
+    waitpid(network_pid, NULL, 0);
+    close(wakeup_fd);
+    munmap(ring, sizeof(*ring));
+    ring = NULL;
+}
@@ -0,0 +1,103 @@
+//
+//  privsep.h
+//  SqueezeButtonPi
+//
+//  Privilege separation
+//  GPIO handling stays in the privileged process, the network code runs
+//  in an unprivileged child process. Input events are passed through a
+//  shared memory ring, wake-ups use an eventfd.
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef privsep_h
+#define privsep_h
+
+#include "sbpd.h"
+#include "events.h"
+#include "control.h"
+
+//
+//  Process roles
+//
+typedef enum {
+    SBPD_proc_single = 0,   // no privilege separation
+    SBPD_proc_gpio,         // privileged GPIO process
+    SBPD_proc_network,      // unprivileged network process
+    SBPD_proc_error = -1,
+} sbpd_process_t;
+
+//
+//  Ring size. Needs to be a power of two
+//
+#define input_ring_size     256
+
+//
+//  Set up the ring shared by the GPIO and the network process
+//  Call before the GPIO interrupts start with privsep_forward() as input
+//  sink: events from then on wait in the ring for the network process.
+//  Returns: 0 on success, -1 on error
+//
+int init_privsep();
+
+//
+//  Split into GPIO and network process
+//  Call after init_privsep(). The network process drops privileges to the given user.
+//  Parameters:
+//      user: the user to run the network process as, NULL: keep the privileges (benchmarks)
+//  Returns: the role of the calling process or SBPD_proc_error
+//
+sbpd_process_t start_privsep(const char * user);
+
+//
+//  GPIO process: input sink forwarding input events to the network process
+//  Safe to call from multiple GPIO interrupt threads
+//
+void privsep_forward(const struct sbpd_event * event);
+
+//
+//  Network process: call before waiting in the event loop
+//  The eventfd is watched by the event loop and wakes it up for input events.
+//  Returns: true if input events are already available, don't wait then
+//
+bool privsep_prepare();
+
+//
+//  Network process: apply queued input events
+//  Parameters:
+//      sink: called for every input event
+//  Returns: number of events
+//
+int privsep_poll(input_sink_t sink);
+
+//
+//  GPIO process: stop network process and clean up
+//
+void stop_privsep();
+
+#endif /* privsep_h */
@@ -0,0 +1,98 @@
+//
+//  profile.c
+//  SqueezeButtonPi
+//
+//  Startup critical path profiler
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "profile.h"
+#include "sbpd.h"
+#include "timing.h"
+
+struct phase {
+    const char * name;
+    sbpd_time_t begin;
+    volatile sbpd_time_t end;
+};
+
+static struct phase phases[max_phases];
+static volatile int numberofphases = 0;
+static sbpd_time_t start_time = 0;
+static volatile bool reported = false;
+
+//
+//  Start a startup phase
+//  The first phase marks process start
+//
+int begin_phase(const char * name) {
+    sbpd_time_t now = clock_now();
+    int phase = __atomic_fetch_add(&numberofphases, 1, __ATOMIC_ACQ_REL);
+    if (phase >= max_phases)
+        return -1;
+    if (!phase)
+        start_time = now;
+    phases[phase].name = name;
+    phases[phase].begin = now;
+    phases[phase].end = 0;
+    return phase;
+}
+
+//
+//  End a startup phase
+//
+void end_phase(int phase) {
+    if ((phase < 0) || (phase >= max_phases) || phases[phase].end)
+        return;
+    phases[phase].end = clock_now();
+    logdebug("Startup phase %s: %.1f ms", phases[phase].name,
+             (double)(phases[phase].end - phases[phase].begin) / SCD_MILLISECOND);
+}
+
+//
+//  Startup is complete: report
+//  Offsets are relative to the first phase
+//
+void startup_complete() {
+    if (reported || !numberofphases)
+        return;
+    reported = true;
+    sbpd_time_t now = clock_now();
+    int count = (numberofphases < max_phases) ? numberofphases : max_phases;
+    for (int phase = 0; phase < count; phase++) {
+        if (!phases[phase].end)
+            continue;
+        lognotice("Startup phase %-12s at %8.1f ms took %8.1f ms",
+                  phases[phase].name,
+                  (double)(phases[phase].begin - start_time) / SCD_MILLISECOND,
+                  (double)(phases[phase].end - phases[phase].begin) / SCD_MILLISECOND);
+    }
+    lognotice("Ready: first command accepted %.1f ms after start",
+              (double)(now - start_time) / SCD_MILLISECOND);
+}
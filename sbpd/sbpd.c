@@ -44,13 +44,31 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#ifndef SBPD_STATIC_CONFIG
 #include <argp.h>
-#include <sys/time.h>
+#endif
+#include <pthread.h>
+#include <semaphore.h>
 #include <sys/param.h>
+#include <arpa/inet.h>
 #include "sbpd.h"
 #include "discovery.h"
 #include "servercomm.h"
 #include "control.h"
+#include "timing.h"
+#include "events.h"
+#include "dispatch.h"
+#include "privsep.h"
+#include "netlink.h"
+#include "profile.h"
+#include "statecache.h"
+#include "alloc.h"
+#include "eventloop.h"
+#include "playerstate.h"
+#include "players.h"
+#ifdef SBPD_STATIC_CONFIG
+#include "sbpd_config.h"
+#endif
 
 //
 //  Server configuration
@@ -66,12 +84,27 @@ static char * MAC;
 static volatile int stop_signal;
 static void sigHandler( int sig, siginfo_t *siginfo, void *context );
 
+//
+//  Network startup thread
+//
+static sem_t network_done;
+static volatile bool network_ready = false;
+static sbpd_time_t start_time;
+static sbpd_time_t network_ready_time;
+static void * network_startup(void * arg);
+
+//
+//  Event logging
+//
+static void log_event(const struct sbpd_event * event, void * context);
+
 //
 //  Logging
 //
 static int streamloglevel = LOG_NOTICE;
 static int sysloglevel = LOG_ALERT;
 
+#ifndef SBPD_STATIC_CONFIG
 //
 //  Argument Parsing
 //
@@ -92,6 +125,11 @@ static struct argp_option options[] =
     { "port",      'P', "xxxx", 0, "Set server control port. Default: autodetect", 0 },
     { "username",  'u', "user name", 0, "Set user name for server. Default: none", 0 },
     { "password",  'p', "password", 0, "Set password for server. Default: none", 0 },
+    { "rules",     'f', "file", 0, "Read control rules from file. Default: none", 0 },
+    { "state",     'S', "file", 0, "Cache the server in this file for fast restarts. Default: none", 0 },
+    { "probe",     'i', "seconds", 0, "Probe the server when idle this long, 0: never. Default: 30", 0 },
+    { "user",      'U', "user", 0,
+        "Run network communication in a separate process as this user. Default: single process", 1 },
     { "verbose",   'v', 0, 0, "Produce verbose output", 1 },
     { "silent",    's', 0, 0, "Don't produce output", 1 },
     { "daemonize", 'd', 0, 0, "Daemonize", 1 },
@@ -104,16 +142,18 @@ static struct argp_option options[] =
 //  At least one needs to be specified for the daemon to do anything useful
 //  Arguments are a comma-separated list of configuration parameters:
 //  For rotary encoders (one, volume only):
-//      e,pin1,pin2,CMD[,edge]
+//      e,pin1,pin2,CMD[,edge[,player]]
 //          "e" for "Encoder"
 //          p1, p2: GPIO PIN numbers in BCM-notation
-//          CMD: Command. Unused for encoders, always VOLM for Volume
+//          CMD: Command. VOLU for Volume, VOLA for absolute volume or "-" for rules only
 //          edge: Optional. one of
 //                  1 - falling edge
 //                  2 - rising edge
 //                  0, 3 - both
+//          player: Optional. MAC or name of the player to control, "@" in front
+//                  for the player and its sync group. Default: the -M player
 //  For buttons:
-//      b,pin,CMD[,edge]
+//      b,pin,CMD[,edge[,player]]
 //          "b" for "Button"
 //          pin: GPIO PIN numbers in BCM-notation
 //          CMD: Command. One of:
@@ -123,12 +163,14 @@ static struct argp_option options[] =
 //              VOL+:   Increase volume
 //              VOL-:   Decrease volume
 //              POWR:   Toggle power state
+//              -:      None, actions defined by rules only
 //          edge: Optional. one of
 //                  1 - falling edge
 //                  2 - rising edge
 //                  0, 3 - both
+//          player: Optional, as for encoders
 //
-static char args_doc[] = "[e,pin1,pin2,CMD,edge] [b,pin,CMD,edge...]";
+static char args_doc[] = "[e,pin1,pin2,CMD,edge,player] [b,pin,CMD,edge,player...]";
 //
 //  DOC.  Field 4 in ARGP.
 //  Program documentation.
@@ -139,14 +181,50 @@ static char doc[] = "sbpd - SqueezeButtinPiDaemon is a button and rotary encoder
 //
 static struct argp argp = {options, parse_opt, args_doc, doc};
 static bool arg_daemonize = false;
+static char *arg_rules = NULL;
+static char *arg_user = NULL;
+static char *arg_state = NULL;
+static int arg_probe = SBPD_PROBE_INTERVAL;
 static char *arg_elements[max_buttons + max_encoders];
 static int arg_element_count = 0;
+#else
+//
+//  Static configuration
+//  Options and control elements are defined in sbpd_config.h,
+//  see sbpd_config.example.h
+//
+#ifndef SBPD_CONFIG_DAEMONIZE
+#define SBPD_CONFIG_DAEMONIZE false
+#endif
+#ifndef SBPD_CONFIG_USER
+#define SBPD_CONFIG_USER NULL
+#endif
+#ifndef SBPD_CONFIG_STATE
+#define SBPD_CONFIG_STATE NULL
+#endif
+#ifndef SBPD_CONFIG_PROBE
+#define SBPD_CONFIG_PROBE SBPD_PROBE_INTERVAL
+#endif
+static const bool arg_daemonize = SBPD_CONFIG_DAEMONIZE;
+static char *arg_user = SBPD_CONFIG_USER;
+static char *arg_state = SBPD_CONFIG_STATE;
+static const int arg_probe = SBPD_CONFIG_PROBE;
+static void static_config();
+static void setup_static_controls();
+#endif
 
 int main(int argc, char * argv[]) {
+    int startup_phase = begin_phase("startup");
+    start_time = clock_now();
+    
     //
     //  Parse Arguments
     //
+#ifdef SBPD_STATIC_CONFIG
+    static_config();
+#else
     argp_parse (&argp, argc, argv, 0, 0, 0);
+#endif
 
     //
     //  Daemonize
@@ -171,43 +249,133 @@ int main(int argc, char * argv[]) {
         }
     }
     
+    //
+    // Configure signal handling
+    //
+    struct sigaction act;
+    memset( &act, 0, sizeof(act) );
+    act.sa_sigaction = &sigHandler;
+    act.sa_flags     = SA_SIGINFO;
+    sigaction( SIGINT, &act, NULL );
+    sigaction( SIGTERM, &act, NULL );
+    
+    //
+    //  Wait for the network and find the MAC while GPIO is set up
+    //
+    sem_init(&network_done, 0, 0);
+    pthread_t network_thread;
+    if (pthread_create(&network_thread, NULL, network_startup, NULL)) {
+        logerr("Could not start network startup thread");
+        return -1;
+    }
+    
     //
     //  Init GPIO
     //  Done after daemonization becasue child process needs to have GPIO initilized
     //
+    int phase = begin_phase("GPIO init");
     init_GPIO();
+    end_phase(phase);
     
     //
     //  Now parse GPIO elements
     //  Needed to initialize GPIO first
     //
+    phase = begin_phase("controls");
+#ifdef SBPD_STATIC_CONFIG
+    setup_static_controls();
+#else
     parse_arg();
+#endif
+    //
+    //  Privilege separation: the ring is there before the first interrupt,
+    //  input waits in it until the network process is forked below
+    //
+    if (arg_user) {
+        if (init_privsep())
+            return -1;
+        set_input_sink(privsep_forward);
+    }
+    start_GPIO_interrupts();
+    end_phase(phase);
     
+#ifndef SBPD_STATIC_CONFIG
     //
-    // Configure signal handling
+    //  Read rules and build the dispatch table
+    //  Rules from the file override the commands given for the control elements
+    //  A static configuration has a constant dispatch table
     //
-    struct sigaction act;
-    memset( &act, 0, sizeof(act) );
-    act.sa_sigaction = &sigHandler;
-    act.sa_flags     = SA_SIGINFO;
-    sigaction( SIGINT, &act, NULL );
-    sigaction( SIGTERM, &act, NULL );
+    phase = begin_phase("rules");
+    if (arg_rules && (load_rules(arg_rules) < 0))
+        return -1;
+    compile_dispatch();
+    end_phase(phase);
+#endif
     
+    //
+    //  Render the commands of all actions, sending them only fills in parameters
+    //
+    compile_actions();
     
     //
-    // Find MAC
+    //  Join network startup
+    //  At boot we may be started before any interface is up.
+    //  Signals interrupt the wait
     //
+    while (sem_wait(&network_done)) {
+        if (stop_signal)
+            return 0;
+    }
+    pthread_join(network_thread, NULL);
+    if (!network_ready)
+        return -1;
+    lognotice("Network ready %.3f s after start, %.3f s after boot",
+              (double)(network_ready_time - start_time) / SCD_SECOND, time_since_boot());
     if (!(configured_parameters & SBPD_cfg_MAC)) {
-        MAC = find_mac();
         if (!MAC)
             return -1;  // no MAC, no control
         discovered_parameters |= SBPD_cfg_MAC;
     }
     
+    //
+    //  Privilege separation
+    //  The GPIO process keeps root privileges and only forwards input events
+    //  The network process continues below as an unprivileged user
+    //
+    sbpd_process_t role = SBPD_proc_single;
+    if (arg_user) {
+        role = start_privsep(arg_user);
+        if (role == SBPD_proc_error)
+            return -1;
+        if (role == SBPD_proc_gpio) {
+            sigaction( SIGCHLD, &act, NULL );   // network process died
+            while( !stop_signal )
+                pause();
+            stop_privsep();
+            return 0;
+        }
+    }
+    
     //
     //  Initialize server communication
     //
-    init_comm(MAC);
+    phase = begin_phase("comm init");
+    init_comm(MAC, arg_probe);
+    init_player_state(MAC);
+    end_phase(phase);
+    
+    //
+    //  Warm start: use the cached server until discovery finds another one
+    //
+    if (arg_state)
+        init_state_cache(arg_state, configured_parameters, &discovered_parameters, &server, MAC);
+    
+    //
+    //  Log internal events in verbose mode
+    //
+    int log_subscriber = -1;
+    if (loglevel() == LOG_DEBUG)
+        log_subscriber = subscribe_events(SBPD_evt_all);
     
     //
     //
@@ -215,30 +383,60 @@ int main(int argc, char * argv[]) {
     //
     //
     loginfo("Starting main loop polling");
+    end_phase(startup_phase);
+    int discovery_phase = begin_phase("discovery");
     while( !stop_signal ) {
         //
         //  Poll the server discovery
+        //  Each step is accounted to its subsystem, see alloc.h
         //
+        alloc_scope(SBPD_alloc_discovery);
         poll_discovery(configured_parameters,
                        &discovered_parameters,
                        &server);
+        if (server.host && server.port)
+            end_phase(discovery_phase);
+        alloc_scope(SBPD_alloc_comm);
+        poll_comm(&server);
+        poll_players(&server);
+        poll_player_state(&server);
+        alloc_scope(SBPD_alloc_input);
         handle_buttons(&server);
         handle_encoders(&server);
+        alloc_scope(SBPD_alloc_events);
+        poll_events(log_subscriber, log_event, NULL);
+        alloc_scope(SBPD_alloc_state);
+        poll_state_cache();
+        alloc_scope(SBPD_alloc_other);
         //
-        // Just sleep...
+        // Wait for server replies and timers...
+        // ...and for input from the GPIO process
+        // Event loop handlers are server communication
         //
-        usleep( SCD_SLEEP_TIMEOUT ); // 0.1s
+        alloc_scope(SBPD_alloc_comm);
+        if (role == SBPD_proc_network) {
+            run_loop( privsep_prepare() ? 0 : SCD_SLEEP_TIMEOUT );
+            alloc_scope(SBPD_alloc_input);
+            privsep_poll(control_input);
+        } else
+            run_loop( SCD_SLEEP_TIMEOUT ); // 0.1s
+        alloc_scope(SBPD_alloc_other);
         
     } // end of: while( !stop_signal )
     
     //
     //  Shutdown server communication
     //
+    alloc_steady_state(false);
+    shutdown_player_state();
     shutdown_comm();
+    stop_privsep();
+    alloc_report();
     
     return 0;
 }
 
+#ifndef SBPD_STATIC_CONFIG
 //
 //
 //  Argument parsing
@@ -295,7 +493,7 @@ parse_opt (int key, char *arg, struct argp_state *state)
             //  Server port
         case 'P':
             server.port = (uint32_t)strtoul(arg, NULL, 10);
-            loginfo("Options parsing: Manually set http port %s", server.port);
+            loginfo("Options parsing: Manually set http port %u", server.port);
             configured_parameters |= SBPD_cfg_port;
             break;
             //  Server user name
@@ -311,6 +509,30 @@ parse_opt (int key, char *arg, struct argp_state *state)
             configured_parameters |= SBPD_cfg_password;
             break;
             
+            //
+            //  Control configuration
+            //
+            //  Rule file
+        case 'f':
+            arg_rules = arg;
+            loginfo("Options parsing: Rule file %s", arg_rules);
+            break;
+            //  State cache
+        case 'S':
+            arg_state = arg;
+            loginfo("Options parsing: State file %s", arg_state);
+            break;
+            //  Health probe
+        case 'i':
+            arg_probe = (int)strtol(arg, NULL, 10);
+            loginfo("Options parsing: Probe interval %d s", arg_probe);
+            break;
+            //  Privilege separation
+        case 'U':
+            arg_user = arg;
+            loginfo("Options parsing: Network process user %s", arg_user);
+            break;
+            
         case ARGP_KEY_ARG:
             if (arg_element_count == (max_encoders + max_buttons)) {
                 logerr("Too many control elements defined");
@@ -333,16 +555,18 @@ parse_opt (int key, char *arg, struct argp_state *state)
 //
 //  Arguments are a comma-separated list of configuration parameters:
 //  For rotary encoders (one, volume only):
-//      e,pin1,pin2,CMD[,edge]
+//      e,pin1,pin2,CMD[,edge[,player]]
 //          "e" for "Encoder"
 //          p1, p2: GPIO PIN numbers in BCM-notation
-//          CMD: Command. Unused for encoders, always VOLM for Volume
+//          CMD: Command. VOLU for Volume, VOLA for absolute volume or "-" for rules only
 //          edge: Optional. one of
 //                  1 - falling edge
 //                  2 - rising edge
 //                  0, 3 - both
+//          player: Optional. MAC or name of the player to control, "@" in front
+//                  for the player and its sync group. Default: the -M player
 //  For buttons:
-//      b,pin,CMD[,edge]
+//      b,pin,CMD[,edge[,player]]
 //          "b" for "Button"
 //          pin: GPIO PIN numbers in BCM-notation
 //          CMD: Command. One of:
@@ -352,10 +576,12 @@ parse_opt (int key, char *arg, struct argp_state *state)
 //              VOL+:   Increase volume
 //              VOL-:   Decrease volume
 //              POWR:   Toggle power state
+//              -:      None, actions defined by rules only
 //          edge: Optional. one of
 //                  1 - falling edge
 //                  2 - rising edge
 //                  0, 3 - both
+//          player: Optional, as for encoders
 //
 //
 static error_t parse_arg() {
@@ -380,7 +606,7 @@ static error_t parse_arg() {
                     int edge = 0;
                     if (string)
                         edge = (int)strtol(string, NULL, 10);
-                    setup_encoder_ctrl(cmd, p1, p2, edge);
+                    setup_encoder_ctrl(cmd, p1, p2, edge, strtok(NULL, ","));
                 }
                     break;
                 case 'b': {
@@ -393,7 +619,7 @@ static error_t parse_arg() {
                     int edge = 0;
                     if (string)
                         edge = (int)strtol(string, NULL, 10);
-                    setup_button_ctrl(cmd, pin, edge);
+                    setup_button_ctrl(cmd, pin, edge, strtok(NULL, ","));
                 }
                     break;
                     
@@ -404,6 +630,85 @@ static error_t parse_arg() {
     }
     return 0;
 }
+#else
+//
+//
+//  Static configuration
+//
+//
+static void static_config() {
+#ifdef SBPD_CONFIG_LOGLEVEL
+    streamloglevel = SBPD_CONFIG_LOGLEVEL;
+#endif
+#ifdef SBPD_CONFIG_MAC
+    MAC = SBPD_CONFIG_MAC;
+    configured_parameters |= SBPD_cfg_MAC;
+#endif
+#ifdef SBPD_CONFIG_HOST
+    server.host = SBPD_CONFIG_HOST;
+    configured_parameters |= SBPD_cfg_host;
+#endif
+#ifdef SBPD_CONFIG_PORT
+    server.port = SBPD_CONFIG_PORT;
+    configured_parameters |= SBPD_cfg_port;
+#endif
+#ifdef SBPD_CONFIG_USERNAME
+    server.user = SBPD_CONFIG_USERNAME;
+    configured_parameters |= SBPD_cfg_user;
+#endif
+#ifdef SBPD_CONFIG_PASSWORD
+    server.password = SBPD_CONFIG_PASSWORD;
+    configured_parameters |= SBPD_cfg_password;
+#endif
+}
+
+//
+//  Control elements
+//  Commands are defined by the rules, so set up "rules only"
+//
+#define BUTTON_ENTRY(pin, edge) { pin, 0, edge },
+#define ENCODER_ENTRY(pin1, pin2, edge) { pin1, pin2, edge },
+static const struct {
+    int pin1;
+    int pin2;
+    int edge;
+} static_buttons[] = { SBPD_BUTTONS(BUTTON_ENTRY) },
+  static_encoders[] = { SBPD_ENCODERS(ENCODER_ENTRY) };
+
+#ifdef SBPD_CONFIG_ABSOLUTE_VOLUME
+#define STATIC_ENCODER_CMD  "VOLA"
+#else
+#define STATIC_ENCODER_CMD  "-"
+#endif
+
+//
+//  Players of control elements, by pin. Default: the configured player
+//
+#ifndef SBPD_TARGETS
+#define SBPD_TARGETS(X)
+#endif
+#define TARGET_ENTRY(pin, player) { pin, player },
+static const struct {
+    int pin;
+    const char * player;
+} static_targets[] = { SBPD_TARGETS(TARGET_ENTRY) { -1, NULL } };
+
+static const char * static_target(int pin) {
+    int cnt = 0;
+    while ((static_targets[cnt].pin >= 0) && (static_targets[cnt].pin != pin))
+        cnt++;
+    return static_targets[cnt].player;
+}
+
+static void setup_static_controls() {
+    for (int cnt = 0; cnt < sizeof(static_buttons) / sizeof(static_buttons[0]); cnt++)
+        setup_button_ctrl("-", static_buttons[cnt].pin1, static_buttons[cnt].edge,
+                          static_target(static_buttons[cnt].pin1));
+    for (int cnt = 0; cnt < sizeof(static_encoders) / sizeof(static_encoders[0]); cnt++)
+        setup_encoder_ctrl(STATIC_ENCODER_CMD, static_encoders[cnt].pin1, static_encoders[cnt].pin2,
+                           static_encoders[cnt].edge, static_target(static_encoders[cnt].pin1));
+}
+#endif
 
 
 //
@@ -427,6 +732,7 @@ static void sigHandler( int sig, siginfo_t *siginfo, void *context )
             //
         case SIGINT:
         case SIGTERM:
+        case SIGCHLD:
             stop_signal = sig;
             break;
             //
@@ -437,6 +743,67 @@ static void sigHandler( int sig, siginfo_t *siginfo, void *context )
     }
 }
 
+//
+//  Network startup thread
+//  Waits for a usable network interface and finds the MAC address.
+//  Signals are handled by the main thread.
+//
+static void * network_startup(void * arg) {
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    
+    int phase = begin_phase("network");
+    network_ready = wait_for_network();
+    network_ready_time = clock_now();
+    end_phase(phase);
+    if (network_ready && !(configured_parameters & SBPD_cfg_MAC)) {
+        phase = begin_phase("MAC");
+        MAC = find_mac();
+        end_phase(phase);
+    }
+    sem_post(&network_done);
+    return NULL;
+}
+
+//
+//  Event bus subscriber: log events
+//
+static void log_event(const struct sbpd_event * event, void * context) {
+    switch (event->type) {
+        case SBPD_evt_input:
+            logdebug("Event: %s on GPIO %d value: %ld change: %ld",
+                     (event->input.source == SBPD_input_button) ? "button" : "encoder",
+                     event->input.pin, event->input.value, event->input.change);
+            break;
+        case SBPD_evt_command:
+            logdebug("Event: command %d %s, result: %d",
+                     event->command.request,
+                     (event->command.success) ? "succeeded" : "failed",
+                     event->command.code);
+            break;
+        case SBPD_evt_discovery:
+            logdebug("Event: discovered parameters: 0x%x", event->discovery.discovered);
+            break;
+        case SBPD_evt_server:
+            logdebug("Event: server endpoint %08x port %u",
+                     ntohl(event->server.address), event->server.port);
+            break;
+        case SBPD_evt_player:
+            logdebug("Event: player %s, power %d, mode %d, volume %d%s",
+                     (event->player.known) ? "known" : "unknown",
+                     event->player.power, event->player.mode, event->player.volume,
+                     (event->player.muted) ? " (muted)" : "");
+            break;
+        case SBPD_evt_health:
+            logdebug("Event: server %s, RTT %u us",
+                     (event->health.degraded) ? "degraded" : "recovered", event->health.rtt);
+            break;
+        default:
+            break;
+    }
+}
+
 //
 //  Logging facility
 //
@@ -458,9 +825,7 @@ void _mylog( const char *file, int line,  int prio, const char *fmt, ... )
         //FILE *f = stderr;
         
         // print timestamp, prio and thread info
-        struct timeval tv;
-        gettimeofday( &tv, NULL );
-        double time = tv.tv_sec+tv.tv_usec*1E-6;
+        double time = clock_wall();
         fprintf( f, "%.4f %d", time, prio);
         
         // prepend location to message (if available)
@@ -73,16 +73,19 @@ typedef enum {
 
 // server configuration data structure
 // contains address and user/password
+// cli_port and uuid are discovered only, 0/NULL if unknown
 struct sbpd_server {
     char *      host;
     uint32_t    port;
     char *      user;
     char *      password;
+    uint32_t    cli_port;
+    char *      uuid;
 };
 
 //
 //  Define scheduling behavior
-//  We use usleep so this is in µs
+//  We use clock_sleep (see timing.h) so this is in µs
 //
 #define SCD_SLEEP_TIMEOUT   100000
 #define SCD_SECOND          1000000
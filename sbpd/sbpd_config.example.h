@@ -0,0 +1,112 @@
+//
+//  sbpd_config.example.h
+//  SqueezeButtonPi
+//
+//  Example static configuration
+//  Copy to sbpd_config.h (or generate it) and build with "make sbpd-static"
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef sbpd_config_h
+#define sbpd_config_h
+
+//
+//  Options
+//  All optional, the defaults are the same as for the command line version
+//
+//#define SBPD_CONFIG_MAC         "b8:27:eb:00:00:01"     // -M, default: autodetect
+//#define SBPD_CONFIG_HOST        "192.168.1.2"           // -A, default: autodetect
+//#define SBPD_CONFIG_PORT        9000                    // -P, default: autodetect
+//#define SBPD_CONFIG_USERNAME    "user"                  // -u
+//#define SBPD_CONFIG_PASSWORD    "secret"                // -p
+//#define SBPD_CONFIG_STATE       "/var/cache/sbpd.state" // -S
+//#define SBPD_CONFIG_PROBE       30                      // -i, s, 0: never
+//#define SBPD_CONFIG_USER        "nobody"                // -U
+//#define SBPD_CONFIG_DAEMONIZE   true                    // -d
+//#define SBPD_CONFIG_LOGLEVEL    LOG_DEBUG               // -v: LOG_DEBUG, -s: 0
+//#define SBPD_CONFIG_ABSOLUTE_VOLUME                     // encoders use VOLA instead of rules
+
+//
+//  Control elements
+//      X(pin, edge) for buttons
+//      X(pin1, pin2, edge) for encoders
+//  Pins in BCM notation, edge: 1 - falling, 2 - rising, 0, 3 - both
+//  Controls have no commands of their own, all actions are rules
+//
+#define SBPD_BUTTONS(X) \
+    X(4, 0) \
+    X(17, 0) \
+    X(27, 0)
+
+#define SBPD_ENCODERS(X) \
+    X(22, 23, 0)
+
+//
+//  Optional: players other than the configured one
+//      X(pin, player)
+//  player: MAC or name, "@" in front for the player and its sync group
+//
+/*
+#define SBPD_TARGETS(X) \
+    X(27, "Kitchen") \
+    X(22, "@00:04:20:12:34:56")
+*/
+
+//
+//  Modifiers: buttons that change the actions of other controls while held
+//      X(name, pin)
+//  At most max_modifiers
+//
+#define SBPD_MODIFIERS(X) \
+    X(shift, 17)
+
+//
+//  Rules
+//      X(name, pin, gesture, modifier, steps, depends, commands)
+//          name: unique rule name
+//          pin: GPIO pin of the control (first pin for encoders)
+//          gesture: press, cw or ccw
+//          modifier: name of a modifier or none
+//          steps: number of commands
+//          depends: bit n set: command n waits for the reply to command n - 1
+//          commands: the command templates, separated by "\0".
+//                    "%d" is replaced by the number of encoder steps.
+//                    The FRAGMENT_ defines in dispatch.h are the built-in commands.
+//  Later rules for the same input win, see dispatch.h
+//
+#define SBPD_RULES(X) \
+    X(play,     4,  press, none,  1, 0,   FRAGMENT_PAUSE) \
+    X(next,     27, press, none,  1, 0,   FRAGMENT_NEXT) \
+    X(prev,     27, press, shift, 1, 0,   FRAGMENT_PREV) \
+    X(louder,   22, cw,    none,  1, 0,   FRAGMENT_VOLUME_PLUS) \
+    X(quieter,  22, ccw,   none,  1, 0,   FRAGMENT_VOLUME_MINUS) \
+    X(radio,    4,  press, shift, 2, 0x2, FRAGMENT_POWER "\0" \
+                                          "[\"favorites\",\"playlist\",\"play\",\"item_id:0\"]")
+
+#endif /* sbpd_config_h */
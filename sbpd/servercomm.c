@@ -36,158 +36,1134 @@
 
 #include "servercomm.h"
 #include "sbpd.h"
-#include <curl/curl.h>
+#include "events.h"
+#include "eventloop.h"
+#include "profile.h"
+#include "alloc.h"
+#include "timing.h"
+#include "clicomm.h"
+#include "httpclient.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+static bool initialized = false;
+static char serverName[100];
+
+//
+//  JSON-RPC envelope with the player, rendered into a request slot when
+//  the slot is used for another player than before
+//  The id field is padded with blanks, request ids are patched in
+//
+#define JSON_ENVELOPE   "{\"id\":%*s,\"method\":\"slim.request\",\"params\":[\"%s\","
+#define JSON_ID_OFFSET  6           // after {"id":
+#define JSON_ID_WIDTH   10
+static struct sbpd_command probeCommand;
 
 //
-// lock for asynchronous sending of commands - we don't do this right now
+//  Requests
+//  Every request slot has its own body, the HTTP transport takes the slot
+//  number as request handle. Macro steps are pipelined: all of them are
+//  queued at once and start in order without waiting for replies, only a
+//  step that depends on the previous one is held until its reply is in.
+//  Commands go over the CLI connection when it is up, queries and anything
+//  the CLI can't take use HTTP.
 //
-/*#include <pthread.h>
+struct request {
+    sbpd_request_t id;          // -1: slot is free
+    int next;                   // slot of the next macro step or -1
+    int previous;               // slot of the macro step to start first or -1
+    bool depends;               // only run if the previous step succeeded
+    bool probe;                 // health probe, not reported
+    bool macro;                 // macro step, never coalesced
+    int player;                 // see players.h
+    bool member;                // sent to another player of a group, not rate limited
+    sbpd_request_t group;       // handle of the group's first request or -1, see cancel_command()
+    sbpd_command_class_t class;
+    sbpd_priority_t priority;
+    bool throttled;             // waited for the rate limit
+    bool cli;                   // sent over the CLI
+    bool started;               // sent, not just queued
+    sbpd_time_t sent;           // start of the round trip
+    sbpd_time_t deadline;       // CLI: reply due, HTTP deadlines are kept by the transport
+    bool waiting;               // queued: (re)start at retry_at, see dispatch_requests()
+    sbpd_time_t retry_at;
+    sbpd_time_t expires;        // end of the time to live
+    sbpd_time_t queued;         // for the starvation limit
+    int attempts;
+    reply_handler_t handler;    // gets the reply, optional
+    void * context;
+    char fragment[max_command];
+    int fragment_length;
+    int parameter;              // coalescing: the value in the parameter slot
+    int parameter_at;           // -1: no parameter
+    int parameter_digits;
+    bool additive;              // relative steps ("+%d", "-%d")
+    char arguments[max_cli_arguments]; // CLI
+    int arguments_length;       // -1: HTTP only
+    char body[max_command + 128];
+    int length;
+    int envelope_player;        // player of the envelope in body, -1: none
+    int envelope_length;
+    struct sbpd_json_field * fields;    // query fields
+    int count;
+    struct sbpd_json_parser parser;     // reply parser, HTTP only
+};
+static struct request requests[max_requests];
+static sbpd_request_t lastRequestId = 0;
 
-static volatile bool commLock;
-static pthread_mutex_t lock;*/
+//
+//  Connection manager
+//  Persistent connections to the current server endpoint, kept by the
+//  HTTP transport. If no usable connection is left a probe reconnects
+//  right away, not the next command. Idle connections are probed to keep
+//  them, and the server, warm.
+//
+#define PROBE_RETRY         5       // s between failed probes
+#define PROBE_FRAGMENT      "[\"serverstatus\",\"0\",\"0\"]"
 
-static CURL *curl;
-static char * MAC = NULL;
-static struct curl_slist * headerList = NULL;
+static struct {
+    char host[16];
+    uint32_t port;
+    sbpd_time_t next_probe;     // not before, after a failed probe
+    sbpd_time_t last_traffic;   // last request completed
+} connection;
+static sbpd_time_t probeInterval = 0;
+static struct sbpd_server_health health;
 
-#define JSON_CALL_MASK	"{\"id\":%ld,\"method\":\"slim.request\",\"params\":[\"%s\",%s]}"
-#define SERVER_ADDRESS_TEMPLATE "http://localhost/jsonrpc.js"
+static void drain_queue();
 
 //
+//  Health state changed
 //
-//  Send CLI command fragment to Logitech Media Server/Squeezebox Server
-//  This command blocks (synchronously communicates".
-//  In timing critical situations this should be called from a separate thread
+static void set_degraded(bool degraded) {
+    if (health.degraded == degraded)
+        return;
+    health.degraded = degraded;
+    if (degraded)
+        logwarn("Server %s degraded: %d probes failed", serverName, health.failures);
+    else
+        lognotice("Server %s recovered", serverName);
+    struct sbpd_event event = {
+        .type = SBPD_evt_health,
+        .health = {
+            .degraded = degraded,
+            .rtt = (uint32_t)health.srtt
+        }
+    };
+    publish_event(&event);
+}
+
 //
-//  Parameters:
-//      server: the server information structure defining host, port etc.
-//      frament: the command fragment to be sent as JSON array
-//               e.g. "[\"mixer\”,\"volume\",\"+2\"]"
-//               optionally: some CLI commands can take parameter hashes as "params:{}"
-//  Returns: success flag
+//  A round trip was measured, smoothed as in RFC 6298
 //
+static void rtt_sample(sbpd_time_t rtt) {
+    health.rtt = rtt;
+    if (!health.samples++) {
+        health.srtt = rtt;
+        health.rttvar = rtt / 2;
+        health.min_rtt = rtt;
+        health.max_rtt = rtt;
+        return;
+    }
+    sbpd_time_t delta = (rtt > health.srtt) ? rtt - health.srtt : health.srtt - rtt;
+    health.rttvar = (3 * health.rttvar + delta) / 4;
+    health.srtt = (7 * health.srtt + rtt) / 8;
+    health.min_rtt = MIN(health.min_rtt, rtt);
+    health.max_rtt = MAX(health.max_rtt, rtt);
+}
+
+//
+//  Configure the endpoint and credentials, the transport drops connections
+//  to an old endpoint
+//
+static void set_endpoint(struct sbpd_server * server) {
+    http_endpoint(server->host, server->port, server->user, server->password);
+    if ((connection.port == server->port) && !strcmp(connection.host, server->host))
+        return;
+    snprintf(connection.host, sizeof(connection.host), "%s", server->host);
+    connection.port = server->port;
+    connection.next_probe = 0;
+    snprintf(serverName, sizeof(serverName), "::%s:%u", server->host, server->port);
+    loginfo("Server endpoint %s", serverName);
+    //
+    //  The statistics are for the old server, degraded until the new one answers
+    //
+    bool degraded = health.degraded;
+    memset(&health, 0, sizeof(health));
+    health.degraded = degraded;
+    drain_queue();
+}
+
+//
+//  Request slots
 //
-bool send_command(struct sbpd_server * server, char * fragment) {
-    if (!curl)
+static int free_slots() {
+    int count = 0;
+    for (int cnt = 0; cnt < max_requests; cnt++)
+        if (requests[cnt].id < 0)
+            count++;
+    return count;
+}
+
+static int get_slot() {
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        if (requests[cnt].id >= 0)
+            continue;
+        requests[cnt].id = ++lastRequestId;
+        if (lastRequestId == INT32_MAX)
+            lastRequestId = 0;
+        requests[cnt].next = -1;
+        requests[cnt].previous = -1;
+        requests[cnt].depends = false;
+        requests[cnt].probe = false;
+        requests[cnt].macro = false;
+        requests[cnt].player = SBPD_target_default;
+        requests[cnt].member = false;
+        requests[cnt].group = -1;
+        requests[cnt].throttled = false;
+        requests[cnt].cli = false;
+        requests[cnt].started = false;
+        requests[cnt].waiting = false;
+        requests[cnt].attempts = 0;
+        requests[cnt].handler = NULL;
+        requests[cnt].fields = NULL;
+        requests[cnt].count = 0;
+        return cnt;
+    }
+    return -1;
+}
+
+//
+//  Command classes by fragment, the first match counts
+//
+static const struct {
+    const char * prefix;
+    sbpd_command_class_t class;
+} commandClasses[] = {
+    { "[\"mixer\",\"volume\"", SBPD_class_volume },
+    { "[\"button\",\"volume", SBPD_class_volume },
+    { "[\"button\",\"voldown\"", SBPD_class_volume },
+    { "[\"power\"", SBPD_class_power },
+    { "[\"button\",\"power\"", SBPD_class_power },
+    { "[\"play\"", SBPD_class_transport },
+    { "[\"pause\"", SBPD_class_transport },
+    { "[\"stop\"", SBPD_class_transport },
+    { "[\"button\",\"play", SBPD_class_transport },
+    { "[\"button\",\"pause\"", SBPD_class_transport },
+    { "[\"button\",\"stop\"", SBPD_class_transport },
+    { "[\"button\",\"fwd\"", SBPD_class_navigation },
+    { "[\"button\",\"rew\"", SBPD_class_navigation },
+    { "[\"button\",\"jump_", SBPD_class_navigation },
+    { "[\"playlist\"", SBPD_class_navigation },
+    { "[\"favorites\"", SBPD_class_navigation },
+    { "[\"time\"", SBPD_class_seek },
+};
+
+static const sbpd_time_t classTTL[SBPD_classes] = {
+    [SBPD_class_default] = SBPD_TTL_DEFAULT,
+    [SBPD_class_transport] = SBPD_TTL_TRANSPORT,
+    [SBPD_class_navigation] = SBPD_TTL_NAVIGATION,
+    [SBPD_class_volume] = SBPD_TTL_VOLUME,
+    [SBPD_class_seek] = SBPD_TTL_SEEK,
+    [SBPD_class_power] = SBPD_TTL_POWER,
+};
+
+static const sbpd_priority_t classPriority[SBPD_classes] = {
+    [SBPD_class_default] = SBPD_priority_navigation,
+    [SBPD_class_transport] = SBPD_priority_transport,
+    [SBPD_class_navigation] = SBPD_priority_navigation,
+    [SBPD_class_volume] = SBPD_priority_continuous,
+    [SBPD_class_seek] = SBPD_priority_continuous,
+    [SBPD_class_power] = SBPD_priority_transport,
+};
+
+//
+//  Compare a fragment to a prefix, ignoring white space in the fragment
+//
+static bool has_prefix(const char * fragment, const char * prefix) {
+    while (*prefix) {
+        if (*fragment == ' ') {
+            fragment++;
+            continue;
+        }
+        if (*fragment++ != *prefix++)
+            return false;
+    }
+    return true;
+}
+
+static sbpd_command_class_t command_class(const char * fragment) {
+    for (int cnt = 0; cnt < sizeof(commandClasses) / sizeof(commandClasses[0]); cnt++)
+        if (has_prefix(fragment, commandClasses[cnt].prefix))
+            return commandClasses[cnt].class;
+    return SBPD_class_default;
+}
+
+//
+//  Write a number, no terminating NUL
+//  Returns: number of characters
+//
+static int put_number(char * out, int value) {
+    char digits[12];
+    int count = 0;
+    unsigned int magnitude = (value < 0) ? -(unsigned int)value : (unsigned int)value;
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    int length = 0;
+    if (value < 0)
+        out[length++] = '-';
+    while (count)
+        out[length++] = digits[--count];
+    return length;
+}
+
+//
+//  Render one part of a compiled command, the parameter goes in at split
+//  Returns: length
+//
+static int render_part(char * out, const char * text, int length, int split, bool parameter, int value) {
+    if (!parameter) {
+        memcpy(out, text, length);
+        return length;
+    }
+    memcpy(out, text, split);
+    int digits = put_number(out + split, value);
+    memcpy(out + split + digits, text + split, length - split);
+    return length + digits;
+}
+
+//
+//  Compile a command fragment
+//  Room for the parameter digits is left in both parts
+//
+bool compile_command(struct sbpd_command * command, const char * fragment) {
+    const char * slot = strstr(fragment, "%d");
+    size_t length = strlen(fragment);
+    if ((length + 12 > sizeof(command->json)) || (slot && strstr(slot + 2, "%d")))
         return false;
+    command->class = command_class(fragment);
+    command->parameter = slot != NULL;
+    command->json_split = (slot) ? (int)(slot - fragment) : (int)length;
+    command->json_length = (slot) ? (int)length - 2 : (int)length;
+    memcpy(command->json, fragment, command->json_split);
+    memcpy(command->json + command->json_split, fragment + command->json_split + ((slot) ? 2 : 0),
+           command->json_length - command->json_split);
     
     //
-    //  Sending commands asynchronously? Secure with a mutex
-    //  But right now we are actually not doing that, so comment out
+    //  CLI: convert with a marker in the parameter slot, it passes URL encoding unchanged
     //
-    /*pthread_mutex_lock(&lock);
-    if (commLock) {
-        pthread_mutex_unlock(&lock);
+    char marked[max_command + 16];
+    snprintf(marked, sizeof(marked), "%.*s%s%s", command->json_split, fragment,
+             (slot) ? "SBPDPARAMETER" : "", (slot) ? slot + 2 : "");
+    command->cli_length = cli_arguments(marked, command->cli, sizeof(command->cli) - 12);
+    command->cli_split = command->cli_length;
+    if (slot && (command->cli_length >= 0)) {
+        char * marker = strstr(command->cli, "SBPDPARAMETER");
+        if (!marker)
+            command->cli_length = -1;
+        else {
+            command->cli_split = (int)(marker - command->cli);
+            command->cli_length -= strlen("SBPDPARAMETER");
+            memmove(marker, marker + strlen("SBPDPARAMETER"), command->cli_length - command->cli_split + 1);
+        }
+    }
+    return true;
+}
+
+//
+//  Set up a new request from a compiled command
+//
+static void prepare_request(int slot, const struct sbpd_command * command, int parameter) {
+    struct request * request = requests + slot;
+    request->fragment_length = render_part(request->fragment, command->json, command->json_length,
+                                           command->json_split, command->parameter, parameter);
+    request->fragment[request->fragment_length] = 0;
+    request->parameter = parameter;
+    request->parameter_at = (command->parameter) ? command->json_split : -1;
+    request->parameter_digits = request->fragment_length - command->json_length;
+    request->additive = command->parameter && (command->json_split > 0) &&
+                        ((command->json[command->json_split - 1] == '+') ||
+                         (command->json[command->json_split - 1] == '-'));
+    request->class = command->class;
+    request->priority = classPriority[command->class];
+    request->arguments_length = -1;
+    if (command->cli_length >= 0)
+        request->arguments_length = render_part(request->arguments, command->cli, command->cli_length,
+                                                command->cli_split, command->parameter, parameter);
+    request->queued = clock_now();
+    request->expires = request->queued + classTTL[command->class];
+}
+
+//
+//  Does a request come from the same command template?
+//
+static bool same_template(const struct request * request, const struct sbpd_command * command) {
+    int tail = command->json_length - command->json_split;
+    return command->parameter && (request->parameter_at == command->json_split) &&
+           (request->fragment_length - request->parameter_at - request->parameter_digits == tail) &&
+           !memcmp(request->fragment, command->json, command->json_split) &&
+           !memcmp(request->fragment + request->parameter_at + request->parameter_digits,
+                   command->json + command->json_split, tail);
+}
+
+//
+//  Put a request that was not delivered back into the offline queue
+//  Backoff doubles with every attempt, jittered to half..full
+//  Returns: false if the time to live would run out first
+//
+static bool schedule_retry(int slot) {
+    struct request * request = requests + slot;
+    sbpd_time_t backoff = MIN(SBPD_RETRY_MIN << MIN(request->attempts, 8), SBPD_RETRY_MAX);
+    sbpd_time_t delay = backoff / 2 + (sbpd_time_t)random() % (backoff / 2 + 1);
+    sbpd_time_t now = clock_now();
+    if (now + delay >= request->expires)
         return false;
+    request->attempts++;
+    request->started = false;
+    request->cli = false;
+    request->waiting = true;
+    request->retry_at = now + delay;
+    logdebug("Command %d not delivered, retry %d in %lu ms",
+             request->id, request->attempts, (unsigned long)(delay / SCD_MILLISECOND));
+    return true;
+}
+
+//
+//  The connection is back: send the offline queue now
+//
+static void drain_queue() {
+    for (int cnt = 0; cnt < max_requests; cnt++)
+        if ((requests[cnt].id >= 0) && requests[cnt].waiting)
+            requests[cnt].retry_at = 0;
+}
+
+static void complete_request(int slot, bool success, int code, const char * reason, bool retry);
+
+static void start_request(int slot) {
+    struct request * request = requests + slot;
+    request->started = true;
+    request->waiting = false;
+    request->sent = clock_now();
+    if (!request->handler && !request->probe &&
+        cli_command(request->id, player_cli_id(request->player),
+                    request->arguments, request->arguments_length)) {
+        request->cli = true;
+        request->deadline = request->sent + SBPD_COMMAND_TIMEOUT * SCD_MILLISECOND;
+        return;
+    }
+    //
+    //  The envelope is usually in place: patch the id, append the fragment
+    //
+    if (request->envelope_player != request->player) {
+        request->envelope_length = snprintf(request->body, sizeof(request->body) - max_command - 2,
+                                            JSON_ENVELOPE, JSON_ID_WIDTH, "", player_id(request->player));
+        request->envelope_player = request->player;
+    }
+    char id[12];
+    int digits = put_number(id, (request->probe) ? 0 : request->id);
+    memset(request->body + JSON_ID_OFFSET, ' ', JSON_ID_WIDTH - digits);
+    memcpy(request->body + JSON_ID_OFFSET + JSON_ID_WIDTH - digits, id, digits);
+    memcpy(request->body + request->envelope_length, request->fragment, request->fragment_length);
+    request->length = request->envelope_length + request->fragment_length;
+    memcpy(request->body + request->length, "]}", 3);
+    request->length += 2;
+    logdebug("Server %s command %d: %s", serverName, request->id, request->body);
+    json_begin(&request->parser, request->fields, request->count);
+    if (!http_post(slot, request->body, request->length))
+        complete_request(slot, false, SBPD_result_send, "could not send", true);
+}
+
+//
+//  Rate limits, one token bucket per command class
+//
+static struct {
+    double tokens;
+    sbpd_time_t updated;
+    sbpd_time_t decreased;      // last multiplicative decrease
+} buckets[SBPD_classes];
+static struct sbpd_rate_stats rateStats[SBPD_classes];
+static int rateTimer = -1;
+
+static void refill(sbpd_command_class_t class, sbpd_time_t now) {
+    buckets[class].tokens = MIN(buckets[class].tokens +
+                                (double)(now - buckets[class].updated) * rateStats[class].rate / SCD_SECOND,
+                                SBPD_RATE_BURST);
+    buckets[class].updated = now;
+}
+
+//
+//  A reply came in, or didn't: additive increase, multiplicative decrease
+//  Parameters:
+//      class: the command class
+//      rtt: the round trip, 0: no reply in time
+//
+static void adapt_rate(sbpd_command_class_t class, sbpd_time_t rtt) {
+    sbpd_time_t now = clock_now();
+    refill(class, now);
+    struct sbpd_rate_stats * stats = rateStats + class;
+    if (rtt && (rtt <= SBPD_RATE_LATENCY * health.min_rtt + SBPD_RATE_SLACK)) {
+        stats->rate = MIN(stats->rate + SBPD_RATE_INCREASE, SBPD_RATE_MAX);
+        return;
+    }
+    if (now - buckets[class].decreased < health.srtt)
+        return;
+    buckets[class].decreased = now;
+    stats->rate = MAX(stats->rate / 2, SBPD_RATE_MIN);
+    stats->decreases++;
+    logdebug("Class %d rate %.1f/s, round trip %lu ms", class, stats->rate,
+             (unsigned long)(rtt / SCD_MILLISECOND));
+}
+
+//
+//  Outbound queue
+//  Ready requests are waiting with their retry time passed. Started by
+//  priority, then age: a request is held while a higher priority for the
+//  same player is queued or in flight, unless it was ready for the
+//  starvation limit. Probes don't count.
+//  Macro steps share the priority of the first step and start in order,
+//  a step is held until the one before it was started.
+//  A request over the rate of its class waits for the rate timer. A command
+//  to a group counts once, the other players' requests go along.
+//
+static struct sbpd_queue_stats queueStats[SBPD_priorities];
+static bool dispatching = false;
+static bool redispatch = false;
+
+static void dispatch_requests() {
+    if (dispatching) {
+        redispatch = true;          // a request completed while starting another
+        return;
+    }
+    if (!connection.port)
+        return;                     // no server yet
+    dispatching = true;
+    do {
+        redispatch = false;
+        sbpd_time_t now = clock_now();
+        int busy[max_players][SBPD_priorities] = { { 0 } };
+        int inFlight[max_players][SBPD_priorities] = { { 0 } };
+        int next = -1;
+        for (int cnt = 0; cnt < max_requests; cnt++) {
+            struct request * request = requests + cnt;
+            if ((request->id < 0) || request->probe)
+                continue;
+            if (request->started && !request->waiting) {
+                busy[request->player][request->priority]++;
+                inFlight[request->player][request->priority]++;
+            } else if (request->waiting && (now >= request->retry_at))
+                busy[request->player][request->priority]++;
+        }
+        bool promoted = false;
+        sbpd_time_t wakeup = 0;
+        for (int cnt = 0; cnt < max_requests; cnt++) {
+            struct request * request = requests + cnt;
+            if ((request->id < 0) || !request->waiting || (now < request->retry_at))
+                continue;
+            if ((request->previous >= 0) &&
+                (!requests[request->previous].started || requests[request->previous].waiting))
+                continue;
+            if ((request->priority == SBPD_priority_continuous) && !request->macro &&
+                inFlight[request->player][SBPD_priority_continuous])
+                continue;
+            refill(request->class, now);
+            if (!request->member && (buckets[request->class].tokens < 1)) {
+                if (!request->throttled)
+                    rateStats[request->class].throttled++;
+                request->throttled = true;
+                sbpd_time_t due = now + (sbpd_time_t)((1 - buckets[request->class].tokens) * SCD_SECOND /
+                                                      rateStats[request->class].rate) + 1;
+                if (!wakeup || (due < wakeup))
+                    wakeup = due;
+                continue;
+            }
+            bool preempted = false;
+            for (int priority = 0; priority < request->priority; priority++)
+                preempted = preempted || busy[request->player][priority];
+            if (preempted && (now - MAX(request->queued, request->retry_at) < SBPD_STARVATION_LIMIT))
+                continue;
+            if ((next < 0) || (request->priority < requests[next].priority) ||
+                ((request->priority == requests[next].priority) && (request->queued < requests[next].queued))) {
+                next = cnt;
+                promoted = preempted;
+            }
+        }
+        set_timer(rateTimer, wakeup);
+        if (next < 0)
+            break;
+        if (!requests[next].member)
+            buckets[requests[next].class].tokens -= 1;
+        if (promoted) {
+            queueStats[requests[next].priority].promoted++;
+            logdebug("Command %d started ahead of higher priorities", requests[next].id);
+        }
+        start_request(next);
+        redispatch = true;
+    } while (redispatch);
+    dispatching = false;
+}
+
+//
+//  Tokens are due
+//
+static void rate_timer(void * context) {
+    dispatch_requests();
+}
+
+//
+//  A request is done
+//  Parameters:
+//      slot: the request slot
+//      success: the command was accepted
+//      code: HTTP status, negative curl result code, 0: not sent
+//      reason: failure reason for the log
+//      retry: the command did not reach the server, it may be sent again
+//
+static void complete_request(int slot, bool success, int code, const char * reason, bool retry) {
+    struct request * request = requests + slot;
+    if (!success && retry && !request->probe && schedule_retry(slot))
+        return;
+    sbpd_time_t now = clock_now();
+    connection.last_traffic = now;
+    if (success && !request->probe)
+        adapt_rate(request->class, now - request->sent);
+    else if (code == SBPD_result_timeout)
+        adapt_rate(request->class, 0);
+    if (success) {
+        rtt_sample(now - request->sent);
+        health.failures = 0;
+        set_degraded(false);
+        drain_queue();
+    }
+    if (request->probe) {
+        health.probes++;
+        if (success)
+            logdebug("Server %s probe: RTT %lu us, smoothed %lu us", serverName,
+                     (unsigned long)health.rtt, (unsigned long)health.srtt);
+        else {
+            logdebug("Server %s probe failed: %s", serverName, reason);
+            health.probes_failed++;
+            connection.next_probe = now + PROBE_RETRY * SCD_SECOND;
+            if (++health.failures >= SBPD_PROBE_FAILURES)
+                set_degraded(true);
+        }
+    } else {
+        if (code == SBPD_result_cancelled)
+            logdebug("Command %d cancelled: %s", request->id, request->fragment);
+        else if (!success)
+            logwarn("Command failed (%s, code %d): %s", reason, code, request->fragment);
+        if (request->handler)
+            request->handler(request->id, success, request->context);
+        struct sbpd_event event = {
+            .type = SBPD_evt_command,
+            .command = {
+                .request = request->id,
+                .success = success,
+                .code = code
+            }
+        };
+        publish_event(&event);
+        if (success) {
+            startup_complete();
+            alloc_steady_state(true);
+        }
     }
-    commLock = true;
-    pthread_mutex_unlock(&lock);*/
     
     //
-    //  target setup. We call an IPv4 ip so we need to replace a default host
+    //  Free the slot, then release a macro step that waited for this reply
+    //  Other steps are queued already and may be out by now
+    //
+    int next = request->next;
+    request->id = -1;
+    for (int cnt = 0; cnt < max_requests; cnt++)
+        if (requests[cnt].previous == slot)
+            requests[cnt].previous = -1;
+    if ((next >= 0) && requests[next].depends) {
+        if (success) {
+            requests[next].waiting = true;
+            requests[next].retry_at = 0;
+        } else
+            complete_request(next, false, 0, "previous command failed", false);
+    }
+    dispatch_requests();
+}
+
+//
+//  An HTTP transfer is done
+//  Only requests that didn't go out at all are retried
+//
+static void complete_transfer(int slot, int status, int code, bool sent) {
+    struct request * request = requests + slot;
+    logdebug("Request %d done: transport result %d, HTTP status %d", request->id, code, status);
+    //
+    //  Accepted: a complete JSON-RPC reply without error
     //
-    struct curl_slist * targetList = NULL;
-    curl_easy_setopt(curl, CURLOPT_URL, SERVER_ADDRESS_TEMPLATE);
-    char target[100];
-    snprintf(target, sizeof(target), "::%s:%d", server->host, server->port);
-    //logdebug("Command Target: %s", target);
-    targetList = curl_slist_append(targetList, target);
-    curl_easy_setopt(curl, CURLOPT_CONNECT_TO, targetList);
+    bool accepted = json_end(&request->parser);
+    complete_request(slot, !code && (status == 200) && accepted,
+                     (code) ? code : status,
+                     (code) ? http_error(code) :
+                     (status != 200) ? "HTTP error" : "invalid or error reply",
+                     code && !sent);
+}
+
+//
+//  HTTP reply data, in chunks as it arrives
+//
+static void transfer_data(int slot, const char * data, size_t length) {
+    logdebug("Server reply %.*s", (int)length, data);
+    json_feed(&requests[slot].parser, data, length);
+}
+
+//
+//  A CLI command is done
+//  The CLI replies to everything, only a lost connection is a failure
+//
+static void cli_result(int id, bool success) {
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        if ((requests[cnt].id != id) || !requests[cnt].cli)
+            continue;
+        logdebug("Request %d done: CLI %s", id, (success) ? "reply" : "connection lost");
+        complete_request(cnt, success, (success) ? 200 : SBPD_result_recv, "CLI connection lost", false);
+        return;
+    }
+}
+
+//
+//  Send a new request, or queue it if there is no server yet
+//  slot: the request, -1 to only start what's queued
+//
+static void send_request(struct sbpd_server * server, int slot) {
+    if (slot >= 0) {
+        requests[slot].waiting = true;
+        requests[slot].retry_at = 0;
+    }
+    if (!server->host || !server->port) {
+        if (slot >= 0)
+            logdebug("No server, command %d queued: %s", requests[slot].id, requests[slot].fragment);
+        return;
+    }
+    sbpd_alloc_subsystem_t scope = alloc_scope(SBPD_alloc_comm);
+    set_endpoint(server);
+    dispatch_requests();
+    alloc_scope(scope);
+}
+
+//
+//  Room for new requests of a priority, see SBPD_TRANSPORT_SLOTS
+//  Parameters:
+//      priority: priority of the (first) command
+//      count: number of slots needed
+//      freed: slots about to be freed (coalesced)
+//
+static bool admit(sbpd_priority_t priority, int count, int freed) {
+    int available = free_slots() + freed;
+    if (priority == SBPD_priority_transport)
+        return available >= count;
+    if (available - SBPD_TRANSPORT_SLOTS < count)
+        return false;
+    if (priority != SBPD_priority_continuous)
+        return true;
+    int used = 0;
+    for (int cnt = 0; cnt < max_requests; cnt++)
+        if ((requests[cnt].id >= 0) && (requests[cnt].priority == SBPD_priority_continuous))
+            used++;
+    return used - freed + count <= SBPD_CONTINUOUS_SLOTS;
+}
+
+//
+//  A queued continuous request from the same template, to be merged
+//  Returns: slot or -1
+//
+static int coalesce_candidate(int player, const struct sbpd_command * command, reply_handler_t handler) {
+    if (handler || !command->parameter || (classPriority[command->class] != SBPD_priority_continuous))
+        return -1;
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        struct request * request = requests + cnt;
+        if ((request->id >= 0) && request->waiting && !request->macro && !request->handler &&
+            (request->player == player) && same_template(request, command))
+            return cnt;
+    }
+    return -1;
+}
+
+//
+//  Queue a single request for a player
+//  member: sent to another player of a group
+//  group: handle of the group's first request or -1
+//
+static sbpd_request_t queue_request(struct sbpd_server * server, int player, bool member, sbpd_request_t group,
+                                    const struct sbpd_command * command, int parameter,
+                                    struct sbpd_json_field * fields, int count,
+                                    reply_handler_t handler, void * context) {
+    if (!initialized)
+        return -1;
+    int merge = coalesce_candidate(player, command, handler);
+    if (!admit(classPriority[command->class], 1, (merge >= 0) ? 1 : 0)) {
+        logwarn("Too many commands in flight, dropped: %.*s", command->json_length, command->json);
+        return SBPD_request_busy;
+    }
     
     //
-    //  username/password?
+    //  Continuous controls: the queued request is replaced by this one,
+    //  which keeps its place in the queue
     //
-    char secret[255];
-    if (server->user && server->password) {
-        snprintf(secret, sizeof(secret), "%s:%s", server->user, server->password);
-        curl_easy_setopt(curl, CURLOPT_USERPWD, secret);
+    sbpd_time_t queued = 0;
+    bool throttled = false;
+    if (merge >= 0) {
+        queued = requests[merge].queued;
+        throttled = requests[merge].throttled;
+        if (requests[merge].additive)
+            parameter += requests[merge].parameter;
+        queueStats[requests[merge].priority].coalesced++;
+        logdebug("Command %d coalesced", requests[merge].id);
+        complete_request(merge, false, SBPD_result_cancelled, "coalesced", false);
     }
+    int slot = get_slot();
     
     //
     //  setup payload (JSON/RPC CLI command) for POST command
     //
-    char jsonFragment[256];
-    snprintf(jsonFragment, sizeof(jsonFragment), JSON_CALL_MASK, 1l, MAC, fragment);
-    logdebug("Server %s command: %s", target, jsonFragment);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonFragment);
-    if (headerList)
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+    struct request * request = requests + slot;
+    request->handler = handler;
+    request->context = context;
+    request->fields = fields;
+    request->count = count;
+    request->player = player;
+    request->member = member;
+    request->group = group;
+    prepare_request(slot, command, parameter);
+    if (merge >= 0) {
+        request->queued = queued;
+        request->throttled = throttled;
+    }
+    send_request(server, slot);
+    return request->id;
+}
+
+//
+//
+//  Send CLI command fragment to Logitech Media Server/Squeezebox Server
+//  Asynchronous: returns immediately, the result is published as command event
+//
+//  Parameters:
+//      server: the server information structure defining host, port etc.
+//      frament: the command fragment to be sent as JSON array
+//               e.g. "[\"mixer\”,\"volume\",\"+2\"]"
+//               optionally: some CLI commands can take parameter hashes as "params:{}"
+//  Returns: request handle or -1 if the command could not be sent
+//
+//
+sbpd_request_t send_command(struct sbpd_server * server, sbpd_target_t target, const char * fragment) {
+    struct sbpd_command command;
+    if (!compile_command(&command, fragment)) {
+        logwarn("Invalid command: %s", fragment);
+        return -1;
+    }
+    return send_compiled(server, target, &command, 1, 0, 0);
+}
+
+//
+//
+//  Send a CLI query, the reply goes to the handler
+//
+//
+sbpd_request_t send_query(struct sbpd_server * server, sbpd_target_t target, const char * fragment,
+                          struct sbpd_json_field * fields, int count,
+                          reply_handler_t handler, void * context) {
+    struct sbpd_command command;
+    if (!compile_command(&command, fragment)) {
+        logwarn("Invalid query: %s", fragment);
+        return -1;
+    }
+    return queue_request(server, SBPD_target_player(target), false, -1, &command, 0,
+                         fields, count, handler, context);
+}
+
+//
+//
+//  Send a macro: a list of CLI command fragments
+//  Steps are sent in order, back to back. See servercomm.h
+//
+//
+sbpd_request_t send_commands(struct sbpd_server * server, sbpd_target_t target,
+                             char * fragments[], uint32_t depends, int count) {
+    if ((count < 1) || (count > max_requests))
+        return -1;
+    struct sbpd_command commands[max_requests];
+    for (int cnt = 0; cnt < count; cnt++) {
+        if (!compile_command(commands + cnt, fragments[cnt])) {
+            logwarn("Invalid command: %s", fragments[cnt]);
+            return -1;
+        }
+    }
+    return send_compiled(server, target, commands, count, depends, 0);
+}
+
+//
+//
+//  Send compiled commands
+//  A single command is a plain request, more are macro steps
+//  Per player commands to a group go to all players, see servercomm.h
+//
+//
+sbpd_request_t send_compiled(struct sbpd_server * server, sbpd_target_t target,
+                             const struct sbpd_command * commands,
+                             int count, uint32_t depends, int parameter) {
+    if (!initialized || (count < 1))
+        return -1;
+    if (count == 1) {
+        int players[max_players];
+        int number = 1;
+        players[0] = SBPD_target_player(target);
+        if ((commands->class == SBPD_class_volume) || (commands->class == SBPD_class_power))
+            number = target_players(target, players);
+        sbpd_request_t first = -1;
+        sbpd_request_t last = -1;
+        for (int cnt = 0; cnt < number; cnt++) {
+            sbpd_request_t request = queue_request(server, players[cnt], cnt > 0, first, commands, parameter,
+                                                   NULL, 0, NULL, NULL);
+            if ((request >= 0) && (first < 0))
+                first = request;
+            if ((request >= 0) || (last < 0))
+                last = request;
+        }
+        return (first >= 0) ? first : last;
+    }
     
     //
-    //  Send command and clean up
-    //  Note: one could retrieve a result here since all communication is synchronous!
+    //  Macros go to the target's player only, also volume and power steps
     //
-    CURLcode res = curl_easy_perform(curl);
-    logdebug("Curl result: %d", res);
-    curl_slist_free_all(targetList);
-    targetList = NULL;
+    if (target & SBPD_target_group) {
+        for (int cnt = 0; cnt < count; cnt++) {
+            if ((commands[cnt].class == SBPD_class_volume) || (commands[cnt].class == SBPD_class_power)) {
+                loginfo("Macro for a group: sent to player %d only, not to its group", SBPD_target_player(target));
+                break;
+            }
+        }
+    }
+    if (!admit(classPriority[commands->class], count, 0)) {
+        logwarn("Too many commands in flight, macro dropped");
+        return SBPD_request_busy;
+    }
     
-    //commLock = false;
-    return true;
+    //
+    //  All steps are queued now, in order and with the priority of the
+    //  first. Only steps depending on the previous reply are held.
+    //
+    int previous = -1;
+    for (int cnt = 0; cnt < count; cnt++) {
+        int slot = get_slot();
+        struct request * request = requests + slot;
+        request->depends = (cnt > 0) && (depends & (1 << cnt));
+        request->macro = true;
+        request->player = SBPD_target_player(target);
+        request->member = cnt > 0;
+        prepare_request(slot, commands + cnt, parameter);
+        request->previous = previous;
+        if (previous >= 0) {
+            requests[previous].next = slot;
+            request->priority = requests[previous].priority;
+            request->queued = requests[previous].queued;
+        }
+        if (!request->depends) {
+            request->waiting = true;
+            request->retry_at = 0;
+        }
+        logdebug("Macro step %d%s: %s", request->id, (request->depends) ? " (held)" : "",
+                 request->fragment);
+        previous = slot;
+    }
+    sbpd_request_t last = requests[previous].id;
+    send_request(server, -1);
+    return last;
 }
 
 //
-//  Curl reply callback
-//  Replies from the server go here.
-//  We could handle return values here but we just log.
 //
-size_t write_data(char *buffer, size_t size, size_t nmemb, void *userp) {
-    if (size)
-        logdebug("Server reply %s", buffer);
-    return size * nmemb;
+//  Cancel a command
+//  Removes a running HTTP transfer, a CLI command already written is
+//  left alone and its reply ignored. Remaining macro steps and the
+//  requests for the other players of a group are cancelled too.
+//
+//
+bool cancel_command(sbpd_request_t request) {
+    if (request < 0)
+        return false;
+    bool found = false;
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        if ((requests[cnt].id < 0) || ((requests[cnt].id != request) && (requests[cnt].group != request)))
+            continue;
+        found = true;
+        int slot = cnt;
+        while (slot >= 0) {
+            int next = requests[slot].next;
+            requests[slot].next = -1;
+            if (requests[slot].started && !requests[slot].cli)
+                http_cancel(slot);
+            complete_request(slot, false, SBPD_result_cancelled, "cancelled", false);
+            slot = next;
+        }
+    }
+    return found;
 }
 
 //
+//  CLI commands past their deadline
+//  The connection is stuck: drop it, everything else in flight on it fails
+//  and later commands use HTTP until it is back
 //
-//  Initialize CURL for server communication and set MAC address
+static void check_deadlines() {
+    sbpd_time_t now = clock_now();
+    bool expired = false;
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        if ((requests[cnt].id < 0) || !requests[cnt].cli || (now < requests[cnt].deadline))
+            continue;
+        complete_request(cnt, false, SBPD_result_timeout, "no CLI reply", false);
+        expired = true;
+    }
+    if (expired)
+        cli_abort();
+}
+
+bool command_waiting(sbpd_request_t request) {
+    bool waiting = false;
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        if ((request < 0) || (requests[cnt].id < 0) ||
+            ((requests[cnt].id != request) && (requests[cnt].group != request)))
+            continue;
+        if (!requests[cnt].waiting)
+            return false;
+        waiting = true;
+    }
+    return waiting;
+}
+
+const struct sbpd_server_health * server_health() {
+    return &health;
+}
+
+const struct sbpd_rate_stats * rate_stats() {
+    return rateStats;
+}
+
+const struct sbpd_queue_stats * queue_stats() {
+    for (int priority = 0; priority < SBPD_priorities; priority++) {
+        queueStats[priority].queued = 0;
+        queueStats[priority].in_flight = 0;
+    }
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        struct request * request = requests + cnt;
+        if ((request->id < 0) || request->probe)
+            continue;
+        if (request->waiting)
+            queueStats[request->priority].queued++;
+        else if (request->started)
+            queueStats[request->priority].in_flight++;
+    }
+    return queueStats;
+}
+
+sbpd_time_t server_reply_time() {
+    if (!health.samples)
+        return SBPD_COMMAND_TIMEOUT * SCD_MILLISECOND;
+    return health.srtt + 4 * health.rttvar;
+}
+
 //
+//  Maintain the connection
 //
-int init_comm(char * use_mac) {
-    loginfo("Initializing CURL");
-    MAC = use_mac;
-    //
-    //  Setup mutex lock for comm - unused
-    //
-    /*if (pthread_mutex_init(&lock, NULL) != 0) {
-        logerr("comm lock mutex init failed");
-        return -1;
-    }*/
+void poll_comm(struct sbpd_server * server) {
+    if (!initialized)
+        return;
     
     //
-    //  Initialize curl comm
+    //  Offline queue: drop what's too old
     //
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl = curl_easy_init();
-    if (!curl) {
-        curl_global_cleanup();
-        return -1;
+    sbpd_time_t now = clock_now();
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        if ((requests[cnt].id < 0) || !requests[cnt].waiting || (now < requests[cnt].expires))
+            continue;
+        requests[cnt].waiting = false;
+        complete_request(cnt, false, SBPD_result_expired, "not delivered in time", false);
     }
+    if (!server->host || !server->port)
+        return;
+    set_endpoint(server);
+    check_deadlines();
+    poll_cli_comm(server);
     
     //
-    //  Set verbose mode for communication debugging
+    //  Outbound queue: next attempts, starved requests
     //
-    if (loglevel() == LOG_DEBUG)
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-    headerList = curl_slist_append(headerList, "Content-Type: application/json");
-    char userAgent[50];
-    snprintf(userAgent, sizeof(userAgent), "User-Agent: %s/%s)", USER_AGENT, VERSION);
-    headerList = curl_slist_append(headerList, userAgent);
+    dispatch_requests();
+    
     //
-    //  Add session-ID? Only needed for MySB which is not supported
+    //  Probe: (re)connect, or keep an idle connection warm
+    //  Never while commands are in flight, they are the better probe
     //
-    //headerList = curl_slist_append(headerList, "x-sdi-squeezenetwork-session: ...")
+    if ((free_slots() < max_requests) || (now < connection.next_probe))
+        return;
+    if (http_ready() && (!probeInterval || (now < connection.last_traffic + probeInterval)))
+        return;
+    int slot = get_slot();
+    requests[slot].probe = true;
+    prepare_request(slot, &probeCommand, 0);
+    start_request(slot);
+}
+
+//
+//
+//  Initialize server communication and set MAC address
+//
+//
+int init_comm(char * use_mac, int probe_interval) {
+    init_players(use_mac);
+    probeInterval = (sbpd_time_t)MAX(probe_interval, 0) * SCD_SECOND;
+    for (int cnt = 0; cnt < max_requests; cnt++) {
+        requests[cnt].id = -1;
+        requests[cnt].envelope_player = -1;
+    }
+    compile_command(&probeCommand, PROBE_FRAGMENT);
+    for (int class = 0; class < SBPD_classes; class++) {
+        buckets[class].tokens = SBPD_RATE_BURST;
+        buckets[class].updated = clock_now();
+        rateStats[class].rate = SBPD_RATE_INITIAL;
+    }
+    rateTimer = create_timer(rate_timer, NULL);
+    if (rateTimer < 0)
+        return -1;
+    if (init_http(transfer_data, complete_transfer))
+        return -1;
+    init_cli_comm(use_mac, cli_result);
+    initialized = true;
     return 0;
 }
 
 //
 //
-//  Shutdown CURL
+//  Shutdown server communication
 //
 //
 void shutdown_comm() {
-    curl_slist_free_all(headerList);
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
+    if (!initialized)
+        return;
+    if (health.samples)
+        loginfo("Server RTT: %u samples, last %lu, min %lu, smoothed %lu +/- %lu, max %lu us, "
+                "probes: %u, %u failed",
+                health.samples, (unsigned long)health.rtt, (unsigned long)health.min_rtt,
+                (unsigned long)health.srtt, (unsigned long)health.rttvar,
+                (unsigned long)health.max_rtt, health.probes, health.probes_failed);
+    for (int class = 0; class < SBPD_classes; class++)
+        if (rateStats[class].throttled || rateStats[class].decreases)
+            loginfo("Class %d: rate %.1f/s, %u commands throttled, %u decreases", class,
+                    rateStats[class].rate, rateStats[class].throttled, rateStats[class].decreases);
+    for (int priority = 0; priority < SBPD_priorities; priority++)
+        if (queueStats[priority].coalesced || queueStats[priority].promoted)
+            loginfo("Priority %d: %u commands coalesced, %u promoted", priority,
+                    queueStats[priority].coalesced, queueStats[priority].promoted);
+    shutdown_cli_comm();
+    shutdown_http();
+    initialized = false;
 }
-
@@ -36,34 +36,357 @@
 #define servercomm_h
 
 #include "sbpd.h"
+#include "jsonparse.h"
+#include "timing.h"
+#include "players.h"
 
 //
+//  Request handle, published with the command result
+//  Negative: not sent. SBPD_request_busy: no room right now, may be tried
+//  again later. -1: won't work on another try either (invalid, not initialized)
 //
-//  Initialize CURL for server communication and set MAC address
+typedef int sbpd_request_t;
+#define SBPD_request_busy       (-2)
+
+#define max_requests 16     // requests in flight, including macro steps
+#define max_command  200    // command fragment length
+
+//
+//  Deadlines in ms
+//  Every command has to connect and complete in time, it fails with
+//  SBPD_result_timeout otherwise. The main loop never waits for the server.
+//
+#define SBPD_CONNECT_TIMEOUT    1000
+#define SBPD_COMMAND_TIMEOUT    3000
+
+//
+//  Command event codes besides HTTP status
+//  Negative curl result codes, the built-in HTTP client and the CLI use the same
+//
+#define SBPD_result_connect     (-7)    // CURLE_COULDNT_CONNECT
+#define SBPD_result_timeout     (-28)   // CURLE_OPERATION_TIMEDOUT
+#define SBPD_result_send        (-55)   // CURLE_SEND_ERROR
+#define SBPD_result_recv        (-56)   // CURLE_RECV_ERROR
+#define SBPD_result_cancelled   (-42)   // CURLE_ABORTED_BY_CALLBACK
+#define SBPD_result_expired     (-1000) // not delivered within its time to live
+
+//
+//  Offline queue
+//  Commands that could not be delivered (no server, no connection) are
+//  retried with jittered exponential backoff until their time to live
+//  runs out. The time to live depends on the command class, a late
+//  "play" is worse than none. Commands that may have reached the server
+//  are never repeated.
+//
+typedef enum {
+    SBPD_class_default = 0,
+    SBPD_class_transport,       // play, pause, stop
+    SBPD_class_navigation,      // next, previous, playlists, favorites
+    SBPD_class_volume,
+    SBPD_class_seek,
+    SBPD_class_power,
+    SBPD_classes
+} sbpd_command_class_t;
+
+#define SBPD_TTL_DEFAULT        (10 * SCD_SECOND)
+#define SBPD_TTL_TRANSPORT      (5 * SCD_SECOND)
+#define SBPD_TTL_NAVIGATION     (5 * SCD_SECOND)
+#define SBPD_TTL_VOLUME         (10 * SCD_SECOND)
+#define SBPD_TTL_SEEK           (5 * SCD_SECOND)
+#define SBPD_TTL_POWER          (15 * SCD_SECOND)
+#define SBPD_RETRY_MIN          (250 * SCD_MILLISECOND)
+#define SBPD_RETRY_MAX          (4 * SCD_SECOND)
+
+//
+//  Outbound queue priorities
+//  Every player has its own queue. Requests are started by priority:
+//  nothing of a lower priority is started for a player while a higher one
+//  is queued or in flight, so a pause never waits behind a volume storm.
+//  Continuous controls are sent one at a time per player, queued ones with
+//  the same command template are coalesced (relative steps are added up,
+//  absolute values replaced). A request that waited
+//  for SBPD_STARVATION_LIMIT is started regardless.
+//  Slots are reserved: continuous controls use at most half of them and
+//  the last SBPD_TRANSPORT_SLOTS only take transport commands.
+//
+typedef enum {
+    SBPD_priority_transport = 0,    // play, pause, power
+    SBPD_priority_navigation,       // next, previous, anything else
+    SBPD_priority_continuous,       // volume, seek
+    SBPD_priorities
+} sbpd_priority_t;
+
+#define SBPD_STARVATION_LIMIT   (1 * SCD_SECOND)
+#define SBPD_TRANSPORT_SLOTS    2
+#define SBPD_CONTINUOUS_SLOTS   (max_requests / 2)
+
+struct sbpd_queue_stats {
+    int queued;                 // waiting to be sent, including the offline queue
+    int in_flight;
+    uint32_t coalesced;         // merged into a newer request
+    uint32_t promoted;          // started ahead of a higher priority
+};
+
+//
+//  Rate limits
+//  Every command class has a token bucket, its rate adapts to the server
+//  (AIMD): it grows by SBPD_RATE_INCREASE with every reply in time and is
+//  halved, at most once per round trip, when a reply takes longer than
+//  SBPD_RATE_LATENCY times the fastest round trip plus SBPD_RATE_SLACK or
+//  doesn't come at all. Commands over the rate wait in the queue,
+//  continuous controls coalesce meanwhile. Probes are not limited.
+//
+#define SBPD_RATE_INITIAL       20      // commands per second
+#define SBPD_RATE_MIN           2
+#define SBPD_RATE_MAX           200
+#define SBPD_RATE_INCREASE      1
+#define SBPD_RATE_BURST         4       // commands
+#define SBPD_RATE_LATENCY       2
+#define SBPD_RATE_SLACK         (20 * SCD_MILLISECOND)
+
+struct sbpd_rate_stats {
+    double rate;                // current commands per second
+    uint32_t throttled;         // commands that waited for the rate limit
+    uint32_t decreases;
+};
+
+//
+//  Server health
+//  When no command ran for the probe interval a cheap query keeps the
+//  connection warm and the server paged in. Every command and probe
+//  round trip feeds the RTT estimate (smoothed as in RFC 6298). The server
+//  is degraded after consecutive failed probes, until anything succeeds.
+//  Changes are published as SBPD_evt_health.
+//
+#define SBPD_PROBE_INTERVAL     30      // s, default
+#define SBPD_PROBE_FAILURES     2
+
+struct sbpd_server_health {
+    bool degraded;
+    int failures;               // consecutive failed probes
+    uint32_t samples;
+    sbpd_time_t rtt;            // last round trip
+    sbpd_time_t srtt;           // smoothed round trip, 0: no sample yet
+    sbpd_time_t rttvar;         // round trip variation
+    sbpd_time_t min_rtt;
+    sbpd_time_t max_rtt;
+    uint32_t probes;
+    uint32_t probes_failed;
+};
+
+//
+//  Compiled command
+//  A command fragment prepared once, at configuration time, for both
+//  transports: the JSON fragment and the URL encoded CLI arguments, each
+//  split at the parameter slot ("%d"). Sending it only copies the parts and
+//  writes the parameter digits between them. The JSON-RPC envelope with the
+//  MAC is prebuilt per request slot, the request id patched in.
 //
+#define max_cli_arguments   (3 * max_command)
+
+struct sbpd_command {
+    sbpd_command_class_t class;
+    bool parameter;             // has a parameter slot
+    int json_split;             // position of the parameter
+    int json_length;
+    int cli_split;
+    int cli_length;             // -1: not a CLI command, HTTP only
+    char json[max_command];
+    char cli[max_cli_arguments];
+};
+
+//
+//  Compile a command fragment
+//  Parameters:
+//      command: receives the compiled command
+//      fragment: the command as JSON array, at most one "%d" parameter
+//  Returns: false if the fragment is too long or has more than one parameter
+//
+bool compile_command(struct sbpd_command * command, const char * fragment);
+
+//
+//  Reply handler for queries
+//  Called from the event loop when the query completed
+//  Parameters:
+//      request: the request handle
+//      success: the reply was complete, the fields are set (see found flags)
+//      context: as passed to send_query
+//
+typedef void (*reply_handler_t)(sbpd_request_t request, bool success, void * context);
+
+//
+//
+//  Initialize server communication and set MAC address
+//  Parameters:
+//      use_mac: the default player's MAC address, see players.h
+//      probe_interval: idle time in s before the server is probed, 0: never
 //
-int init_comm(char * use_mac);
+//
+int init_comm(char * use_mac, int probe_interval);
 
 //
 //
-//  Shutdown CURL
+//  Shutdown server communication
 //
 //
 void shutdown_comm();
 
+//
+//
+//  Maintain the server connection
+//  Call from the main loop. Keeps a persistent connection to the current
+//  server and reconnects if it was lost, before the next command is sent.
+//
+//  Parameters:
+//      server: the server information structure defining host, port etc.
+//
+//
+void poll_comm(struct sbpd_server * server);
+
 //
 //
 //  Send CLI command fragment to Logitech Media Server/Squeezebox Server
-//  This command blocks (synchronously communicates".
-//  In timing critical situations this should be called from a separate thread
+//  Asynchronous: the request is queued and runs from the event loop,
+//  the result is published as SBPD_evt_command with the returned handle.
+//  Sent over the CLI port when connected (pipelined), otherwise over HTTP.
+//  Without server or connection the command waits in the offline queue.
 //
 //  Parameters:
 //      server: the server information structure defining host, port etc.
+//      target: the player or group, see send_compiled()
 //      frament: the command fragment to be sent as JSON array
 //               e.g. "[\"mixer\”,\"volume\",\"+2\"]"
-//  Returns: success flag
+//  Returns: request handle, SBPD_request_busy if the queue is full, -1 on error
+//
+//
+sbpd_request_t send_command(struct sbpd_server * server, sbpd_target_t target, const char * fragment);
+
+//
+//
+//  Send a CLI query
+//  Like send_command, the requested fields of the reply's "result" object
+//  are parsed as the reply comes in. The handler is called before the
+//  command event is published. Queries always use HTTP (JSON reply).
+//
+//  Parameters:
+//      server: the server information structure defining host, port etc.
+//      target: the player, a group target queries its player
+//      fragment: the query fragment, e.g. "[\"mixer\",\"volume\",\"?\"]"
+//      fields: the fields to extract, need to stay valid until the handler was called
+//      count: number of fields
+//      handler: called when the query completed
+//      context: passed to the handler
+//  Returns: request handle, SBPD_request_busy if the queue is full, -1 on error
+//
+//
+sbpd_request_t send_query(struct sbpd_server * server, sbpd_target_t target, const char * fragment,
+                          struct sbpd_json_field * fields, int count,
+                          reply_handler_t handler, void * context);
+
+//
+//
+//  Send a macro: a list of CLI command fragments
+//  Commands are sent in order, back to back without waiting for replies:
+//  a macro takes one round trip. Commands flagged in "depends" are held
+//  until the previous one replied and only sent if it succeeded.
+//  Asynchronous, every command publishes its own SBPD_evt_command.
+//
+//  Parameters:
+//      server: the server information structure defining host, port etc.
+//      target: the player or group, see send_compiled()
+//      fragments: the command fragments
+//      depends: bit n set: command n only runs if command n - 1 succeeded
+//      count: number of commands
+//  Returns: handle of the last command, SBPD_request_busy if the queue is full,
+//           -1 on error
+//
+//
+sbpd_request_t send_commands(struct sbpd_server * server, sbpd_target_t target,
+                             char * fragments[], uint32_t depends, int count);
+
+//
+//
+//  Send compiled commands: a single command or a macro
+//  Like send_commands, the parameter goes into every command's parameter slot
+//  Group targets: a single volume or power command is sent to every player
+//  of the group at once, they are set per player. The returned handle is
+//  that of the target's player request and stands for the group: its
+//  SBPD_evt_command is the target player's result, cancel_command() cancels
+//  all of them. Everything else goes to the target's player, the server
+//  applies playback to its whole sync group (a "pause" toggle per player
+//  would undo itself). Macros go to the target's player only, volume and
+//  power steps too: they are logged and not fanned out.
+//
+//  Parameters:
+//      server: the server information structure defining host, port etc.
+//      target: the player or group, see players.h
+//      commands: the compiled commands
+//      count: number of commands
+//      depends: bit n set: command n only runs if command n - 1 succeeded
+//      parameter: value for the parameter slots
+//  Returns: handle of the last command or of the group (see above),
+//           SBPD_request_busy if the queue is full, -1 on error
+//
+//
+sbpd_request_t send_compiled(struct sbpd_server * server, sbpd_target_t target,
+                             const struct sbpd_command * commands,
+                             int count, uint32_t depends, int parameter);
+
+//
+//
+//  Cancel a command, e.g. a volume change superseded by a newer one
+//  The command and the remaining steps of its macro complete with
+//  SBPD_result_cancelled, for a group handle (see send_compiled()) the
+//  requests for all players of the group. A command already on the wire
+//  may still take effect.
+//
+//  Parameters:
+//      request: the request handle
+//  Returns: false if the request is not in flight
+//
+//
+bool cancel_command(sbpd_request_t request);
+
+//
+//
+//  Is a command waiting in the offline queue?
+//  True between delivery attempts, the command can still be cancelled
+//  and replaced without having had any effect. For a group handle all
+//  of the group's requests have to be waiting.
+//
+//
+bool command_waiting(sbpd_request_t request);
+
+//
+//
+//  Server health and round trip statistics
+//  Returns: the current statistics, updated in place
+//
+//
+const struct sbpd_server_health * server_health();
+
+//
+//
+//  Outbound queue statistics
+//  Returns: SBPD_priorities entries, indexed by sbpd_priority_t
+//
+//
+const struct sbpd_queue_stats * queue_stats();
+
+//
+//
+//  Rate limit statistics
+//  Returns: SBPD_classes entries, indexed by sbpd_command_class_t
+//
+//
+const struct sbpd_rate_stats * rate_stats();
+
+//
+//
+//  Time in which a reply is expected: smoothed RTT plus four times its
+//  variation, SBPD_COMMAND_TIMEOUT (in µs) until there was a sample
 //
 //
-bool send_command(struct sbpd_server * server, char * fragment);
+sbpd_time_t server_reply_time();
 
 #endif /* servercomm_h */
@@ -0,0 +1,189 @@
+//
+//  statecache.c
+//  SqueezeButtonPi
+//
+//  Persistent warm-start cache
+//  - Read the cached server at startup
+//  - Atomically write the state file when a new server was validated
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "statecache.h"
+#include "sbpd.h"
+#include "events.h"
+#include "discovery.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+static const char * statePath = NULL;
+static struct sbpd_server * cacheServer = NULL;
+static const char * cacheMAC = NULL;
+static int subscriber = -1;
+static bool dirty = false;  // server changed, not yet validated and saved
+
+//
+//  Cached values
+//
+static char cachedHost[16];
+static char cachedUUID[64];
+
+//
+//  Write the state file
+//  Written to a temporary file first and renamed, so the file is never partial
+//
+static void save_state() {
+    char tmpPath[256];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", statePath);
+    //
+    //  No stdio: this runs in steady state and fopen() allocates
+    //
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        logwarn("Could not write state file %s", tmpPath);
+        return;
+    }
+    bool ok = dprintf(fd, "# sbpd state\n"
+                      "mac=%s\n"
+                      "host=%s\n"
+                      "port=%u\n"
+                      "cliport=%u\n"
+                      "uuid=%s\n",
+                      cacheMAC, cacheServer->host, cacheServer->port, cacheServer->cli_port,
+                      (cacheServer->uuid) ? cacheServer->uuid : "") > 0;
+    ok = !fsync(fd) && ok;
+    close(fd);
+    if (!ok || rename(tmpPath, statePath)) {
+        logwarn("Could not write state file %s", statePath);
+        unlink(tmpPath);
+        return;
+    }
+    loginfo("State saved: server %s:%u", cacheServer->host, cacheServer->port);
+}
+
+//
+//  Read the state file
+//  Returns true if a complete entry for this player was found
+//
+static bool load_state(uint32_t * port, uint32_t * cliPort) {
+    FILE * file = fopen(statePath, "r");
+    if (!file)
+        return false;
+    char line[128];
+    bool sameMAC = false;
+    *port = 0;
+    *cliPort = 0;
+    cachedHost[0] = 0;
+    cachedUUID[0] = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = 0;
+        char * value = strchr(line, '=');
+        if ((line[0] == '#') || !value)
+            continue;
+        *value++ = 0;
+        if (!strcmp(line, "mac"))
+            sameMAC = cacheMAC && !strcasecmp(value, cacheMAC);
+        else if (!strcmp(line, "host"))
+            strncpy(cachedHost, value, sizeof(cachedHost) - 1);
+        else if (!strcmp(line, "port"))
+            *port = (uint32_t)strtoul(value, NULL, 10);
+        else if (!strcmp(line, "cliport"))
+            *cliPort = (uint32_t)strtoul(value, NULL, 10);
+        else if (!strcmp(line, "uuid"))
+            strncpy(cachedUUID, value, sizeof(cachedUUID) - 1);
+    }
+    fclose(file);
+    if (!sameMAC)
+        loginfo("State file %s is for a different player", statePath);
+    return sameMAC && cachedHost[0] && *port;
+}
+
+//
+//  Event handler
+//  A server endpoint counts as validated after the first successful command
+//
+static void state_event(const struct sbpd_event * event, void * context) {
+    switch (event->type) {
+        case SBPD_evt_server:
+            dirty = true;
+            break;
+        case SBPD_evt_command:
+            if (dirty && event->command.success &&
+                cacheServer->host && cacheServer->port) {
+                dirty = false;
+                save_state();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+//
+//  Initialize the state cache
+//
+bool init_state_cache(const char * path,
+                      sbpd_config_parameters_t config,
+                      sbpd_config_parameters_t * discovered,
+                      struct sbpd_server * server,
+                      const char * mac) {
+    statePath = path;
+    cacheServer = server;
+    cacheMAC = mac;
+    
+    uint32_t port, cliPort;
+    bool loaded = load_state(&port, &cliPort) &&
+                  (!(config & SBPD_cfg_host) || !(config & SBPD_cfg_port));
+    //
+    //  Subscribe after seeding discovery: the cached server doesn't need to be saved again
+    //
+    if (loaded) {
+        lognotice("Using cached server %s:%u", cachedHost, port);
+        if (!(config & SBPD_cfg_host))
+            server->host = cachedHost;
+        if (!(config & SBPD_cfg_port))
+            server->port = port;
+        server->cli_port = cliPort;
+        server->uuid = cachedUUID;
+        seed_discovery(config, discovered, server);
+    }
+    subscriber = subscribe_events(SBPD_evt_server | SBPD_evt_command);
+    return loaded;
+}
+
+//
+//  Polling function: handle server and command events
+//
+void poll_state_cache() {
+    if (subscriber >= 0)
+        poll_events(subscriber, state_event, NULL);
+}
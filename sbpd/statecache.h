@@ -0,0 +1,67 @@
+//
+//  statecache.h
+//  SqueezeButtonPi
+//
+//  Persistent warm-start cache
+//  Keeps the last validated server endpoint across restarts
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef statecache_h
+#define statecache_h
+
+#include "sbpd.h"
+
+//
+//  Initialize the state cache
+//  Reads the state file and, if it belongs to the same player, seeds
+//  server discovery with the cached server so commands can be sent right away.
+//  The state file is rewritten whenever a new server endpoint was validated
+//  by a successful command.
+//  Parameters:
+//      path: the state file
+//      config: preconfigured parameters, never taken from the cache
+//      discovered: the discovered parameters
+//      server: server configuration
+//      mac: the player MAC
+//  Returns: true if a cached server is used
+//
+bool init_state_cache(const char * path,
+                      sbpd_config_parameters_t config,
+                      sbpd_config_parameters_t * discovered,
+                      struct sbpd_server * server,
+                      const char * mac);
+
+//
+//  Polling function: handle server and command events
+//  Call from main loop
+//
+void poll_state_cache();
+
+#endif /* statecache_h */
@@ -0,0 +1,85 @@
+//
+//  bench_json.c
+//  SqueezeButtonPi
+//
+//  Reply parser benchmark: throughput on LMS status replies
+//  The 825 byte status reply is fed in random chunks of 1-512 bytes, like
+//  HTTP reads deliver it, with the fields a status query would extract.
+//  
+//      make bench, or test/bench_json [replies]
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "testing.h"
+#include "timing.h"
+#include "jsonparse.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define max_chunk       512
+
+int main(int argc, char * argv[]) {
+    int replies = (argc > 1) ? atoi(argv[1]) : 200000;
+    if (replies < 1)
+        replies = 200000;
+    long power, volume;
+    char mode[8], name[16];
+    struct sbpd_json_field fields[] = {
+        { "_power", SBPD_json_int, &power, sizeof(power) },
+        { "_mode", SBPD_json_string, mode, sizeof(mode) },
+        { "_volume", SBPD_json_int, &volume, sizeof(volume) },
+        { "player_name", SBPD_json_string, name, sizeof(name) }
+    };
+    size_t length = strlen(statusReply);
+    unsigned int seed = 1;
+    int failed = 0;
+    
+    sbpd_time_t start = clock_now();
+    for (int cnt = 0; cnt < replies; cnt++) {
+        struct sbpd_json_parser parser;
+        json_begin(&parser, fields, 4);
+        for (size_t offset = 0; offset < length; ) {
+            size_t chunk = 1 + rand_r(&seed) % max_chunk;
+            if (chunk > length - offset)
+                chunk = length - offset;
+            json_feed(&parser, statusReply + offset, chunk);
+            offset += chunk;
+        }
+        if (!json_end(&parser) || !fields[3].found)
+            failed++;
+    }
+    sbpd_time_t elapsed = clock_now() - start;
+    
+    double seconds = (double)elapsed / SCD_SECOND;
+    printf("%d status replies of %zu bytes in %.2f s: %.1f MB/s, %.2f us per reply, %d failed\n",
+           replies, length, seconds, replies * length / seconds / 1E6,
+           (double)elapsed / replies, failed);
+    return (failed) ? 1 : 0;
+}
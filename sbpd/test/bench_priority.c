@@ -0,0 +1,160 @@
+//
+//  bench_priority.c
+//  SqueezeButtonPi
+//
+//  Priority benchmark: a pauseRequest while volume commands flood the queue
+//  A stand-in server CLI answers after 20 ms, an encoder sends a volume
+//  step every 2 ms, coalesced while one is in flight. Now and then a pauseRequest is sent, its time to completion
+//  is the latency a user sees on the button.
+//  
+//      make bench, or test/bench_priority [pauses]
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "testing.h"
+#include "timing.h"
+#include "eventloop.h"
+#include "events.h"
+#include "servercomm.h"
+#include "clicomm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#define MAC             "00:04:20:00:00:01"
+#define SERVER_DELAY    (20 * SCD_MILLISECOND)
+#define VOLUME_EVERY    (2 * SCD_MILLISECOND)
+#define PAUSE_EVERY     (300 * SCD_MILLISECOND)
+#define max_pauses      1000
+
+static struct sbpd_server server;
+static int subscriber;
+
+static sbpd_request_t pauseRequest = -1;
+static bool pauseDone = false;
+static bool pauseSucceeded = false;
+
+static void command_event(const struct sbpd_event * event, void * context) {
+    if (event->command.request != pauseRequest)
+        return;
+    pauseDone = true;
+    pauseSucceeded = event->command.success;
+}
+
+static int compare_time(const void * a, const void * b) {
+    sbpd_time_t x = *(const sbpd_time_t *)a, y = *(const sbpd_time_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char * argv[]) {
+    int pauses = (argc > 1) ? atoi(argv[1]) : 20;
+    if ((pauses < 1) || (pauses > max_pauses))
+        pauses = 20;
+    uint32_t httpPort;
+    int refused = test_listener(false, &httpPort);
+    server.host = "127.0.0.1";
+    server.port = httpPort;
+    server.cli_port = start_cli_server(SERVER_DELAY);
+    subscriber = subscribe_events(SBPD_evt_command);
+    struct sbpd_command volumeStep;     // like a relative encoder, see control.c
+    compile_command(&volumeStep, "[\"mixer\",\"volume\",\"+%d\"]");
+    if (init_comm(MAC, 0))
+        return 1;
+    sbpd_time_t end = clock_now() + 2 * SCD_SECOND;
+    while (!cli_ready() && (clock_now() < end)) {
+        poll_comm(&server);
+        run_loop(10 * SCD_MILLISECOND);
+    }
+    if (!cli_ready()) {
+        fprintf(stderr, "stand-in server not reachable\n");
+        return 1;
+    }
+    
+    //
+    //  Volume every 2 ms, a pauseRequest every 300 ms once the previous one is done
+    //
+    static sbpd_time_t latencies[max_pauses];
+    int done = 0;
+    int failed = 0;
+    int volumes = 0;
+    sbpd_time_t nextVolume = clock_now();
+    sbpd_time_t nextPause = clock_now() + PAUSE_EVERY;
+    sbpd_time_t pauseSent = 0;
+    while (done < pauses) {
+        sbpd_time_t now = clock_now();
+        if (now >= nextVolume) {
+            send_compiled(&server, SBPD_target_default, &volumeStep, 1, 0, 1);
+            volumes++;
+            nextVolume += VOLUME_EVERY;
+        }
+        if ((pauseRequest < 0) && (now >= nextPause)) {
+            pauseRequest = send_command(&server, SBPD_target_default, "[\"pause\"]");
+            pauseSent = now;
+            pauseDone = false;
+            if (pauseRequest < 0) {
+                failed++;
+                done++;
+                nextPause = now + PAUSE_EVERY;
+            }
+        }
+        poll_comm(&server);
+        run_loop(MIN(nextVolume - MIN(nextVolume, clock_now()), SCD_MILLISECOND));
+        poll_events(subscriber, command_event, NULL);
+        if ((pauseRequest >= 0) && pauseDone) {
+            if (pauseSucceeded)
+                latencies[done - failed] = clock_now() - pauseSent;
+            else
+                failed++;
+            done++;
+            pauseRequest = -1;
+            nextPause = clock_now() + PAUSE_EVERY;
+        }
+    }
+    
+    int measured = done - failed;
+    const struct sbpd_queue_stats * stats = queue_stats();
+    printf("%d volume steps, %u coalesced; pause: %d sent, %d failed\n", volumes,
+           stats[SBPD_priority_continuous].coalesced, pauses, failed);
+    if (measured) {
+        sbpd_time_t sum = 0;
+        for (int cnt = 0; cnt < measured; cnt++)
+            sum += latencies[cnt];
+        qsort(latencies, measured, sizeof(latencies[0]), compare_time);
+        printf("pause latency: min %.1f ms, avg %.1f ms, max %.1f ms (server %lu ms)\n",
+               (double)latencies[0] / SCD_MILLISECOND, (double)sum / measured / SCD_MILLISECOND,
+               (double)latencies[measured - 1] / SCD_MILLISECOND,
+               (unsigned long)(SERVER_DELAY / SCD_MILLISECOND));
+    }
+    shutdown_comm();
+    stop_cli_server();
+    close(refused);
+    return 0;
+}
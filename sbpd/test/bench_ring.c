@@ -0,0 +1,123 @@
+//
+//  bench_ring.c
+//  SqueezeButtonPi
+//
+//  Input ring benchmark: GPIO process to network process latency
+//  The parent forwards input events like GPIO interrupt threads do, the
+//  forked network process takes them from the ring in its event loop.
+//  Paced events find the consumer asleep (eventfd wakeup), bursts don't.
+//  
+//      make bench, or test/bench_ring [events]
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "testing.h"
+#include "timing.h"
+#include "eventloop.h"
+#include "privsep.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PACE            (1 * SCD_MILLISECOND)
+#define max_events      100000
+
+static sbpd_time_t latencies[max_events];
+static int received = 0;
+
+static void bench_sink(const struct sbpd_event * event) {
+    if (received < max_events)
+        latencies[received] = clock_now() - event->time;
+    received++;
+}
+
+static int compare_time(const void * a, const void * b) {
+    sbpd_time_t x = *(const sbpd_time_t *)a, y = *(const sbpd_time_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char * name, sbpd_time_t * values, int count) {
+    sbpd_time_t sum = 0;
+    for (int cnt = 0; cnt < count; cnt++)
+        sum += values[cnt];
+    qsort(values, count, sizeof(*values), compare_time);
+    printf("%-8s %6d events  avg %6.1f us  p50 %5llu us  p99 %5llu us  max %5llu us\n",
+           name, count, (double)sum / count,
+           (unsigned long long)values[count / 2], (unsigned long long)values[count * 99 / 100],
+           (unsigned long long)values[count - 1]);
+}
+
+//
+//  Network process: run the event loop like sbpd does until all events are in
+//
+static void consume(int events) {
+    while (received < 2 * events) {
+        run_loop(privsep_prepare() ? 0 : SCD_SLEEP_TIMEOUT);
+        privsep_poll(bench_sink);
+    }
+    report("paced", latencies, events);
+    report("burst", latencies + events, events);
+    fflush(stdout);
+}
+
+int main(int argc, char * argv[]) {
+    int events = (argc > 1) ? atoi(argv[1]) : 2000;
+    if ((events < 1) || (2 * events > max_events))
+        events = 2000;
+    if (init_privsep())
+        return 1;
+    sbpd_process_t role = start_privsep(NULL);
+    if (role == SBPD_proc_error)
+        return 1;
+    if (role == SBPD_proc_network) {
+        consume(events);
+        pause();                // until stop_privsep()
+        return 0;
+    }
+    
+    //
+    //  GPIO process
+    //
+    struct sbpd_event event = { .type = SBPD_evt_input, .input = { SBPD_input_button, 4, 0, -1 } };
+    for (int cnt = 0; cnt < events; cnt++) {
+        clock_sleep(PACE);
+        event.time = clock_now();
+        privsep_forward(&event);
+    }
+    for (int cnt = 0; cnt < events; cnt++) {
+        if (!(cnt % (input_ring_size / 2)))
+            clock_sleep(PACE);  // let the consumer catch up, nothing is dropped
+        event.time = clock_now();
+        privsep_forward(&event);
+    }
+    clock_sleep(SCD_SECOND);
+    stop_privsep();
+    return 0;
+}
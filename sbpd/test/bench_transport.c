@@ -0,0 +1,157 @@
+//
+//  bench_transport.c
+//  SqueezeButtonPi
+//
+//  Transport benchmark: CLI pipelining and HTTP JSON-RPC
+//  Sends volume commands straight through the transports, without the
+//  dispatcher and its rate limits, to local stand-in servers. One command
+//  in flight, then several. Prints wall time and sbpd CPU time (main thread,
+//  the stand-ins run on their own threads) per command.
+//  test/bench_transport_curl is the same with the libcurl HTTP client,
+//  the maximum RSS at the end compares the two builds.
+//  
+//      make bench, or test/bench_transport [commands]
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#define _GNU_SOURCE             // RUSAGE_THREAD
+#include "testing.h"
+#include "timing.h"
+#include "eventloop.h"
+#include "clicomm.h"
+#include "httpclient.h"
+#include "servercomm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#define MAC             "00:04:20:00:00:01"
+#define FRAGMENT        "[\"mixer\",\"volume\",\"+1\"]"
+
+static struct sbpd_server server;
+static char arguments[max_cli_arguments];
+static int argumentsLength;
+static char body[256];
+static int bodyLength;
+
+static int remaining = 0;
+static int completed = 0;
+static int failed = 0;
+
+static void send_next(bool cli, int slot) {
+    remaining--;
+    bool sent = (cli) ? cli_command(slot, MAC, arguments, argumentsLength) :
+                        http_post(slot, body, bodyLength);
+    if (!sent) {
+        completed++;
+        failed++;
+    }
+}
+
+static void cli_done(int request, bool success) {
+    completed++;
+    if (!success)
+        failed++;
+    if (remaining > 0)
+        send_next(true, request);
+}
+
+static void http_data(int slot, const char * data, size_t length) {
+}
+
+static void http_done(int slot, int status, int code, bool sent) {
+    completed++;
+    if (code || (status != 200))
+        failed++;
+    if (remaining > 0)
+        send_next(false, slot);
+}
+
+static sbpd_time_t cpu_time() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (sbpd_time_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * SCD_SECOND +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void run(const char * name, bool cli, int commands, int inflight) {
+    completed = 0;
+    failed = 0;
+    remaining = commands;
+    sbpd_time_t start = clock_now();
+    sbpd_time_t cpu = cpu_time();
+    for (int slot = 0; slot < inflight; slot++)
+        send_next(cli, slot);
+    while (completed < commands)
+        run_loop(SCD_SLEEP_TIMEOUT);
+    printf("%-5s %d in flight: %6.1f us/cmd wall, %5.1f us/cmd CPU, %d failed\n",
+           name, inflight, (double)(clock_now() - start) / commands,
+           (double)(cpu_time() - cpu) / commands, failed);
+}
+
+int main(int argc, char * argv[]) {
+    int commands = (argc > 1) ? atoi(argv[1]) : 2000;
+    if (commands < 1)
+        commands = 2000;
+    printf("%s, %d commands per run\n", argv[0], commands);
+    server.host = "127.0.0.1";
+    server.port = start_http_server();
+    server.cli_port = start_cli_server(0);
+    argumentsLength = cli_arguments(FRAGMENT, arguments, sizeof(arguments));
+    bodyLength = snprintf(body, sizeof(body),
+                          "{\"id\":1,\"method\":\"slim.request\",\"params\":[\"%s\",%s]}", MAC, FRAGMENT);
+    
+    init_cli_comm(MAC, cli_done);
+    sbpd_time_t end = clock_now() + 2 * SCD_SECOND;
+    while (!cli_ready() && (clock_now() < end)) {
+        poll_cli_comm(&server);
+        run_loop(10 * SCD_MILLISECOND);
+    }
+    if (init_http(http_data, http_done) || !cli_ready()) {
+        fprintf(stderr, "stand-in servers not reachable\n");
+        return 1;
+    }
+    http_endpoint(server.host, server.port, NULL, NULL);
+    
+    run("CLI", true, commands, 1);
+    run("CLI", true, commands, 8);
+    run("HTTP", false, commands, 1);
+    run("HTTP", false, commands, 8);
+    
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("max RSS %ld kB\n", usage.ru_maxrss);
+    
+    shutdown_cli_comm();
+    shutdown_http();
+    stop_cli_server();
+    stop_http_server();
+    return 0;
+}
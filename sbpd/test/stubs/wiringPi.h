@@ -0,0 +1,17 @@
+//
+//  wiringPi.h
+//  SqueezeButtonPi
+//
+//  The wiringPi definitions the modules under test use, the tests run
+//  without the library and GPIO hardware, see testing.c
+//
+
+#ifndef wiringPi_h
+#define wiringPi_h
+
+#define INT_EDGE_SETUP      0
+#define INT_EDGE_FALLING    1
+#define INT_EDGE_RISING     2
+#define INT_EDGE_BOTH       3
+
+#endif /* wiringPi_h */
@@ -0,0 +1,101 @@
+//
+//  test_alloc.c
+//  SqueezeButtonPi
+//
+//  Pool allocator test
+//  - Blocks keep their contents when they grow, in the pool and on the heap
+//  - Small blocks on the heap once the arena is exhausted
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "testing.h"
+#include "alloc.h"
+
+#include <string.h>
+
+#define max_blocks      (pool_arena_size / pool_min_block)
+
+static void * blocks[max_blocks];
+
+static void fill(unsigned char * ptr, size_t size) {
+    for (size_t cnt = 0; cnt < size; cnt++)
+        ptr[cnt] = (unsigned char)(cnt * 7 + 1);
+}
+
+static bool filled(const unsigned char * ptr, size_t size) {
+    for (size_t cnt = 0; cnt < size; cnt++)
+        if (ptr[cnt] != (unsigned char)(cnt * 7 + 1))
+            return false;
+    return true;
+}
+
+//
+//  Allocate, grow and check the contents
+//
+static void grow(size_t size, size_t newSize) {
+    unsigned char * ptr = pool_malloc(size);
+    CHECK(ptr);
+    fill(ptr, size);
+    ptr = pool_realloc(ptr, newSize);
+    CHECK(ptr && filled(ptr, size));
+    pool_free(ptr);
+}
+
+int main(int argc, char * argv[]) {
+    //
+    //  Pool blocks: in place, into a larger class and after shrinking
+    //
+    grow(20, 30);
+    grow(40, 1000);
+    unsigned char * ptr = pool_malloc(1000);
+    fill(ptr, 1000);
+    ptr = pool_realloc(ptr, 10);
+    ptr = pool_realloc(ptr, 5000);
+    CHECK(ptr && filled(ptr, 10));
+    pool_free(ptr);
+    
+    //
+    //  Larger than any class: on the heap. The second one is mapped by
+    //  malloc(), copying more than it holds faults
+    //
+    grow(100 * 1024, 200 * 1024);
+    grow(256 * 1024, 16 * 1024 * 1024);
+    
+    //
+    //  Exhaust the arena, small blocks fall back to the heap
+    //
+    int count = 0;
+    while (count < max_blocks)
+        blocks[count++] = pool_malloc(pool_min_block);
+    grow(40, 4000);
+    grow(40, 50);
+    for (int cnt = 0; cnt < count; cnt++)
+        pool_free(blocks[cnt]);
+    return test_summary("test_alloc");
+}
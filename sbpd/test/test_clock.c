@@ -0,0 +1,266 @@
+//
+//  test_clock.c
+//  SqueezeButtonPi
+//
+//  Virtual clock test
+//  - The event loop waits on the clock, not in poll()
+//  - Button press retry window
+//  - Discovery cadence and a server switch
+//  Runs in well under a second for almost a minute of virtual time
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "testing.h"
+#include "timing.h"
+#include "eventloop.h"
+#include "events.h"
+#include "discovery.h"
+#include "servercomm.h"
+#include "control.h"
+#include "dispatch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/param.h>
+
+static struct sbpd_clock virtualClock;
+
+static double real_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+//
+//  Event loop: timers fire on virtual time, ready descriptors don't wait
+//
+static int timerCalls = 0;
+static int fdCalls = 0;
+
+static void count_timer(void * context) {
+    timerCalls++;
+}
+
+static void read_pipe(int fd, short revents, void * context) {
+    char c;
+    if (read(fd, &c, 1) == 1)
+        fdCalls++;
+}
+
+static void test_event_loop() {
+    int fds[2];
+    CHECK(!pipe(fds));
+    watch_fd(fds[0], POLLIN, read_pipe, NULL);
+    int timer = create_timer(count_timer, NULL);
+    
+    sbpd_time_t start = clock_now();
+    set_timer(timer, start + 3 * SCD_SECOND);
+    run_loop(10 * SCD_SECOND);
+    CHECK(timerCalls == 1);
+    CHECK(clock_now() - start == 3 * SCD_SECOND);
+    
+    //
+    //  Input is handled right away, time stands still
+    //
+    CHECK(write(fds[1], "x", 1) == 1);
+    run_loop(10 * SCD_SECOND);
+    CHECK(fdCalls == 1);
+    CHECK(clock_now() - start == 3 * SCD_SECOND);
+    
+    run_loop(10 * SCD_SECOND);
+    CHECK(clock_now() - start == 13 * SCD_SECOND);
+    unwatch_fd(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+//
+//  Run the control and comm polling functions in steps of virtual time
+//
+static void run_for(struct sbpd_server * server, sbpd_time_t duration) {
+    sbpd_time_t end = clock_now() + duration;
+    while (clock_now() < end) {
+        poll_comm(server);
+        handle_buttons(server);
+        run_loop(MIN(100 * SCD_MILLISECOND, end - clock_now()));
+    }
+    poll_comm(server);
+    handle_buttons(server);
+}
+
+static int queued() {
+    return queue_stats()[SBPD_priority_transport].queued;
+}
+
+//
+//  A press that finds the queue full is retried for BUTTON_RETRY_TIMEOUT (5 s)
+//  There is no server, commands wait in the offline queue for their time to live
+//  A press that can't be sent at all is dropped right away
+//
+static void test_button_retry() {
+    struct sbpd_server server = { NULL, 0 };
+    CHECK(!setup_button_ctrl("PLAY", 4, 1, NULL));
+    compile_dispatch();
+    compile_actions();
+    
+    //
+    //  No comm yet: not a full queue, the press is not retried
+    //
+    fake_button(4, false);
+    run_for(&server, 100 * SCD_MILLISECOND);
+    CHECK(!init_comm("00:04:20:00:00:01", 0));
+    run_for(&server, 1 * SCD_SECOND);
+    CHECK(queued() == 0);
+    CHECK(send_command(&server, SBPD_target_default, "[\"time\",\"%d\",\"%d\"]") == -1);
+    
+    //
+    //  Pauses live 5 s: the press gets through when they expire
+    //
+    for (int cnt = 0; cnt < max_requests; cnt++)
+        send_command(&server, SBPD_target_default, "[\"pause\"]");
+    CHECK(queued() == max_requests);
+    CHECK(send_command(&server, SBPD_target_default, "[\"pause\"]") == SBPD_request_busy);
+    run_for(&server, 1 * SCD_SECOND);
+    fake_button(4, false);
+    run_for(&server, 3900 * SCD_MILLISECOND);
+    CHECK(queued() == max_requests);
+    run_for(&server, 100 * SCD_MILLISECOND);
+    CHECK(queued() == 1);
+    run_for(&server, 5 * SCD_SECOND);
+    CHECK(queued() == 0);
+    
+    //
+    //  Power commands live 15 s: the press is given up after 5 s
+    //
+    for (int cnt = 0; cnt < max_requests; cnt++)
+        send_command(&server, SBPD_target_default, "[\"power\",\"1\"]");
+    run_for(&server, 1 * SCD_SECOND);
+    fake_button(4, false);
+    run_for(&server, 14 * SCD_SECOND + 100 * SCD_MILLISECOND);
+    CHECK(queued() == 0);
+    run_for(&server, 5 * SCD_SECOND);
+    CHECK(queued() == 0);
+    shutdown_comm();
+}
+
+//
+//  Discovery: the connection table is a file the test writes
+//
+static char connections[64];
+
+static void set_connection(const char * address) {
+    FILE * file = fopen(connections, "w");
+    fprintf(file, "  sl  local_address rem_address   st tx_queue rx_queue tr tm->when retrnsmt   uid  timeout inode\n");
+    if (address)
+        fprintf(file, "   0: 0A00000A:9C40 %s:0D9B 01 00000000:00000000 00:00000000 00000000     0        0 1\n",
+                address);
+    fclose(file);
+}
+
+static uint32_t serverAddress = 0;
+static int serverEvents = 0;
+
+static void server_event(const struct sbpd_event * event, void * context) {
+    serverAddress = event->server.address;
+    serverEvents++;
+}
+
+static void discover_at(sbpd_time_t time, struct sbpd_server * server, sbpd_config_parameters_t * discovered,
+                        int subscriber) {
+    advance_virtual_clock(&virtualClock, time - clock_now());
+    poll_discovery(SBPD_cfg_port, discovered, server);
+    poll_events(subscriber, server_event, NULL);
+}
+
+//
+//  Searched every 500 ms until a server was found, then every 3 s
+//
+static void test_discovery() {
+    strcpy(connections, "/tmp/sbpd-test-tcp-XXXXXX");
+    close(mkstemp(connections));
+    set_discovery_source(connections);
+    int subscriber = subscribe_events(SBPD_evt_server);
+    struct sbpd_server server = { NULL, 9000 };
+    sbpd_config_parameters_t discovered = 0;
+    sbpd_time_t start = clock_now();
+    
+    set_connection(NULL);
+    discover_at(start, &server, &discovered, subscriber);
+    CHECK(!server.host);
+    set_connection("0100007F");
+    discover_at(start + 400 * SCD_MILLISECOND, &server, &discovered, subscriber);
+    CHECK(!server.host && !serverEvents);
+    discover_at(start + 500 * SCD_MILLISECOND, &server, &discovered, subscriber);
+    CHECK(server.host && !strcmp(server.host, "127.0.0.1"));
+    CHECK((serverEvents == 1) && (serverAddress == inet_addr("127.0.0.1")));
+    
+    //
+    //  The search scheduled before the server was found still runs after 500 ms
+    //
+    discover_at(start + 1000 * SCD_MILLISECOND, &server, &discovered, subscriber);
+    CHECK(serverEvents == 1);
+    
+    //
+    //  The player moves to another server
+    //
+    set_connection("0200007F");
+    discover_at(start + 3900 * SCD_MILLISECOND, &server, &discovered, subscriber);
+    CHECK(!strcmp(server.host, "127.0.0.1") && (serverEvents == 1));
+    discover_at(start + 4000 * SCD_MILLISECOND, &server, &discovered, subscriber);
+    CHECK(!strcmp(server.host, "127.0.0.2"));
+    CHECK((serverEvents == 2) && (serverAddress == inet_addr("127.0.0.2")));
+    
+    //
+    //  Same server: no event
+    //
+    discover_at(start + 7000 * SCD_MILLISECOND, &server, &discovered, subscriber);
+    CHECK(serverEvents == 2);
+    unlink(connections);
+    set_discovery_source(NULL);
+}
+
+int main(int argc, char * argv[]) {
+    init_virtual_clock(&virtualClock, 1000 * SCD_SECOND, 1.5E9);
+    set_clock(&virtualClock);
+    double start = real_seconds();
+    sbpd_time_t virtualStart = clock_now();
+    
+    test_event_loop();
+    test_button_retry();
+    test_discovery();
+    
+    printf("%.1f s virtual time in %.3f s\n",
+           (double)(clock_now() - virtualStart) / SCD_SECOND, real_seconds() - start);
+    CHECK(real_seconds() - start < 5);
+    return test_summary("test_clock");
+}
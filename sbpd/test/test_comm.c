@@ -0,0 +1,293 @@
+//
+//  test_comm.c
+//  SqueezeButtonPi
+//
+//  Server communication test against a fake CLI on a real clock
+//  - Macro steps are pipelined, a macro takes one round trip
+//  - A step depending on the previous reply waits for it
+//  - A slow server doesn't block the caller or the event loop
+//  - A server that never replies: deadline, timeout in the control layer,
+//    a superseded volume is cancelled
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "testing.h"
+#include "timing.h"
+#include "eventloop.h"
+#include "events.h"
+#include "servercomm.h"
+#include "clicomm.h"
+#include "control.h"
+#include "players.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REPLY_DELAY     (200 * SCD_MILLISECOND)
+#define MAC             "00:04:20:00:00:01"
+
+static struct sbpd_server server;
+static int subscriber;
+
+//
+//  Command results
+//
+#define max_results     64
+
+static int results = 0;
+static int succeeded = 0;
+static sbpd_time_t lastResult = 0;
+static struct {
+    sbpd_request_t request;
+    int code;
+    sbpd_time_t time;
+} result[max_results];
+
+static void command_event(const struct sbpd_event * event, void * context) {
+    if (results < max_results) {
+        result[results].request = event->command.request;
+        result[results].code = event->command.code;
+        result[results].time = clock_now();
+    }
+    results++;
+    if (event->command.success)
+        succeeded++;
+    lastResult = clock_now();
+}
+
+//
+//  Run the comm polling and the event loop until enough results are in
+//
+static void run_until(int count, sbpd_time_t timeout) {
+    sbpd_time_t end = clock_now() + timeout;
+    while ((results < count) && (clock_now() < end)) {
+        poll_comm(&server);
+        run_loop(10 * SCD_MILLISECOND);
+        poll_events(subscriber, command_event, NULL);
+    }
+}
+
+static void reset_results() {
+    results = 0;
+    succeeded = 0;
+}
+
+static void connect_cli() {
+    sbpd_time_t end = clock_now() + 2 * SCD_SECOND;
+    while (!cli_ready() && (clock_now() < end)) {
+        poll_comm(&server);
+        run_loop(10 * SCD_MILLISECOND);
+    }
+    CHECK(cli_ready());
+}
+
+//
+//  Three steps go out back to back, all replies are in after one delay
+//
+static void test_pipelined_macro() {
+    char * steps[] = { "[\"power\",\"1\"]", "[\"mixer\",\"volume\",\"30\"]", "[\"play\"]" };
+    sbpd_time_t arrived[8];
+    int before = cli_server_lines(arrived, 8);
+    reset_results();
+    sbpd_time_t start = clock_now();
+    CHECK(send_commands(&server, SBPD_target_default, steps, 0, 3) >= 0);
+    run_until(3, 2 * SCD_SECOND);
+    CHECK((results == 3) && (succeeded == 3));
+    CHECK(cli_server_lines(arrived, 8) == before + 3);
+    CHECK(arrived[before + 2] - start < REPLY_DELAY / 2);
+    CHECK(lastResult - start < REPLY_DELAY + REPLY_DELAY / 2);
+}
+
+//
+//  "&": the third step waits for the second reply, two round trips
+//
+static void test_dependent_step() {
+    char * steps[] = { "[\"power\",\"1\"]", "[\"mixer\",\"volume\",\"30\"]", "[\"play\"]" };
+    sbpd_time_t arrived[8];
+    int before = cli_server_lines(arrived, 8);
+    reset_results();
+    sbpd_time_t start = clock_now();
+    CHECK(send_commands(&server, SBPD_target_default, steps, 1 << 2, 3) >= 0);
+    run_until(3, 2 * SCD_SECOND);
+    CHECK((results == 3) && (succeeded == 3));
+    CHECK(cli_server_lines(arrived, 8) == before + 3);
+    CHECK(arrived[before + 1] - start < REPLY_DELAY / 2);
+    CHECK(arrived[before + 2] - start >= REPLY_DELAY);
+    CHECK(lastResult - start >= 2 * REPLY_DELAY);
+    CHECK(lastResult - start < 3 * REPLY_DELAY);
+}
+
+//
+//  Slow server: sending returns at once, the event loop keeps running
+//  timers while the reply is outstanding
+//
+#define SLOW_DELAY      (1 * SCD_SECOND)
+#define TICK            (10 * SCD_MILLISECOND)
+
+static int ticks = 0;
+static int ticker = -1;
+
+static void tick(void * context) {
+    ticks++;
+    set_timer(ticker, clock_now() + TICK);
+}
+
+static void test_slow_server() {
+    set_cli_server_delay(SLOW_DELAY);
+    ticker = create_timer(tick, NULL);
+    set_timer(ticker, clock_now() + TICK);
+    reset_results();
+    
+    sbpd_time_t start = clock_now();
+    CHECK(send_command(&server, SBPD_target_default, "[\"pause\"]") >= 0);
+    CHECK(clock_now() - start < 5 * SCD_MILLISECOND);
+    int before = ticks;
+    run_until(1, 3 * SCD_SECOND);
+    CHECK((results == 1) && (succeeded == 1));
+    CHECK(lastResult - start >= SLOW_DELAY);
+    CHECK(ticks - before >= SLOW_DELAY / TICK / 2);
+    
+    set_timer(ticker, 0);
+    set_cli_server_delay(REPLY_DELAY);
+}
+
+//
+//  Blackhole: the server takes commands and never answers
+//  An absolute volume encoder reads the volume over HTTP, its changes go
+//  over the CLI and are never answered
+//
+#define ENCODER_PIN     5
+
+static void run_controls(sbpd_time_t duration) {
+    sbpd_time_t end = clock_now() + duration;
+    while (clock_now() < end) {
+        poll_comm(&server);
+        handle_encoders(&server);
+        run_loop(10 * SCD_MILLISECOND);
+        poll_events(subscriber, command_event, NULL);
+    }
+}
+
+//
+//  Group target: a volume change goes to all three players, the handle
+//  stands for all of them. A macro goes to the group's player only.
+//
+static void test_group() {
+    set_http_server_result("{\"_sync\":\"00:04:20:00:00:02,00:04:20:00:00:03,00:04:20:00:00:04\"}");
+    sbpd_target_t group = add_target("@00:04:20:00:00:02");
+    CHECK(group >= 0);
+    reset_results();
+    poll_players(&server);
+    run_until(1, 2 * SCD_SECOND);
+    int players[max_players];
+    CHECK(target_players(group, players) == 3);
+    
+    sbpd_time_t arrived[8];
+    int before = cli_server_lines(arrived, 8);
+    reset_results();
+    sbpd_request_t request = send_command(&server, group, "[\"mixer\",\"volume\",\"+2\"]");
+    CHECK(request >= 0);
+    CHECK(cancel_command(request));
+    CHECK((results == 0) || (results == 3));
+    run_until(4, REPLY_DELAY + REPLY_DELAY / 2);
+    CHECK((results == 3) && (succeeded == 0));
+    for (int cnt = 0; cnt < 3; cnt++)
+        CHECK(result[cnt].code == SBPD_result_cancelled);
+    CHECK(!command_waiting(request));
+    CHECK(!cancel_command(request));
+    CHECK(cli_server_lines(arrived, 8) == before + 3);
+    
+    char * steps[] = { "[\"power\",\"1\"]", "[\"mixer\",\"volume\",\"30\"]" };
+    reset_results();
+    CHECK(send_commands(&server, group, steps, 0, 2) >= 0);
+    run_until(2, 2 * SCD_SECOND);
+    CHECK((results == 2) && (succeeded == 2));
+    CHECK(cli_server_lines(arrived, 8) == before + 5);
+}
+
+static void test_blackhole() {
+    set_http_server_result("{\"_volume\":\"30\"}");
+    set_cli_server_delay(CLI_SILENT);
+    reset_results();
+    int queries = http_server_requests_served();
+    
+    //
+    //  The first movement reads the volume, then 32 goes out
+    //
+    fake_encoder(ENCODER_PIN, 2);
+    run_controls(100 * SCD_MILLISECOND);
+    CHECK(http_server_requests_served() == queries + 1);
+    CHECK((results == 1) && (succeeded == 1));
+    
+    //
+    //  35 supersedes 32 after 250 ms: 32 is cancelled, 35 sent
+    //
+    sbpd_time_t start = clock_now();
+    fake_encoder(ENCODER_PIN, 3);
+    run_controls(300 * SCD_MILLISECOND);
+    CHECK(results == 2);
+    CHECK(result[1].code == SBPD_result_cancelled);
+    CHECK(!cancel_command(result[1].request));
+    CHECK(!command_waiting(result[1].request));
+    
+    //
+    //  No reply to 35 within the command deadline: it times out, the control
+    //  layer forgets the volume and reads it again
+    //
+    run_controls(SBPD_COMMAND_TIMEOUT * SCD_MILLISECOND);
+    CHECK(results == 4);
+    CHECK(result[2].code == SBPD_result_timeout);
+    CHECK(result[2].request != result[1].request);
+    CHECK(result[2].time - start >= SBPD_COMMAND_TIMEOUT * SCD_MILLISECOND);
+    CHECK(http_server_requests_served() == queries + 2);
+    CHECK(result[3].code == 200);
+    CHECK(!cli_ready());
+}
+
+int main(int argc, char * argv[]) {
+    server.host = "127.0.0.1";
+    server.port = start_http_server();
+    server.cli_port = start_cli_server(REPLY_DELAY);
+    subscriber = subscribe_events(SBPD_evt_command);
+    CHECK(!setup_encoder_ctrl("VOLA", ENCODER_PIN, ENCODER_PIN + 1, 0, NULL));
+    CHECK(!init_comm(MAC, 0));
+    connect_cli();
+    
+    test_pipelined_macro();
+    test_dependent_step();
+    test_slow_server();
+    test_group();
+    test_blackhole();
+    
+    shutdown_comm();
+    stop_cli_server();
+    stop_http_server();
+    return test_summary("test_comm");
+}
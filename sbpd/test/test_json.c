@@ -0,0 +1,110 @@
+//
+//  test_json.c
+//  SqueezeButtonPi
+//
+//  Reply parser test
+//  - Accepted replies, "error" members, null errors
+//  - Fields out of the result, replies split anywhere
+//  - A status reply split at every position
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "testing.h"
+#include "jsonparse.h"
+
+#include <string.h>
+
+//
+//  Parse a reply in chunks of the given size
+//
+static bool parse(const char * reply, size_t chunk, struct sbpd_json_field * fields, int count) {
+    struct sbpd_json_parser parser;
+    json_begin(&parser, fields, count);
+    size_t length = strlen(reply);
+    for (size_t offset = 0; offset < length; offset += chunk)
+        json_feed(&parser, reply + offset, (length - offset < chunk) ? length - offset : chunk);
+    return json_end(&parser);
+}
+
+//
+//  Status reply in two chunks, split at every position
+//  Fields of the nested playlist are not taken for the result's
+//
+static void test_status_reply() {
+    long power, volume;
+    char mode[8], name[16];
+    struct sbpd_json_field fields[] = {
+        { "_power", SBPD_json_int, &power, sizeof(power) },
+        { "_mode", SBPD_json_string, mode, sizeof(mode) },
+        { "_volume", SBPD_json_int, &volume, sizeof(volume) },
+        { "player_name", SBPD_json_string, name, sizeof(name) }
+    };
+    size_t length = strlen(statusReply);
+    int failed = 0;
+    for (size_t split = 0; split <= length; split++) {
+        struct sbpd_json_parser parser;
+        power = volume = 0;
+        mode[0] = name[0] = 0;
+        json_begin(&parser, fields, 4);
+        json_feed(&parser, statusReply, split);
+        json_feed(&parser, statusReply + split, length - split);
+        if (!json_end(&parser) || !fields[0].found || !fields[1].found || !fields[2].found ||
+            !fields[3].found || (power != 1) || strcmp(mode, "play") || (volume != 30) ||
+            strcmp(name, "K?che"))      // non-ASCII characters become '?'
+            failed++;
+    }
+    CHECK(length == 825);
+    CHECK(failed == 0);
+}
+
+int main(int argc, char * argv[]) {
+    CHECK(parse("{\"id\":1,\"result\":{}}", 100, NULL, 0));
+    CHECK(!parse("{\"id\":1,\"result\":{}", 100, NULL, 0));
+    CHECK(!parse("{\"id\":1,\"error\":{\"code\":-32601,\"message\":\"no\"}}", 100, NULL, 0));
+    CHECK(!parse("{\"id\":1,\"error\":\"failed\"}", 100, NULL, 0));
+    CHECK(!parse("{\"id\":1,\"error\":0}", 100, NULL, 0));
+    
+    //
+    //  A null error is no error, also when split right before the null
+    //
+    CHECK(parse("{\"id\":1,\"result\":{},\"error\":null}", 100, NULL, 0));
+    CHECK(parse("{\"id\":1,\"error\": null,\"result\":{}}", 1, NULL, 0));
+    CHECK(!parse("{\"id\":1,\"error\":null,\"error\":{}}", 100, NULL, 0));
+    
+    long volume = 0;
+    struct sbpd_json_field fields[] = {
+        { "_volume", SBPD_json_int, &volume, sizeof(volume) }
+    };
+    CHECK(parse("{\"id\":1,\"error\":null,\"result\":{\"_volume\":\"-30\"}}", 3, fields, 1));
+    CHECK(fields[0].found && (volume == -30));
+    CHECK(parse("{\"id\":1,\"result\":{\"other\":{\"_volume\":5}}}", 7, fields, 1));
+    CHECK(!fields[0].found);
+    test_status_reply();
+    return test_summary("test_json");
+}
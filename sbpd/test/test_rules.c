@@ -0,0 +1,73 @@
+//
+//  test_rules.c
+//  SqueezeButtonPi
+//
+//  Rule file test
+//  - Malformed pins and modifiers are skipped like unknown gestures
+//  - Valid rules still load and dispatch
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "testing.h"
+#include "dispatch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char * rules =
+    "# pin gesture modifier command\n"
+    "17 press - PLAY\n"
+    "18 press 27 NEXT\n"
+    "17x press - PREV\n"
+    "64 press - PREV\n"
+    "-1 press - PREV\n"
+    "19 press 27x PREV\n"
+    "19 press 99 PREV\n"
+    "19 press 4294967313 PREV\n"
+    "19 swipe - PREV\n";
+
+int main(int argc, char * argv[]) {
+    char path[] = "/tmp/sbpd_rulesXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    CHECK(write(fd, rules, strlen(rules)) == (ssize_t)strlen(rules));
+    close(fd);
+    
+    CHECK(load_rules(path) == 2);
+    unlink(path);
+    compile_dispatch();
+    CHECK(dispatch(17, SBPD_gesture_press, 0) != NULL);
+    CHECK(number_of_modifiers() == 1);
+    CHECK(modifier_pin(1) == 27);
+    CHECK(dispatch(18, SBPD_gesture_press, 1) != NULL);
+    CHECK(dispatch(19, SBPD_gesture_press, 0) == NULL);
+    CHECK(dispatch(1, SBPD_gesture_press, 0) == NULL);
+    return test_summary("test_rules");
+}
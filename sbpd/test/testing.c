@@ -0,0 +1,459 @@
+//
+//  testing.c
+//  SqueezeButtonPi
+//
+//  Test support
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "testing.h"
+#include "timing.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+const char statusReply[] =
+    "{\"id\":1,\"method\":\"slim.request\",\"params\":[\"00:04:20:12:34:56\","
+    "[\"status\",\"-\",\"1\",\"tags:aAdlKt\"]],\"result\":{\"player_name\":\"K\\u00fcche\","
+    "\"player_connected\":1,\"player_ip\":\"192.168.1.23:41230\",\"_power\":\"1\","
+    "\"signalstrength\":0,\"_mode\":\"play\",\"time\":73.412,\"rate\":1,\"duration\":245.573,"
+    "\"can_seek\":1,\"_volume\":\"30\",\"playlist repeat\":0,\"playlist shuffle\":0,"
+    "\"playlist mode\":\"off\",\"seq_no\":0,\"playlist_cur_index\":\"3\",\"playlist_timestamp\":1508412345.12345,"
+    "\"playlist_tracks\":12,\"digital_volume_control\":1,\"remoteMeta\":{\"id\":\"-94420016\","
+    "\"title\":\"Caf\\u00e9 del Mar\",\"artist\":\"Various Artists\"},\"playlist_loop\":[{\"playlist index\":3,"
+    "\"id\":4711,\"title\":\"Ent\\u00e9ndeme\",\"artist\":\"Nils Petter Molv\\u00e6r\","
+    "\"album\":\"Khmer\",\"duration\":245.573,\"tracknum\":\"4\",\"artwork_url\":\"/music/4711/cover.jpg\","
+    "\"_mode\":\"stop\",\"coverid\":\"a1b2c3d4e5f\",\"year\":1997}]}}";
+
+static int checks = 0;
+static int failures = 0;
+static int testLogLevel = -1;
+
+void check_result(bool ok, const char * text, const char * file, int line) {
+    checks++;
+    if (ok)
+        return;
+    failures++;
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, text);
+}
+
+int test_summary(const char * name) {
+    printf("%s: %d checks, %d failed\n", name, checks, failures);
+    return (failures) ? 1 : 0;
+}
+
+void set_test_loglevel(int level) {
+    testLogLevel = level;
+}
+
+int loglevel() {
+    if (testLogLevel < 0) {
+        const char * level = getenv("SBPD_TEST_LOG");
+        testLogLevel = (level) ? atoi(level) : LOG_ERR;
+    }
+    return testLogLevel;
+}
+
+void _mylog(const char * file, int line, int prio, const char * fmt, ...) {
+    if (prio > loglevel())
+        return;
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%10.3f %s:%d ", clock_now() / 1000.0 / SCD_MILLISECOND, file, line);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+//
+//  Fake GPIO
+//
+static struct button buttons[max_buttons];
+static int numberofbuttons = 0;
+static struct encoder encoders[max_encoders];
+static int numberofencoders = 0;
+
+void init_GPIO() {
+}
+
+int start_GPIO_interrupts() {
+    return 0;
+}
+
+struct button * setupbutton(int pin, button_callback_t callback, int edge) {
+    if (numberofbuttons == max_buttons)
+        return NULL;
+    struct button * button = buttons + numberofbuttons++;
+    button->pin = pin;
+    button->value = true;       // pulled up: released
+    button->callback = callback;
+    return button;
+}
+
+struct encoder * setupencoder(int pin_a, int pin_b, rotaryencoder_callback_t callback, int edge) {
+    if (numberofencoders == max_encoders)
+        return NULL;
+    struct encoder * encoder = encoders + numberofencoders++;
+    encoder->pin_a = pin_a;
+    encoder->pin_b = pin_b;
+    encoder->value = 0;
+    encoder->lastEncoded = 0;
+    encoder->callback = callback;
+    return encoder;
+}
+
+void fake_button(int pin, bool value) {
+    for (int cnt = 0; cnt < numberofbuttons; cnt++) {
+        if (buttons[cnt].pin != pin)
+            continue;
+        int change = (buttons[cnt].value == value) ? 0 : (value) ? 1 : -1;
+        buttons[cnt].value = value;
+        buttons[cnt].callback(buttons + cnt, change);
+    }
+}
+
+void fake_encoder(int pin_a, long steps) {
+    for (int cnt = 0; cnt < numberofencoders; cnt++) {
+        if (encoders[cnt].pin_a != pin_a)
+            continue;
+        encoders[cnt].value += steps;
+        encoders[cnt].callback(encoders + cnt, steps);
+    }
+}
+
+int test_listener(bool listening, uint32_t * port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(addr);
+    if ((fd < 0) || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        (listening && listen(fd, 8)) ||
+        getsockname(fd, (struct sockaddr *)&addr, &size)) {
+        perror("test listener");
+        exit(2);
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+//
+//  Stand-in servers answer right away, like a real one
+//
+static void set_nodelay(int fd) {
+    int on = 1;
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+//
+//  Fake server CLI
+//  One connection at a time, replies echo the command line
+//
+#define max_cli_lines   64      // arrival times kept for cli_server_lines()
+#define max_cli_replies 64      // replies outstanding
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int listener;
+    int wakeup[2];              // stop the thread
+    sbpd_time_t delay;
+    int count;                  // lines received
+    sbpd_time_t arrived[max_cli_lines];
+    int head;                   // replies due, oldest first
+    int replies;
+    sbpd_time_t received[max_cli_replies];
+    char lines[max_cli_replies][128];
+} cliServer = { .mutex = PTHREAD_MUTEX_INITIALIZER, .listener = -1 };
+
+static sbpd_time_t real_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sbpd_time_t)ts.tv_sec * SCD_SECOND + ts.tv_nsec / 1000;
+}
+
+static void cli_server_line(const char * line, int length) {
+    sbpd_time_t now = real_now();
+    pthread_mutex_lock(&cliServer.mutex);
+    if (cliServer.count < max_cli_lines)
+        cliServer.arrived[cliServer.count] = now;
+    cliServer.count++;
+    if (cliServer.replies < max_cli_replies) {
+        int slot = (cliServer.head + cliServer.replies++) % max_cli_replies;
+        cliServer.received[slot] = now;
+        snprintf(cliServer.lines[slot], sizeof(cliServer.lines[0]), "%.*s", length, line);
+    }
+    pthread_mutex_unlock(&cliServer.mutex);
+}
+
+static void * cli_server(void * context) {
+    int connection = -1;
+    char in[1024];
+    size_t length = 0;
+    for (;;) {
+        //
+        //  Sleep until the next reply is due, or something comes in
+        //
+        int timeout = -1;
+        pthread_mutex_lock(&cliServer.mutex);
+        if ((cliServer.delay != CLI_SILENT) && cliServer.replies) {
+            sbpd_time_t due = cliServer.received[cliServer.head] + cliServer.delay;
+            sbpd_time_t now = real_now();
+            timeout = (due > now) ? (int)((due - now + SCD_MILLISECOND - 1) / SCD_MILLISECOND) : 0;
+        }
+        pthread_mutex_unlock(&cliServer.mutex);
+        struct pollfd fds[3] = {
+            { cliServer.wakeup[0], POLLIN, 0 },
+            { cliServer.listener, POLLIN, 0 },
+            { connection, POLLIN, 0 }
+        };
+        poll(fds, (connection >= 0) ? 3 : 2, timeout);
+        if (fds[0].revents)
+            break;
+        if (fds[1].revents & POLLIN) {
+            if (connection >= 0)
+                close(connection);
+            connection = accept(cliServer.listener, NULL, NULL);
+            set_nodelay(connection);
+            length = 0;
+        }
+        if ((connection >= 0) && (fds[2].revents & (POLLIN | POLLHUP))) {
+            ssize_t received = read(connection, in + length, sizeof(in) - length);
+            if (received <= 0) {
+                close(connection);
+                connection = -1;
+                continue;
+            }
+            length += received;
+            char * end;
+            while ((end = memchr(in, '\n', length))) {
+                cli_server_line(in, (int)(end - in + 1));
+                length -= end + 1 - in;
+                memmove(in, end + 1, length);
+            }
+        }
+        
+        //
+        //  Replies that are due
+        //
+        pthread_mutex_lock(&cliServer.mutex);
+        while ((cliServer.delay != CLI_SILENT) && cliServer.replies &&
+               (real_now() >= cliServer.received[cliServer.head] + cliServer.delay)) {
+            const char * line = cliServer.lines[cliServer.head];
+            if (connection >= 0)
+                (void)!write(connection, line, strlen(line));
+            cliServer.head = (cliServer.head + 1) % max_cli_replies;
+            cliServer.replies--;
+        }
+        pthread_mutex_unlock(&cliServer.mutex);
+    }
+    if (connection >= 0)
+        close(connection);
+    return NULL;
+}
+
+uint32_t start_cli_server(sbpd_time_t delay) {
+    uint32_t port;
+    cliServer.listener = test_listener(true, &port);
+    cliServer.delay = delay;
+    cliServer.count = 0;
+    cliServer.head = 0;
+    cliServer.replies = 0;
+    if (pipe(cliServer.wakeup) || pthread_create(&cliServer.thread, NULL, cli_server, NULL)) {
+        perror("fake CLI");
+        exit(2);
+    }
+    return port;
+}
+
+void set_cli_server_delay(sbpd_time_t delay) {
+    pthread_mutex_lock(&cliServer.mutex);
+    cliServer.delay = delay;
+    pthread_mutex_unlock(&cliServer.mutex);
+}
+
+void stop_cli_server() {
+    if (cliServer.listener < 0)
+        return;
+    (void)!write(cliServer.wakeup[1], "x", 1);
+    pthread_join(cliServer.thread, NULL);
+    close(cliServer.wakeup[0]);
+    close(cliServer.wakeup[1]);
+    close(cliServer.listener);
+    cliServer.listener = -1;
+}
+
+int cli_server_lines(sbpd_time_t * times, int max) {
+    pthread_mutex_lock(&cliServer.mutex);
+    int count = cliServer.count;
+    for (int cnt = 0; (cnt < count) && (cnt < max) && (cnt < max_cli_lines); cnt++)
+        times[cnt] = cliServer.arrived[cnt];
+    pthread_mutex_unlock(&cliServer.mutex);
+    return count;
+}
+
+//
+//  Fake server JSON-RPC
+//  Every POST is answered right away with the same result, pipelined
+//  requests in order. A few connections at a time.
+//
+#define max_http_connections    8
+
+static struct {
+    pthread_t thread;
+    int listener;
+    int wakeup[2];
+    volatile int requests;
+    int length;
+    char reply[512];
+} httpServer = { .listener = -1 };
+
+struct http_connection {
+    int fd;                     // -1: unused
+    size_t length;
+    char in[8192];
+};
+
+//
+//  Answer the complete requests in a connection's buffer
+//  Returns: false if the connection is broken
+//
+static bool http_server_requests(struct http_connection * connection) {
+    for (;;) {
+        connection->in[connection->length] = 0;
+        char * end = strstr(connection->in, "\r\n\r\n");
+        if (!end)
+            return connection->length < sizeof(connection->in) - 1;
+        size_t body = 0;
+        const char * header = strstr(connection->in, "\r\nContent-Length:");
+        if (header && (header < end))
+            body = strtoul(header + 17, NULL, 10);
+        size_t total = end + 4 - connection->in + body;
+        if (total > connection->length)
+            return total < sizeof(connection->in);
+        if (write(connection->fd, httpServer.reply, httpServer.length) != httpServer.length)
+            return false;
+        __atomic_add_fetch(&httpServer.requests, 1, __ATOMIC_RELAXED);
+        connection->length -= total;
+        memmove(connection->in, connection->in + total, connection->length);
+    }
+}
+
+static void * http_server(void * context) {
+    static struct http_connection connections[max_http_connections];
+    for (int cnt = 0; cnt < max_http_connections; cnt++)
+        connections[cnt].fd = -1;
+    for (;;) {
+        struct pollfd fds[max_http_connections + 2] = {
+            { httpServer.wakeup[0], POLLIN, 0 },
+            { httpServer.listener, POLLIN, 0 }
+        };
+        for (int cnt = 0; cnt < max_http_connections; cnt++)
+            fds[cnt + 2] = (struct pollfd) { connections[cnt].fd, POLLIN, 0 };
+        poll(fds, max_http_connections + 2, -1);
+        if (fds[0].revents)
+            break;
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(httpServer.listener, NULL, NULL);
+            set_nodelay(fd);
+            int cnt = 0;
+            while ((cnt < max_http_connections) && (connections[cnt].fd >= 0))
+                cnt++;
+            if (cnt < max_http_connections) {
+                connections[cnt].fd = fd;
+                connections[cnt].length = 0;
+            } else
+                close(fd);
+        }
+        for (int cnt = 0; cnt < max_http_connections; cnt++) {
+            struct http_connection * connection = connections + cnt;
+            if ((connection->fd < 0) || !(fds[cnt + 2].revents & (POLLIN | POLLHUP)))
+                continue;
+            ssize_t received = read(connection->fd, connection->in + connection->length,
+                                    sizeof(connection->in) - 1 - connection->length);
+            if (received > 0) {
+                connection->length += received;
+                if (http_server_requests(connection))
+                    continue;
+            }
+            close(connection->fd);
+            connection->fd = -1;
+        }
+    }
+    for (int cnt = 0; cnt < max_http_connections; cnt++)
+        if (connections[cnt].fd >= 0)
+            close(connections[cnt].fd);
+    return NULL;
+}
+
+void set_http_server_result(const char * result) {
+    char body[256];
+    int length = snprintf(body, sizeof(body), "{\"id\":1,\"result\":%s}", result);
+    httpServer.length = snprintf(httpServer.reply, sizeof(httpServer.reply),
+                                 "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                                 "Content-Length: %d\r\n\r\n%s", length, body);
+}
+
+uint32_t start_http_server() {
+    uint32_t port;
+    httpServer.listener = test_listener(true, &port);
+    httpServer.requests = 0;
+    set_http_server_result("{}");
+    if (pipe(httpServer.wakeup) || pthread_create(&httpServer.thread, NULL, http_server, NULL)) {
+        perror("fake JSON-RPC");
+        exit(2);
+    }
+    return port;
+}
+
+void stop_http_server() {
+    if (httpServer.listener < 0)
+        return;
+    (void)!write(httpServer.wakeup[1], "x", 1);
+    pthread_join(httpServer.thread, NULL);
+    close(httpServer.wakeup[0]);
+    close(httpServer.wakeup[1]);
+    close(httpServer.listener);
+    httpServer.listener = -1;
+}
+
+int http_server_requests_served() {
+    return __atomic_load_n(&httpServer.requests, __ATOMIC_RELAXED);
+}
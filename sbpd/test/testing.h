@@ -0,0 +1,119 @@
+//
+//  testing.h
+//  SqueezeButtonPi
+//
+//  Test support
+//  - Checks, counted and reported at the end
+//  - Log output for the modules under test
+//  - Fake GPIO: inputs are injected by the test
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef testing_h
+#define testing_h
+
+#include "sbpd.h"
+#include "GPIO.h"
+#include "timing.h"
+
+//
+//  Checks
+//  A failed check is reported with its location, the test goes on
+//
+#define CHECK(condition) check_result((condition), #condition, __FILE__, __LINE__)
+void check_result(bool ok, const char * text, const char * file, int line);
+
+//
+//  Report the result
+//  Returns: exit code, 0 if all checks passed
+//
+int test_summary(const char * name);
+
+//
+//  Log level of the modules under test, LOG_ERR by default
+//  SBPD_TEST_LOG=7 in the environment shows everything
+//
+void set_test_loglevel(int level);
+
+//
+//  An LMS "status" reply, 825 bytes: "_power", "_mode" and "_volume" in
+//  the result, strings with \u escapes, a nested "playlist_loop"
+//
+extern const char statusReply[];
+
+//
+//  Fake GPIO
+//  setupbutton() and setupencoder() register controls without hardware,
+//  the test moves them. Callbacks run on the calling thread.
+//
+void fake_button(int pin, bool value);
+void fake_encoder(int pin_a, long steps);
+
+//
+//  Local TCP listener on 127.0.0.1, any free port
+//  Parameters:
+//      listening: false for a port that refuses connections
+//  Returns: the socket, port receives the port number
+//
+int test_listener(bool listening, uint32_t * port);
+
+//
+//  Fake server CLI on its own thread, with the real clock
+//  Every command line is answered after a delay, or never
+//  Parameters:
+//      delay: reply delay in us, CLI_SILENT: accept commands but never reply
+//  Returns: the port
+//
+//  set_cli_server_delay(): change the delay, for commands still to come
+//
+#define CLI_SILENT  ((sbpd_time_t)-1)
+uint32_t start_cli_server(sbpd_time_t delay);
+void set_cli_server_delay(sbpd_time_t delay);
+void stop_cli_server();
+
+//
+//  Command lines the fake CLI received so far, oldest first
+//  Parameters:
+//      times: arrival times (real clock) of the lines, max entries
+//  Returns: number of lines
+//
+int cli_server_lines(sbpd_time_t * times, int max);
+
+//
+//  Fake server JSON-RPC on its own thread
+//  Every POST to any path gets an empty result right away
+//  Returns: the port
+//  set_http_server_result(): the result object for replies from now on
+//
+uint32_t start_http_server();
+void set_http_server_result(const char * result);
+void stop_http_server();
+int http_server_requests_served();
+
+#endif /* testing_h */
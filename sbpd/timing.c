@@ -0,0 +1,132 @@
+//
+//  timing.c
+//  SqueezeButtonPi
+//
+//  Monotonic clock used for all timing decisions
+//  - Real clock based on CLOCK_MONOTONIC
+//  - Virtual clock advanced manually for deterministic testing
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "timing.h"
+#include "sbpd.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+//
+//  Real clock
+//
+static sbpd_time_t real_now(struct sbpd_clock * clock) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sbpd_time_t)ts.tv_sec * SCD_SECOND + ts.tv_nsec / 1000;
+}
+
+static void real_sleep(struct sbpd_clock * clock, sbpd_time_t usec) {
+    usleep((useconds_t)usec);
+}
+
+static double real_wall(struct sbpd_clock * clock) {
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec * 1E-6;
+}
+
+static struct sbpd_clock real_clock = {
+    .now = real_now,
+    .sleep = real_sleep,
+    .wall = real_wall,
+};
+
+//
+//  The active clock
+//
+static struct sbpd_clock * active_clock = &real_clock;
+
+//
+//  Select the clock to be used
+//
+void set_clock(struct sbpd_clock * clock) {
+    active_clock = (clock) ? clock : &real_clock;
+}
+
+sbpd_time_t clock_now() {
+    return active_clock->now(active_clock);
+}
+
+void clock_sleep(sbpd_time_t usec) {
+    active_clock->sleep(active_clock, usec);
+}
+
+double clock_wall() {
+    return active_clock->wall(active_clock);
+}
+
+//
+//  Time since system boot
+//
+double time_since_boot() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+//
+//  Virtual clock
+//  Time is read and advanced atomically: GPIO callbacks run on their own threads
+//
+static sbpd_time_t virtual_now(struct sbpd_clock * clock) {
+    return __atomic_load_n(&clock->virtual_now, __ATOMIC_ACQUIRE);
+}
+
+static void virtual_sleep(struct sbpd_clock * clock, sbpd_time_t usec) {
+    advance_virtual_clock(clock, usec);
+}
+
+static double virtual_wall(struct sbpd_clock * clock) {
+    return clock->virtual_epoch + (double)virtual_now(clock) / SCD_SECOND;
+}
+
+void init_virtual_clock(struct sbpd_clock * clock, sbpd_time_t start, double epoch) {
+    clock->now = virtual_now;
+    clock->sleep = virtual_sleep;
+    clock->wall = virtual_wall;
+    clock->virtual_now = start;
+    clock->virtual_epoch = epoch;
+}
+
+bool clock_is_virtual() {
+    return active_clock->sleep == virtual_sleep;
+}
+
+void advance_virtual_clock(struct sbpd_clock * clock, sbpd_time_t usec) {
+    __atomic_add_fetch(&clock->virtual_now, usec, __ATOMIC_RELEASE);
+}
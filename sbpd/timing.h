@@ -0,0 +1,120 @@
+//
+//  timing.h
+//  SqueezeButtonPi
+//
+//  Monotonic clock used for all timing decisions
+//  Can be replaced by a virtual clock for deterministic testing
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef timing_h
+#define timing_h
+
+#include "sbpd.h"
+
+//
+//  Time in µs, monotonic. Same unit as SCD_SLEEP_TIMEOUT and SCD_SECOND
+//
+typedef uint64_t sbpd_time_t;
+
+#define SCD_MILLISECOND     1000
+
+//
+//  Clock interface
+//  Every timing decision (scheduling, discovery cadence, log timestamps)
+//  goes through the active clock.
+//      now:   monotonic time in µs
+//      sleep: wait for the given number of µs
+//      wall:  wall clock time in seconds, used for log output
+//
+struct sbpd_clock {
+    sbpd_time_t (*now)(struct sbpd_clock * clock);
+    void (*sleep)(struct sbpd_clock * clock, sbpd_time_t usec);
+    double (*wall)(struct sbpd_clock * clock);
+    //
+    //  virtual clock state, unused by the real clock
+    //
+    volatile sbpd_time_t virtual_now;
+    double virtual_epoch;
+};
+
+//
+//  Select the clock to be used
+//  Parameters:
+//      clock: the clock, NULL selects the real (system) clock
+//
+void set_clock(struct sbpd_clock * clock);
+
+//
+//  Current monotonic time in µs
+//
+sbpd_time_t clock_now();
+
+//
+//  Wait for usec µs
+//  With a virtual clock this just advances the clock and returns immediately
+//
+void clock_sleep(sbpd_time_t usec);
+
+//
+//  Wall clock time in seconds
+//
+double clock_wall();
+
+//
+//  Is the active clock a virtual clock?
+//  The event loop doesn't block in poll() then, time passes by sleeping
+//
+bool clock_is_virtual();
+
+//
+//  Time since system boot in seconds
+//  Real time, used for startup reporting only
+//
+double time_since_boot();
+
+//
+//  Virtual clock
+//  Time only moves when advanced manually or by sleeping.
+//  Parameters:
+//      clock: the clock structure to initialize
+//      start: the monotonic start time in µs
+//      epoch: wall clock time in seconds corresponding to monotonic time 0
+//
+void init_virtual_clock(struct sbpd_clock * clock, sbpd_time_t start, double epoch);
+
+//
+//  Advance a virtual clock
+//  Parameters:
+//      clock: the virtual clock
+//      usec: µs to advance
+//
+void advance_virtual_clock(struct sbpd_clock * clock, sbpd_time_t usec);
+
+#endif /* timing_h */